@@ -0,0 +1,465 @@
+/*
+|| AdapterBenchmark
+|| - Measures the PackedSerialThingAdapter hot paths on the board itself, talking to a simulated
+||   gateway over an in-memory LoopbackStream.  Results are printed to Serial.
+||
+|| Measures:
+|| - Service time of each request (onPacketReceive())
+|| - update() cost as the number of things/properties grows
+|| - Frames and bytes sent per change, for each status encoding
+|| - Duty cycle of an idle-aware loop(), and how long it takes to respond once woken
+||
+|| More notes at the bottom.
+*/
+
+// Room for a whole DEFINEALL response in the loopback buffer
+#define LOOPBACKBUFFERSIZE 512
+// Changes are reported with setChanged(), so update() only visits changed properties
+#define THINGCHANGESCAN 0
+// For the SUBSCRIBE benchmark
+#define THINGMAXSUBSCRIPTIONS 4
+
+#include <PackedSerialThingAdapter.h>
+#include <LoopbackStream.h>
+
+#define ITERATIONS 100
+#define PROPERTIESPERTHING 4
+// The duty cycle is measured over DUTYPERIOD ms, with a change every CHANGEINTERVAL ms
+#define DUTYPERIOD 2000
+#define CHANGEINTERVAL 100
+
+const uint8_t thingCounts[] = { 1, 2, 4, 8 };
+
+
+// Counts what the simulated gateway receives.
+class GatewayCounter : public IPacketReceiver
+{
+  public:
+    void onPacketReceive(const uint8_t *, size_t len)
+    {
+      frames++;
+      bytes += len;
+    }
+
+    uint32_t frames;
+    uint32_t bytes;
+};
+
+
+LoopbackStream adapterEnd;
+LoopbackStream gatewayEnd;
+PackedSerial gatewayConn;
+GatewayCounter gateway;
+
+// final, so it can be deleted without a virtual destructor
+class BenchAdapter final : public PackedSerialThingAdapter
+{
+  public:
+    using PackedSerialThingAdapter::PackedSerialThingAdapter;
+};
+
+BenchAdapter *adapter;
+ThingDevice *things[8];
+ThingPropertyNumber *properties[8 * PROPERTIESPERTHING];
+uint8_t thingCount;
+
+// Set when the adapter is woken, by bytes arriving or by the sketch changing a property
+volatile boolean woken;
+uint32_t wokenAt;
+
+
+void drainGateway()
+{
+  gatewayConn.update();
+  gateway.frames = 0;
+  gateway.bytes = 0;
+  adapterEnd.bytesWritten = 0;
+}
+
+
+// Build an adapter with count things of PROPERTIESPERTHING NUMBER properties each, all paired.
+void buildAdapter(uint8_t count)
+{
+  adapter = new BenchAdapter("Bench", "Adapter benchmark");
+  thingCount = count;
+
+  for (uint8_t t = 0; t < count; t++)
+  {
+    things[t] = new ThingDevice("Thing", "Benchmark thing", THING);
+
+    for (uint8_t p = 0; p < PROPERTIESPERTHING; p++)
+    {
+      properties[t * PROPERTIESPERTHING + p] = new ThingPropertyNumber("value", "Benchmark value");
+      things[t]->addProperty(*properties[t * PROPERTIESPERTHING + p]);
+    }
+
+    adapter->addDevice(*things[t]);
+  }
+
+  adapter->begin(adapterEnd);
+
+  for (uint8_t t = 0; t < count; t++)
+  {
+    uint8_t pair[] = { PAIR, t };
+    adapter->onPacketReceive(pair, sizeof(pair));
+  }
+
+  drainGateway();
+}
+
+
+void destroyAdapter()
+{
+  for (uint8_t i = 0; i < thingCount * PROPERTIESPERTHING; i++)
+    delete properties[i];
+
+  for (uint8_t t = 0; t < thingCount; t++)
+    delete things[t];
+
+  delete adapter;
+}
+
+
+void printResult(const __FlashStringHelper *label, uint32_t total, uint32_t worst)
+{
+  Serial.print(label);
+  Serial.print(F(": avg "));
+  Serial.print(total / ITERATIONS);
+  Serial.print(F(" us, max "));
+  Serial.print(worst);
+  Serial.println(F(" us"));
+}
+
+
+// Service time of one request, as seen by onPacketReceive().
+void benchmarkRequest(const __FlashStringHelper *label, const uint8_t *request, size_t len)
+{
+  uint32_t total = 0;
+  uint32_t worst = 0;
+
+  for (uint16_t i = 0; i < ITERATIONS; i++)
+  {
+    uint32_t start = micros();
+    adapter->onPacketReceive(request, len);
+    uint32_t elapsed = micros() - start;
+
+    total += elapsed;
+    if (elapsed > worst)
+      worst = elapsed;
+
+    drainGateway();
+  }
+
+  printResult(label, total, worst);
+}
+
+
+// Cost of update() with changed properties marked before each call.
+void benchmarkUpdate(const __FlashStringHelper *label, uint8_t changes)
+{
+  uint32_t total = 0;
+  uint32_t worst = 0;
+
+  for (uint16_t i = 0; i < ITERATIONS; i++)
+  {
+    for (uint8_t c = 0; c < changes; c++)
+    {
+      properties[c]->setValue(i);
+      adapter->setChanged(*properties[c]);
+    }
+
+    uint32_t start = micros();
+    adapter->update();
+    uint32_t elapsed = micros() - start;
+
+    total += elapsed;
+    if (elapsed > worst)
+      worst = elapsed;
+
+    drainGateway();
+  }
+
+  printResult(label, total, worst);
+}
+
+
+// Frames and bytes the gateway receives for one update() with changes changed properties.
+void benchmarkWire(const __FlashStringHelper *label, uint8_t options, uint8_t changes)
+{
+  uint8_t setOptions[] = { SETOPTIONS, options };
+
+  adapter->onPacketReceive(setOptions, sizeof(setOptions));
+  drainGateway();
+
+  for (uint8_t c = 0; c < changes; c++)
+  {
+    properties[c]->setValue(c);
+    adapter->setChanged(*properties[c]);
+  }
+
+  adapter->update();
+  gatewayConn.update();
+
+  Serial.print(label);
+  Serial.print(F(": "));
+  Serial.print(gateway.frames);
+  Serial.print(F(" frames, "));
+  Serial.print(gateway.bytes);
+  Serial.print(F(" payload bytes, "));
+  Serial.print(adapterEnd.bytesWritten);
+  Serial.println(F(" bytes on the wire"));
+
+  drainGateway();
+}
+
+
+void onWake()
+{
+  if (!woken)
+  {
+    woken = true;
+    wokenAt = micros();
+  }
+}
+
+
+// Share of the time the adapter keeps the board busy.  Polling, update() is called on every
+// pass of loop() and the board never sleeps; busy is the time spent in update().  Sleeping,
+// the sketch wakes for a change, or when millisUntilDue() says something is due, calls update()
+// while hasPendingWork(), and sleeps again; busy is the time from waking to going back to
+// sleep.  delay() stands in for the sleep.
+void benchmarkDutyCycle(const __FlashStringHelper *label, boolean sleeping)
+{
+  uint32_t busy = 0;
+  uint32_t wakes = 0;
+  uint32_t updates = 0;
+  uint32_t start = millis();
+  uint32_t lastChange = start;
+
+  while ((millis() - start) < DUTYPERIOD)
+  {
+    if ((millis() - lastChange) >= CHANGEINTERVAL)
+    {
+      properties[0]->setValue(millis());
+      adapter->setChanged(*properties[0]);
+      lastChange = millis();
+    }
+
+    uint32_t t = micros();
+    if (sleeping)
+    {
+      while (adapter->hasPendingWork())
+      {
+        adapter->update();
+        updates++;
+      }
+    }
+    else
+    {
+      adapter->update();
+      updates++;
+    }
+    busy += micros() - t;
+    wakes++;
+
+    drainGateway();
+
+    if (sleeping)
+    {
+      // Asleep until the next change, or whatever the adapter has waiting on a timer
+      uint32_t elapsed = millis() - lastChange;
+      uint32_t sleepMs = (elapsed < CHANGEINTERVAL) ? CHANGEINTERVAL - elapsed : 0;
+      uint32_t due = adapter->millisUntilDue();
+
+      delay((due < sleepMs) ? due : sleepMs);
+    }
+  }
+
+  // 10 x us per ms is hundredths of a percent
+  uint32_t hundredths = busy * 10 / DUTYPERIOD;
+
+  Serial.print(label);
+  Serial.print(F(": busy "));
+  Serial.print(hundredths / 100);
+  Serial.print('.');
+  Serial.print((hundredths / 10) % 10);
+  Serial.print(hundredths % 10);
+  Serial.print(F(" %, update() "));
+  Serial.print(updates);
+  Serial.print(F(" times"));
+  if (sleeping)
+  {
+    Serial.print(F(", "));
+    Serial.print(wakes);
+    Serial.print(F(" wakes of "));
+    Serial.print(busy / wakes);
+    Serial.print(F(" us"));
+  }
+  Serial.println();
+}
+
+
+// Time from waking to the response arriving at the gateway, for a request (woken by the bytes
+// arriving, as by a serial receive interrupt) or a property change (woken by setWakeHandler()).
+void benchmarkWake(const __FlashStringHelper *label, boolean request)
+{
+  const uint8_t getProperty[] = { GETPROPERTY, 0, 0 };
+  uint32_t total = 0;
+  uint32_t worst = 0;
+
+  for (uint16_t i = 0; i < ITERATIONS; i++)
+  {
+    woken = false;
+
+    if (request)
+    {
+      gatewayConn.send(getProperty, sizeof(getProperty));
+    }
+    else
+    {
+      properties[0]->setValue(i);
+      adapter->setChanged(*properties[0]);
+    }
+
+    // A sketch would be asleep here
+    while (!woken);
+
+    while (gatewayEnd.available() == 0)
+    {
+      if (adapter->hasPendingWork())
+        adapter->update();
+    }
+
+    uint32_t elapsed = micros() - wokenAt;
+
+    total += elapsed;
+    if (elapsed > worst)
+      worst = elapsed;
+
+    drainGateway();
+  }
+
+  printResult(label, total, worst);
+}
+
+
+void setup()
+{
+  Serial.begin(115200);
+  #if ARDUINO >= 100
+  while (!Serial);
+  #endif
+
+  adapterEnd.connect(gatewayEnd);
+  gatewayConn.setStream(gatewayEnd);
+  gatewayConn.setPacketReceiver(&gateway);
+
+  Serial.println(F("== Request service time (2 things)"));
+  buildAdapter(2);
+  {
+    const uint8_t defineAdapter[] = { DEFINEADAPTER };
+    const uint8_t defineThing[] = { DEFINETHINGBYIDX, 1 };
+    const uint8_t defineProperty[] = { DEFINEPROPERTYBYIDX, 1, 2 };
+    const uint8_t setProperty[] = { SETPROPERTY, 1, 2, 0x00, 0x00, 0x01, 0x00 };
+    const uint8_t getProperty[] = { GETPROPERTY, 1, 2 };
+    const uint8_t setOptions[] = { SETOPTIONS, 0 };
+    const uint8_t defineBitrates[] = { DEFINEBITRATES };
+    const uint8_t defineAll[] = { DEFINEALL };
+    const uint8_t subscribe[] = { SUBSCRIBE, 1, 2, 0x00, 0x64, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+    const uint8_t getSnapshot[] = { GETSNAPSHOT, 1, 0x00, 0x00 };
+    const uint8_t getAllSnapshot[] = { GETSNAPSHOT, 0xff, 0x00, 0x00 };
+    const uint8_t pair[] = { PAIR, 1 };
+    const uint8_t unpair[] = { UNPAIR, 0 };
+    const uint8_t badThing[] = { GETPROPERTY, 200, 0 };
+
+    benchmarkRequest(F("DEFINEADAPTER"), defineAdapter, sizeof(defineAdapter));
+    benchmarkRequest(F("DEFINETHINGBYIDX"), defineThing, sizeof(defineThing));
+    benchmarkRequest(F("DEFINEPROPERTYBYIDX"), defineProperty, sizeof(defineProperty));
+    benchmarkRequest(F("SETPROPERTY"), setProperty, sizeof(setProperty));
+    benchmarkRequest(F("GETPROPERTY"), getProperty, sizeof(getProperty));
+    benchmarkRequest(F("SETOPTIONS"), setOptions, sizeof(setOptions));
+    benchmarkRequest(F("DEFINEBITRATES"), defineBitrates, sizeof(defineBitrates));
+    benchmarkRequest(F("DEFINEALL"), defineAll, sizeof(defineAll));
+    benchmarkRequest(F("SUBSCRIBE"), subscribe, sizeof(subscribe));
+    benchmarkRequest(F("GETSNAPSHOT"), getSnapshot, sizeof(getSnapshot));
+    benchmarkRequest(F("GETSNAPSHOT (every thing)"), getAllSnapshot, sizeof(getAllSnapshot));
+    benchmarkRequest(F("PAIR"), pair, sizeof(pair));
+    benchmarkRequest(F("UNPAIR"), unpair, sizeof(unpair));
+    benchmarkRequest(F("ERROR (thingIdx out of range)"), badThing, sizeof(badThing));
+  }
+  destroyAdapter();
+
+  for (uint8_t i = 0; i < sizeof(thingCounts); i++)
+  {
+    Serial.print(F("== update() with "));
+    Serial.print(thingCounts[i] * PROPERTIESPERTHING);
+    Serial.println(F(" properties"));
+
+    buildAdapter(thingCounts[i]);
+    benchmarkUpdate(F("idle"), 0);
+    benchmarkUpdate(F("1 change"), 1);
+    benchmarkUpdate(F("all changed"), thingCounts[i] * PROPERTIESPERTHING);
+    destroyAdapter();
+  }
+
+  Serial.println(F("== Wire cost of 8 changes"));
+  buildAdapter(2);
+  benchmarkWire(F("PROPERTYSTATUS"), 0, 8);
+  benchmarkWire(F("PROPERTYSTATUSBATCH"), OPTION_BATCHSTATUS, 8);
+  benchmarkWire(F("PROPERTYSTATUSBATCH, compact delta"), OPTION_BATCHSTATUS | OPTION_COMPACTNUMBER | OPTION_DELTANUMBER, 8);
+  destroyAdapter();
+
+  Serial.println(F("== Idle (32 properties, one change every 100 ms)"));
+  buildAdapter(8);
+  benchmarkDutyCycle(F("polling, update() every pass"), false);
+  benchmarkDutyCycle(F("sleeping, update() on hasPendingWork()"), true);
+
+  adapterEnd.setReceiveHandler(onWake);
+  adapter->setWakeHandler(onWake);
+  benchmarkWake(F("wake to response, GETPROPERTY"), true);
+  benchmarkWake(F("wake to status, setChanged()"), false);
+  adapterEnd.setReceiveHandler(nullptr);
+  destroyAdapter();
+
+  Serial.println(F("== Done"));
+}
+
+void loop()
+{
+}
+
+/*
+||
+|| @author         Brett Hagman <bhagman@roguerobotics.com>
+|| @url            http://roguerobotics.com/
+|| @url            http://oryng.org/
+||
+|| @description
+|| | Measures the PackedSerialThingAdapter hot paths on the board itself.  The adapter talks to
+|| | a simulated gateway over a LoopbackStream, so Serial is free for printing the results.
+|| | Run it before and after a change to the adapter to catch performance regressions.
+|| #
+||
+|| @notes
+|| |
+|| | Times are in microseconds, and limited by the resolution of micros() (4 us on 16 MHz AVR).
+|| | Building 8 things uses around 1.5 KB of heap; trim thingCounts on small AVR boards.
+|| | The duty cycle is the time spent in the adapter over the whole period.  Polling, that is
+|| | update() alone, but the board never sleeps.  Sleeping, it is each wake from start to end,
+|| | hasPendingWork() included, with the sleeps in between (delay() here) left out; on a real
+|| | board, that is the share of time spent out of sleep mode.  Wake latency runs from the first
+|| | byte of a request reaching the adapter (or from setChanged()) to the response reaching
+|| | the gateway.
+|| |
+|| | It also builds as a host program, with the rest of the examples, in extras/host (see the
+|| | notes in PackedSerialThingAdapter.h).  Host times say little about a board's, but are
+|| | steady enough to compare one change with the next.
+|| #
+||
+|| @todo
+|| |
+|| #
+||
+|| @license Please see LICENSE.
+||
+*/
@@ -0,0 +1,117 @@
+/*
+|| ButtonEvents
+|| - An example Project Things Oryng Wiring/Arduino sketch demonstrating events raised from an
+||   interrupt handler, and an action invoked by the gateway.
+||
+|| Things:
+|| - Button - "pressed" event, with the number of presses so far
+|| - LED - "on", and a "blink" action
+||
+|| More notes at the bottom.
+*/
+
+// One event and one action; both are left out of the adapter unless asked for.
+#define THINGMAXEVENTS 1
+#define THINGMAXACTIONS 1
+
+#include <PackedSerialThingAdapter.h>
+
+#define BUTTONPIN 2
+#define LEDPIN LED_BUILTIN
+
+// This is our adapter which does all the important communication with the gateway.
+PackedSerialThingAdapter adapter = PackedSerialThingAdapter("ButtonEvents", "Oryng Demoboard 2");
+
+// Our Things
+ThingDevice buttonThing = ThingDevice("Button", "Push button", THING);
+ThingDevice ledThing = ThingDevice("LED", "Blinky LED", ONOFFLIGHT);
+
+// Property for LED
+ThingPropertyBoolean ledOn = ThingPropertyBoolean("on", "LED ON/OFF");
+
+uint8_t pressedEvent;
+volatile int32_t presses = 0;
+uint8_t blinksLeft = 0;
+
+
+// Called on every press.  postEvent() only queues the event, update() sends it later.
+void onButton()
+{
+  presses++;
+  adapter.postEvent(pressedEvent, presses);
+}
+
+
+// Called from adapter.update() when the gateway invokes "blink".
+void blink(int32_t count)
+{
+  blinksLeft = (count > 0 && count < 100) ? count : 1;
+}
+
+
+void setup()
+{
+  // Set up our LED and button
+  pinMode(LEDPIN, OUTPUT);
+  digitalWrite(LEDPIN, LOW);
+  pinMode(BUTTONPIN, INPUT_PULLUP);
+
+  ledThing.addProperty(ledOn);
+
+  adapter.addDevice(buttonThing);
+  adapter.addDevice(ledThing);
+
+  // Events and actions are added after their things, and before begin()
+  pressedEvent = adapter.addEvent(buttonThing, "pressed", "Button pressed");
+  adapter.addAction(ledThing, "blink", "Blink the LED count times", blink);
+
+  adapter.begin(); // Automatically sets up Serial to default bit rate
+
+  attachInterrupt(digitalPinToInterrupt(BUTTONPIN), onButton, FALLING);
+}
+
+void loop()
+{
+  static uint32_t lastBlink = 0;
+
+  // Take care of Adapter communication
+  adapter.update();
+
+  // Work through any blinks asked for, 4 toggles a second
+  if (blinksLeft > 0 && (millis() - lastBlink) > 250)
+  {
+    ledOn.setValue(!ledOn.value);
+    if (!ledOn.value)
+      blinksLeft--;
+
+    lastBlink = millis();
+  }
+
+  // Keep our LED up to date
+  digitalWrite(LEDPIN, ledOn.value);
+}
+
+/*
+||
+|| @author         Brett Hagman <bhagman@roguerobotics.com>
+|| @url            http://roguerobotics.com/
+|| @url            http://oryng.org/
+||
+|| @description
+|| | An example Project Things Oryng Wiring/Arduino sketch demonstrating events raised from an
+|| | interrupt handler, and an action invoked by the gateway.
+|| #
+||
+|| @notes
+|| |
+|| | There is no debouncing, so a bouncy button raises a few events per press.  Events that
+|| | arrive faster than update() can send them are dropped, and counted in the next EVENTBATCH.
+|| #
+||
+|| @todo
+|| |
+|| #
+||
+|| @license Please see LICENSE.
+||
+*/
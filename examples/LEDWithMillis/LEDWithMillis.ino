@@ -10,6 +10,10 @@
 || More notes at the bottom.
 */
 
+// We report every change with adapter.setChanged(), so update() doesn't need to sweep
+// every property looking for changes.
+#define THINGCHANGESCAN 0
+
 #include <PackedSerialThingAdapter.h>
 
 #define LEDPIN LED_BUILTIN
@@ -62,6 +66,8 @@ void loop()
   {
     millisTime.setValue(millis());
     microsTime.setValue(micros());
+    adapter.setChanged(millisTime);
+    adapter.setChanged(microsTime);
 
     lastChange = millis();
   }
@@ -0,0 +1,88 @@
+/*
+|| SerialRouter
+|| - An example Project Things Oryng Wiring/Arduino sketch demonstrating router mode: one
+||   gateway port serving this board's Things and those of another board on Serial1.
+||
+|| Things:
+|| - LED - "on" (thing 0, on this board)
+|| - Things 1 and 2 - on the board wired to Serial1 (see notes)
+||
+|| More notes at the bottom.
+*/
+
+// The stream given to begin(), plus the route to the board behind us.
+#define THINGMAXLINKS 2
+
+#include <PackedSerialThingAdapter.h>
+
+#define LEDPIN LED_BUILTIN
+
+// Things numbered from ROUTEFIRST to ROUTEFIRST + ROUTECOUNT - 1 live on the other board
+#define ROUTEFIRST 1
+#define ROUTECOUNT 2
+
+// This is our adapter which does all the important communication with the gateway.
+PackedSerialThingAdapter adapter = PackedSerialThingAdapter("SerialRouter", "Oryng Demoboard 3");
+
+// Our Thing
+ThingDevice ledThing = ThingDevice("LED", "Router LED", ONOFFLIGHT);
+
+// Property for LED
+ThingPropertyBoolean ledOn = ThingPropertyBoolean("on", "LED ON/OFF");
+
+
+void setup()
+{
+  // Set up our LED
+  pinMode(LEDPIN, OUTPUT);
+  digitalWrite(LEDPIN, LOW);
+
+  ledThing.addProperty(ledOn);
+
+  adapter.addDevice(ledThing);
+
+  adapter.begin(); // Automatically sets up Serial to default bit rate
+
+  // The board behind us talks at the default bit rate, and is reached through our things
+  Serial1.begin(THINGBITRATE);
+  adapter.addRoute(Serial1, ROUTEFIRST, ROUTECOUNT);
+}
+
+void loop()
+{
+  // Take care of Adapter communication, for both ports
+  adapter.update();
+
+  // Keep our LED up to date
+  digitalWrite(LEDPIN, ledOn.value);
+}
+
+/*
+||
+|| @author         Brett Hagman <bhagman@roguerobotics.com>
+|| @url            http://roguerobotics.com/
+|| @url            http://oryng.org/
+||
+|| @description
+|| | An example Project Things Oryng Wiring/Arduino sketch demonstrating router mode: one
+|| | gateway port serving this board's Things and those of another board on Serial1.
+|| #
+||
+|| @notes
+|| |
+|| | The board on Serial1 runs an ordinary sketch with its own two things, given to
+|| | adapter.begin(Serial) as usual, plus one more line before begin():
+|| |
+|| |   adapter.setThingOffset(1);  // ROUTEFIRST here
+|| |
+|| | so its things are 1 and 2 on the wire, and its frames can be passed on unchanged.
+|| | The gateway defines them with DEFINETHINGBYIDX; DEFINEALL only covers the LED.
+|| #
+||
+|| @todo
+|| |
+|| #
+||
+|| @license Please see LICENSE.
+||
+*/
@@ -0,0 +1,26 @@
+/*
+|| SketchMain.cpp - Runs an example sketch on the host: setup(), then loop() for HOSTRUNMS ms
+|| (from the environment, 0 for a single pass).
+*/
+
+#include <Arduino.h>
+
+void setup();
+void loop();
+
+
+int main()
+{
+  const char *runFor = getenv("HOSTRUNMS");
+  unsigned long runMillis = (runFor != nullptr) ? strtoul(runFor, nullptr, 10) : 0;
+
+  setup();
+
+  unsigned long start = millis();
+
+  do
+    loop();
+  while (millis() - start < runMillis);
+
+  return 0;
+}
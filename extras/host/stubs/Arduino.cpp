@@ -0,0 +1,99 @@
+/*
+|| Arduino.cpp - Clock and serial ports for the host stand-in of the Wiring/Arduino core.
+||
+||
+|| More notes in Arduino.h.
+*/
+
+#include <Arduino.h>
+
+#include <chrono>
+#include <stdio.h>
+
+
+HardwareSerial Serial;
+HardwareSerial Serial1;
+
+static const std::chrono::steady_clock::time_point clockStart = std::chrono::steady_clock::now();
+static bool clockFrozen = false;
+static unsigned long frozenMicros = 0;
+
+
+unsigned long micros()
+{
+  if (clockFrozen)
+    return frozenMicros;
+
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - clockStart).count();
+}
+
+
+unsigned long millis()
+{
+  return micros() / 1000;
+}
+
+
+void hostSetMicros(unsigned long us)
+{
+  clockFrozen = true;
+  frozenMicros = us;
+}
+
+
+void hostAdvanceMillis(unsigned long ms)
+{
+  hostSetMicros(micros() + ms * 1000);
+}
+
+
+void delay(unsigned long ms)
+{
+  delayMicroseconds(ms * 1000);
+}
+
+
+void delayMicroseconds(unsigned int us)
+{
+  unsigned long start = micros();
+
+  if (clockFrozen)
+    frozenMicros += us;
+  else
+    while (micros() - start < us);
+}
+
+
+size_t Print::print(long n)
+{
+  char buffer[24];
+
+  snprintf(buffer, sizeof(buffer), "%ld", n);
+  return print(buffer);
+}
+
+
+size_t Print::print(unsigned long n)
+{
+  char buffer[24];
+
+  snprintf(buffer, sizeof(buffer), "%lu", n);
+  return print(buffer);
+}
+
+
+size_t Print::print(double n)
+{
+  char buffer[32];
+
+  snprintf(buffer, sizeof(buffer), "%.2f", n);
+  return print(buffer);
+}
+
+
+size_t HardwareSerial::write(uint8_t c)
+{
+  putchar(c);
+
+  return 1;
+}
@@ -0,0 +1,155 @@
+/*
+|| Arduino.h - Just enough of the Wiring/Arduino core to build PackedSerialThingAdapter on a
+|| Linux host, for the tests and benchmarks in extras/host.
+||
+||
+|| More notes at the bottom.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARDUINO 10800
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define LOW 0
+#define HIGH 1
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+#define LED_BUILTIN 13
+#define A0 14
+
+
+// Flash strings live in RAM like everything else.
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(p) (*(const uint8_t *) (p))
+#define memcpy_P memcpy
+#define strlen_P strlen
+
+class __FlashStringHelper;
+#define F(s) (reinterpret_cast<const __FlashStringHelper *>(PSTR(s)))
+
+
+// The clock follows real time, unless hostSetMicros() has frozen it.
+unsigned long millis();
+unsigned long micros();
+
+// Freeze the clock at us, so tests can step it with hostAdvanceMillis().
+void hostSetMicros(unsigned long us);
+void hostAdvanceMillis(unsigned long ms);
+
+
+// Waits for real, or with the clock frozen, just moves it on.
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+inline void pinMode(uint8_t, uint8_t) {}
+inline void digitalWrite(uint8_t, uint8_t) {}
+inline int digitalRead(uint8_t) { return LOW; }
+inline int analogRead(uint8_t) { return 0; }
+inline int digitalPinToInterrupt(uint8_t pin) { return pin; }
+inline void attachInterrupt(uint8_t, void (*)(), int) {}
+inline void detachInterrupt(uint8_t) {}
+inline void noInterrupts() {}
+inline void interrupts() {}
+
+inline long random(long howBig) { return (howBig > 0) ? rand() % howBig : 0; }
+inline long random(long howSmall, long howBig) { return howSmall + random(howBig - howSmall); }
+inline void randomSeed(unsigned long seed) { srand(seed); }
+
+inline long map(long x, long inMin, long inMax, long outMin, long outMax)
+{
+  return (x - inMin) * (outMax - outMin) / (inMax - inMin) + outMin;
+}
+
+template<class T> T constrain(T x, T low, T high)
+{
+  return (x < low) ? low : ((x > high) ? high : x);
+}
+
+
+class Print
+{
+  public:
+    virtual ~Print() {}
+
+    virtual size_t write(uint8_t c) = 0;
+
+    virtual size_t write(const uint8_t *buffer, size_t size)
+    {
+      size_t n = 0;
+
+      while (size--)
+        n += write(*buffer++);
+
+      return n;
+    }
+
+    virtual int availableForWrite() { return 0; }
+    virtual void flush() {}
+
+    size_t print(const char *s) { return write((const uint8_t *) s, strlen(s)); }
+    size_t print(const __FlashStringHelper *s) { return print((const char *) s); }
+    size_t print(char c) { return write((uint8_t) c); }
+    size_t print(int n) { return print((long) n); }
+    size_t print(unsigned int n) { return print((unsigned long) n); }
+    size_t print(long n);
+    size_t print(unsigned long n);
+    size_t print(double n);
+
+    template<class T> size_t println(T value) { return print(value) + println(); }
+    size_t println() { return print("\r\n"); }
+};
+
+
+class Stream : public Print
+{
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+};
+
+
+// Serial and Serial1 print to stdout, and never receive anything.  Like an AVR's, the transmit
+// buffer has room for 63 bytes.
+class HardwareSerial : public Stream
+{
+  public:
+    void begin(unsigned long) {}
+    void end() {}
+    operator bool() { return true; }
+
+    int available() { return 0; }
+    int read() { return -1; }
+    int peek() { return -1; }
+    size_t write(uint8_t c);
+    using Print::write;
+    int availableForWrite() { return 63; }
+};
+
+extern HardwareSerial Serial;
+extern HardwareSerial Serial1;
+
+
+/*
+||
+|| @description
+|| | Host stand-in for the Wiring/Arduino core.  Only what the library, its examples and the
+|| | host tests use is here; timing and I/O are simulated (see Arduino.cpp).
+|| #
+||
+|| @license Please see LICENSE.
+||
+*/
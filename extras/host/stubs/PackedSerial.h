@@ -0,0 +1,188 @@
+/*
+|| PackedSerial.h - Host stand-in for the PackedSerial library: COBS framed packets over a Stream,
+|| and the SimplePack helpers.
+||
+||
+|| More notes at the bottom.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+
+// Largest packet, before encoding, that is received whole.  Longer ones are dropped.
+#ifndef PACKEDSERIALBUFFERSIZE
+#define PACKEDSERIALBUFFERSIZE 256
+#endif
+
+
+class IPacketReceiver
+{
+  public:
+    virtual void onPacketReceive(const uint8_t *buffer, size_t size) = 0;
+};
+
+
+namespace SimplePack
+{
+  inline uint8_t writeUInt8(uint8_t *buffer, uint8_t value, uint8_t index)
+  {
+    buffer[index] = value;
+    return index + 1;
+  }
+
+  inline uint8_t writeInt32BE(uint8_t *buffer, int32_t value, uint8_t index)
+  {
+    buffer[index] = (uint32_t) value >> 24;
+    buffer[index + 1] = (uint32_t) value >> 16;
+    buffer[index + 2] = (uint32_t) value >> 8;
+    buffer[index + 3] = (uint32_t) value;
+    return index + 4;
+  }
+
+  inline uint8_t writeString(uint8_t *buffer, const char *value, uint8_t index)
+  {
+    size_t len = strlen(value) + 1;
+
+    memcpy(buffer + index, value, len);
+    return index + len;
+  }
+
+  inline uint8_t readUInt8(const uint8_t *buffer, uint8_t index)
+  {
+    return buffer[index];
+  }
+
+  inline int32_t readInt32BE(const uint8_t *buffer, uint8_t index)
+  {
+    return (int32_t) (((uint32_t) buffer[index] << 24) | ((uint32_t) buffer[index + 1] << 16) |
+                      ((uint32_t) buffer[index + 2] << 8) | buffer[index + 3]);
+  }
+
+  inline void readString(char *value, const uint8_t *buffer, uint8_t index)
+  {
+    strcpy(value, (const char *) buffer + index);
+  }
+}
+
+
+// Each packet goes out COBS encoded and followed by a 0, so it takes len + len / 254 + 2 bytes.
+class PackedSerial
+{
+  public:
+    PackedSerial()
+      : stream(nullptr),
+        receiver(nullptr),
+        received(0),
+        overrun(false)
+    {
+    }
+
+    void setStream(Stream &newStream)
+    {
+      stream = &newStream;
+    }
+
+    void setPacketReceiver(IPacketReceiver *newReceiver)
+    {
+      receiver = newReceiver;
+    }
+
+    void send(const uint8_t *buffer, size_t size)
+    {
+      uint8_t block[255];
+      uint8_t blockLength = 1;
+      uint8_t zero = 0;
+
+      for (size_t i = 0; i < size; i++)
+      {
+        if (buffer[i] != 0)
+          block[blockLength++] = buffer[i];
+
+        if (buffer[i] == 0 || blockLength == 255)
+        {
+          block[0] = blockLength;
+          stream->write(block, blockLength);
+          blockLength = 1;
+        }
+      }
+
+      block[0] = blockLength;
+      stream->write(block, blockLength);
+      stream->write(&zero, 1);
+    }
+
+    // Read whatever the stream has, and hand each complete packet to the receiver.
+    void update()
+    {
+      while (stream != nullptr && stream->available() > 0)
+      {
+        int c = stream->read();
+
+        if (c == 0)
+        {
+          if (!overrun)
+            decode();
+          received = 0;
+          overrun = false;
+        }
+        else if (received < sizeof(encoded))
+        {
+          encoded[received++] = c;
+        }
+        else
+        {
+          overrun = true;
+        }
+      }
+    }
+
+
+  private:
+    void decode()
+    {
+      uint8_t packet[PACKEDSERIALBUFFERSIZE];
+      size_t length = 0;
+      size_t i = 0;
+
+      while (i < received)
+      {
+        uint8_t code = encoded[i++];
+
+        for (uint8_t n = 1; n < code; n++)
+        {
+          if (i >= received || length >= sizeof(packet))
+            return;
+          packet[length++] = encoded[i++];
+        }
+
+        if (code != 0xff && i < received)
+        {
+          if (length >= sizeof(packet))
+            return;
+          packet[length++] = 0;
+        }
+      }
+
+      if (receiver != nullptr && length > 0)
+        receiver->onPacketReceive(packet, length);
+    }
+
+    Stream *stream;
+    IPacketReceiver *receiver;
+    uint8_t encoded[PACKEDSERIALBUFFERSIZE + PACKEDSERIALBUFFERSIZE / 254 + 2];
+    size_t received;
+    boolean overrun;
+};
+
+
+/*
+||
+|| @description
+|| | Host stand-in for PackedSerial.  The framing matches what the adapter allows for in
+|| | framedSize(), so availableForWrite() checks behave as they do on a board.
+|| #
+||
+|| @license Please see LICENSE.
+||
+*/
@@ -0,0 +1,228 @@
+/*
+|| Thing.h - Host stand-in for the Oryng Thing classes, with the members PackedSerialThingAdapter
+|| uses.
+||
+||
+|| More notes at the bottom.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+
+
+enum ThingDeviceType
+{
+  THING,
+  ONOFFSWITCH,
+  ONOFFLIGHT,
+  DIMMABLELIGHT,
+  MULTILEVELSENSOR
+};
+
+
+enum ThingPropertyDatatype
+{
+  BOOLEAN,
+  NUMBER,
+  STRING
+};
+
+
+class ThingProperty
+{
+  public:
+    ThingProperty(const char *propertyName, const char *propertyDescription, ThingPropertyDatatype propertyType)
+      : name(propertyName),
+        description(propertyDescription),
+        type(propertyType),
+        changed(false),
+        next(nullptr)
+    {
+    }
+
+    const char *name;
+    const char *description;
+    uint8_t type;
+    boolean changed;
+    ThingProperty *next;
+};
+
+
+class ThingPropertyBoolean : public ThingProperty
+{
+  public:
+    ThingPropertyBoolean(const char *propertyName, const char *propertyDescription)
+      : ThingProperty(propertyName, propertyDescription, BOOLEAN),
+        value(false)
+    {
+    }
+
+    boolean getValue()
+    {
+      return value;
+    }
+
+    void setValue(boolean newValue)
+    {
+      if (newValue != value)
+      {
+        value = newValue;
+        changed = true;
+      }
+    }
+
+    boolean value;
+};
+
+
+class ThingPropertyNumber : public ThingProperty
+{
+  public:
+    ThingPropertyNumber(const char *propertyName, const char *propertyDescription)
+      : ThingProperty(propertyName, propertyDescription, NUMBER),
+        value(0)
+    {
+    }
+
+    int32_t getValue()
+    {
+      return value;
+    }
+
+    void setValue(int32_t newValue)
+    {
+      if (newValue != value)
+      {
+        value = newValue;
+        changed = true;
+      }
+    }
+
+    int32_t value;
+};
+
+
+class ThingPropertyString : public ThingProperty
+{
+  public:
+    ThingPropertyString(const char *propertyName, const char *propertyDescription)
+      : ThingProperty(propertyName, propertyDescription, STRING),
+        value((char *) "")
+    {
+    }
+
+    char *getValue()
+    {
+      return value;
+    }
+
+    // Points the property at newValue, which must outlive it.
+    void setValue(const char *newValue)
+    {
+      value = (char *) newValue;
+      changed = true;
+    }
+
+    char *value;
+};
+
+
+class ThingDevice
+{
+  public:
+    ThingDevice(const char *deviceName, const char *deviceDescription, ThingDeviceType deviceType)
+      : name(deviceName),
+        description(deviceDescription),
+        type(deviceType),
+        paired(false),
+        propertyCount(0),
+        eventCount(0),
+        actionCount(0),
+        firstProperty(nullptr),
+        next(nullptr)
+    {
+    }
+
+    void addProperty(ThingProperty &property)
+    {
+      ThingProperty **last = &firstProperty;
+
+      while (*last != nullptr)
+        last = &(*last)->next;
+
+      *last = &property;
+      propertyCount++;
+    }
+
+    ThingProperty *getProperty(uint8_t propertyIdx)
+    {
+      ThingProperty *property = firstProperty;
+
+      while (property != nullptr && propertyIdx-- > 0)
+        property = property->next;
+
+      return property;
+    }
+
+    const char *name;
+    const char *description;
+    uint8_t type;
+    boolean paired;
+    uint8_t propertyCount;
+    uint8_t eventCount;
+    uint8_t actionCount;
+    ThingProperty *firstProperty;
+    ThingDevice *next;
+};
+
+
+class ThingAdapter
+{
+  public:
+    ThingAdapter(const char *adapterName, const char *adapterDescription)
+      : name(adapterName),
+        description(adapterDescription),
+        thingCount(0),
+        firstDevice(nullptr)
+    {
+    }
+
+    void addDevice(ThingDevice &device)
+    {
+      ThingDevice **last = &firstDevice;
+
+      while (*last != nullptr)
+        last = &(*last)->next;
+
+      *last = &device;
+      thingCount++;
+    }
+
+    ThingDevice *getDevice(uint8_t thingIdx)
+    {
+      ThingDevice *device = firstDevice;
+
+      while (device != nullptr && thingIdx-- > 0)
+        device = device->next;
+
+      return device;
+    }
+
+    const char *name;
+    const char *description;
+    uint8_t thingCount;
+    ThingDevice *firstDevice;
+};
+
+
+/*
+||
+|| @description
+|| | Host stand-in for Thing.h.  The classes keep the same public members as the real ones,
+|| | but only what the adapter and its examples need is implemented.
+|| #
+||
+|| @license Please see LICENSE.
+||
+*/
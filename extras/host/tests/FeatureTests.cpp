@@ -0,0 +1,446 @@
+/*
+|| FeatureTests.cpp - Events, actions, subscriptions, published values, string storage, delta
+|| numbers and performance counters.
+*/
+
+#define THINGMAXEVENTS 2
+#define THINGMAXACTIONS 2
+#define THINGEVENTQUEUESIZE 4
+#define THINGACTIONQUEUESIZE 2
+#define THINGMAXSUBSCRIPTIONS 2
+#define THINGMAXPUBLISHED 2
+#define THINGSTRINGPOOLSIZE 32
+#define THINGMAXSTRINGS 2
+#define THINGDELTANUMBER 1
+#define THINGSTATS 1
+
+#include <PackedSerialThingAdapter.h>
+
+#include "TestHarness.h"
+
+
+// A button with a "pressed" event, and a display with a level, a label and a "flash" action.
+struct TestAdapter
+{
+  TestAdapter()
+    : adapter("Adapter", "Test adapter"),
+      button("Button", "Test button", THING),
+      display("Display", "Test display", THING),
+      level("level", "Level"),
+      label("label", "Label"),
+      gateway(stream)
+  {
+    display.addProperty(level);
+    display.addProperty(label);
+    adapter.addDevice(button);
+    adapter.addDevice(display);
+    pressed = adapter.addEvent(button, "pressed", "Button pressed");
+    adapter.addAction(display, "flash", "Flash the display", onFlash);
+    label.setValue("hi");
+    adapter.addStringStorage(label, 8);
+    adapter.begin(stream);
+    flashes = 0;
+  }
+
+  void pairAll()
+  {
+    gateway.request(adapter, { PAIR, 0 });
+    gateway.request(adapter, { PAIR, 1 });
+  }
+
+  static void onFlash(int32_t count)
+  {
+    flashes += count;
+  }
+
+  PackedSerialThingAdapter adapter;
+  ThingDevice button;
+  ThingDevice display;
+  ThingPropertyNumber level;
+  ThingPropertyString label;
+  TestStream stream;
+  TestGateway gateway;
+  uint8_t pressed;
+  static int32_t flashes;
+};
+
+int32_t TestAdapter::flashes;
+
+
+TEST(eventsAreDefined)
+{
+  TestAdapter t;
+
+  CHECK_FRAME(t.gateway.request(t.adapter, { DEFINEEVENTBYIDX, 0, 0 })[0], DETAILEVENTBYIDX, 0, 0,
+              'p', 'r', 'e', 's', 's', 'e', 'd', 0, 'B', 'u', 't', 't', 'o', 'n', ' ', 'p', 'r', 'e', 's', 's', 'e', 'd', 0);
+  CHECK_EQUAL(DETAILACTIONBYIDX, t.gateway.request(t.adapter, { DEFINEACTIONBYIDX, 1, 0 })[0][0]);
+  CHECK_FRAME(t.gateway.request(t.adapter, { DEFINEEVENTBYIDX, 0, 1 })[0], ERROR, ERROR_EVENTIDX_OUTOFRANGE);
+  CHECK_FRAME(t.gateway.request(t.adapter, { DEFINEACTIONBYIDX, 0, 0 })[0], ERROR, ERROR_ACTIONIDX_OUTOFRANGE);
+  CHECK_FRAME(t.gateway.request(t.adapter, { DEFINETHINGBYIDX, 0 })[0], DETAILTHINGBYIDX, 0, THING,
+              'B', 'u', 't', 't', 'o', 'n', 0, 'T', 'e', 's', 't', ' ', 'b', 'u', 't', 't', 'o', 'n', 0, 0, 1, 0);
+}
+
+
+TEST(eventsAreBatched)
+{
+  TestAdapter t;
+
+  // Unpaired, so dropped
+  CHECK(t.adapter.postEvent(t.pressed, 1));
+  t.adapter.update();
+  CHECK_EQUAL(0, t.gateway.receive().size());
+
+  t.pairAll();
+  CHECK(t.adapter.postEvent(t.pressed, 2));
+  CHECK(t.adapter.postEvent(t.pressed, 3));
+  t.adapter.update();
+  CHECK_FRAME(t.gateway.receive()[0], EVENTBATCH, 0, 2, 0, 0, 0, 0, 0, 2, 0, 0, 0, 0, 0, 3);
+}
+
+
+TEST(eventsDroppedWhenTheQueueIsFullAreCounted)
+{
+  TestAdapter t;
+
+  t.pairAll();
+  CHECK(t.adapter.postEvent(t.pressed, 1));
+  CHECK(t.adapter.postEvent(t.pressed, 2));
+  CHECK(t.adapter.postEvent(t.pressed, 3));
+  CHECK(!t.adapter.postEvent(t.pressed, 4));
+  CHECK(!t.adapter.postEvent(7));
+  t.adapter.update();
+
+  Frame batch = t.gateway.receive()[0];
+  CHECK_EQUAL(1, batch[1]);
+  CHECK_EQUAL(3, batch[2]);
+}
+
+
+TEST(actionsRunInUpdate)
+{
+  TestAdapter t;
+
+  t.pairAll();
+  Frames frames = t.gateway.request(t.adapter, { INVOKEACTION, 1, 0, 0, 0, 0, 3 });
+  CHECK_FRAME(frames[0], ACTIONSTATUS, 1, 0, ACTION_QUEUED);
+  CHECK_FRAME(frames[1], ACTIONSTATUS, 1, 0, ACTION_COMPLETED);
+  CHECK_EQUAL(3, TestAdapter::flashes);
+
+  CHECK_FRAME(t.gateway.request(t.adapter, { INVOKEACTION, 1, 1, 0, 0, 0, 3 })[0], ERROR, ERROR_ACTIONIDX_OUTOFRANGE);
+  CHECK_FRAME(t.gateway.request(t.adapter, { INVOKEACTION, 1, 0, 0, 0 })[0], ERROR, ERROR_VALUE_INVALID);
+}
+
+
+TEST(actionsQueueIsBounded)
+{
+  TestAdapter t;
+
+  t.pairAll();
+
+  // Both requests are handled before update() runs the first handler
+  t.gateway.send({ INVOKEACTION, 1, 0, 0, 0, 0, 1 });
+  t.gateway.send({ INVOKEACTION, 1, 0, 0, 0, 0, 1 });
+  t.adapter.update();
+
+  Frames frames = t.gateway.receive();
+  CHECK_FRAME(frames[0], ACTIONSTATUS, 1, 0, ACTION_QUEUED);
+  CHECK_FRAME(frames[1], ERROR, ERROR_ACTIONS_FULL);
+  CHECK_FRAME(frames[2], ACTIONSTATUS, 1, 0, ACTION_COMPLETED);
+}
+
+
+TEST(subscriptionsCoalesceChanges)
+{
+  TestAdapter t;
+
+  t.pairAll();
+  CHECK_FRAME(t.gateway.request(t.adapter, { SUBSCRIBE, 1, 0, 0x00, 0x64, 0, 0, 0, 0, 0, 0 })[0], SUBSCRIBED, 1, 0);
+
+  t.level.setValue(1);
+  t.adapter.update();
+  CHECK_EQUAL(1, t.gateway.receive().size());
+
+  // Held for 100 ms, and only the latest goes
+  t.level.setValue(2);
+  t.adapter.update();
+  t.level.setValue(3);
+  t.adapter.update();
+  CHECK_EQUAL(0, t.gateway.receive().size());
+  CHECK_EQUAL(100, t.adapter.millisUntilDue());
+
+  hostAdvanceMillis(100);
+  t.adapter.update();
+  Frames frames = t.gateway.receive();
+  CHECK_EQUAL(1, frames.size());
+  CHECK_FRAME(frames[0], PROPERTYSTATUS, 1, 0, 0, 0, 0, 3);
+}
+
+
+TEST(heldChangesDontMoveTheGeneration)
+{
+  TestAdapter t;
+
+  t.pairAll();
+  t.gateway.request(t.adapter, { SUBSCRIBE, 1, 0, 0x00, 0x64, 0, 0, 0, 0, 0, 0 });
+  t.level.setValue(1);
+  t.adapter.update();
+  t.gateway.receive();
+
+  // A change held back by the subscription
+  t.level.setValue(2);
+  t.adapter.update();
+
+  const Frame snapshot = t.gateway.request(t.adapter, { GETSNAPSHOT, 1, 0, 0 })[0];
+  uint8_t high = snapshot[6];
+  uint8_t low = snapshot[7];
+
+  // ...is not a new change on every update() while it waits
+  t.adapter.update();
+  t.adapter.update();
+  CHECK_FRAME(t.gateway.request(t.adapter, { GETSNAPSHOT, 1, high, low })[0], SNAPSHOTUNCHANGED, 1, high, low);
+
+  // but changing it again is
+  t.level.setValue(3);
+  t.adapter.update();
+  CHECK_EQUAL(SNAPSHOT, t.gateway.request(t.adapter, { GETSNAPSHOT, 1, high, low })[0][0]);
+
+  hostAdvanceMillis(100);
+  t.adapter.update();
+  CHECK_FRAME(t.gateway.receive()[0], PROPERTYSTATUS, 1, 0, 0, 0, 0, 3);
+}
+
+
+TEST(heartbeatsDontMoveTheGeneration)
+{
+  TestAdapter t;
+
+  t.pairAll();
+  t.gateway.request(t.adapter, { SUBSCRIBE, 1, 0, 0, 0, 0x03, 0xe8, 0, 0, 0, 0 });
+  t.adapter.update();
+  t.gateway.receive();
+
+  const Frame snapshot = t.gateway.request(t.adapter, { GETSNAPSHOT, 1, 0, 0 })[0];
+  uint8_t high = snapshot[6];
+  uint8_t low = snapshot[7];
+
+  // The heartbeat goes out, but the value it carries is the one in the snapshot
+  hostAdvanceMillis(1000);
+  t.adapter.update();
+  CHECK_FRAME(t.gateway.receive()[0], PROPERTYSTATUS, 1, 0, 0, 0, 0, 0);
+  CHECK_FRAME(t.gateway.request(t.adapter, { GETSNAPSHOT, 1, high, low })[0], SNAPSHOTUNCHANGED, 1, high, low);
+}
+
+
+TEST(subscriptionDeadbandAndHeartbeat)
+{
+  TestAdapter t;
+
+  t.pairAll();
+  t.gateway.request(t.adapter, { SUBSCRIBE, 1, 0, 0, 0, 0x03, 0xe8, 0, 0, 0, 10 });
+
+  t.level.setValue(5);
+  t.adapter.update();
+  CHECK_EQUAL(0, t.gateway.receive().size());
+
+  t.level.setValue(10);
+  t.adapter.update();
+  CHECK_FRAME(t.gateway.receive()[0], PROPERTYSTATUS, 1, 0, 0, 0, 0, 10);
+
+  hostAdvanceMillis(1000);
+  t.adapter.update();
+  CHECK_FRAME(t.gateway.receive()[0], PROPERTYSTATUS, 1, 0, 0, 0, 0, 10);
+
+  // All zeros unsubscribes
+  t.gateway.request(t.adapter, { SUBSCRIBE, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0 });
+  t.level.setValue(11);
+  t.adapter.update();
+  CHECK_EQUAL(1, t.gateway.receive().size());
+}
+
+
+TEST(subscriptionsAreBounded)
+{
+  TestAdapter t;
+
+  t.pairAll();
+  CHECK_EQUAL(SUBSCRIBED, t.gateway.request(t.adapter, { SUBSCRIBE, 1, 0, 0, 1, 0, 0, 0, 0, 0, 0 })[0][0]);
+  CHECK_EQUAL(SUBSCRIBED, t.gateway.request(t.adapter, { SUBSCRIBE, 1, 1, 0, 1, 0, 0, 0, 0, 0, 0 })[0][0]);
+  CHECK_EQUAL(SUBSCRIBED, t.gateway.request(t.adapter, { SUBSCRIBE, 1, 1, 0, 2, 0, 0, 0, 0, 0, 0 })[0][0]);
+
+  PackedSerialThingAdapter other("Other", "Other");
+  ThingDevice thing("Thing", "Thing", THING);
+  ThingPropertyNumber a("a", "a"), b("b", "b"), c("c", "c");
+  TestStream stream;
+  TestGateway gateway(stream);
+
+  thing.addProperty(a);
+  thing.addProperty(b);
+  thing.addProperty(c);
+  other.addDevice(thing);
+  other.begin(stream);
+  gateway.request(other, { SUBSCRIBE, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0 });
+  gateway.request(other, { SUBSCRIBE, 0, 1, 0, 1, 0, 0, 0, 0, 0, 0 });
+  CHECK_FRAME(gateway.request(other, { SUBSCRIBE, 0, 2, 0, 1, 0, 0, 0, 0, 0, 0 })[0], ERROR, ERROR_SUBSCRIPTIONS_FULL);
+}
+
+
+TEST(publishedValuesAreCollected)
+{
+  TestAdapter t;
+  uint8_t id = t.adapter.addPublished(t.level);
+
+  t.adapter.begin(t.stream);
+  t.pairAll();
+
+  t.adapter.publish(id, 41);
+  t.adapter.publish(id, 42);
+  CHECK(t.adapter.hasPendingWork());
+  t.adapter.update();
+  CHECK_EQUAL(42, t.level.getValue());
+  CHECK_FRAME(t.gateway.receive()[0], PROPERTYSTATUS, 1, 0, 0, 0, 0, 42);
+}
+
+
+TEST(manyPublishesBetweenUpdatesAreNotLost)
+{
+  TestAdapter t;
+  uint8_t id = t.adapter.addPublished(t.level);
+
+  t.adapter.begin(t.stream);
+  t.pairAll();
+
+  // Enough to wrap an 8 bit count, once per value and once in all
+  for (int32_t i = 1; i <= 128; i++)
+    t.adapter.publish(id, i);
+  t.adapter.update();
+  CHECK_EQUAL(128, t.level.getValue());
+  CHECK_FRAME(t.gateway.receive()[0], PROPERTYSTATUS, 1, 0, 0, 0, 0, 128);
+
+  for (int32_t i = 1; i <= 256; i++)
+    t.adapter.publish(id, 1000 + i);
+  CHECK(t.adapter.hasPendingWork());
+  t.adapter.update();
+  CHECK_EQUAL(1256, t.level.getValue());
+}
+
+
+TEST(stringStorageBoundsSetProperty)
+{
+  TestAdapter t;
+
+  t.pairAll();
+  CHECK_FRAME(t.gateway.request(t.adapter, { GETPROPERTY, 1, 1 })[0], PROPERTYSTATUS, 1, 1, 'h', 'i', 0);
+  CHECK_FRAME(t.gateway.request(t.adapter, { SETPROPERTY, 1, 1, 'h', 'e', 'l', 'l', 'o', 0 })[0],
+              PROPERTYSTATUS, 1, 1, 'h', 'e', 'l', 'l', 'o', 0);
+  CHECK_EQUAL("hello", std::string(t.label.getValue()));
+
+  // 9 characters, one more than the storage has room for
+  CHECK_FRAME(t.gateway.request(t.adapter, { SETPROPERTY, 1, 1, 'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 0 })[0],
+              ERROR, ERROR_VALUE_INVALID);
+  // Not terminated
+  CHECK_FRAME(t.gateway.request(t.adapter, { SETPROPERTY, 1, 1, 'a', 'b' })[0], ERROR, ERROR_VALUE_INVALID);
+  CHECK_EQUAL("hello", std::string(t.label.getValue()));
+}
+
+
+TEST(setStringCutsShortAndFlagsTheChange)
+{
+  TestAdapter t;
+
+  t.pairAll();
+  CHECK(t.adapter.setString(t.label, "a long label"));
+  CHECK_EQUAL("a long l", std::string(t.label.getValue()));
+  t.adapter.update();
+  CHECK_FRAME(t.gateway.receive()[0], PROPERTYSTATUS, 1, 1, 'a', ' ', 'l', 'o', 'n', 'g', ' ', 'l', 0);
+}
+
+
+TEST(stringsSetElsewhereAreMeasured)
+{
+  TestAdapter t;
+  char text[] = "ten chars!";
+
+  t.pairAll();
+
+  // Pointed away from its storage, the stored length no longer applies
+  t.label.setValue(text);
+  t.adapter.update();
+  CHECK_FRAME(t.gateway.receive()[0], PROPERTYSTATUS, 1, 1, 't', 'e', 'n', ' ', 'c', 'h', 'a', 'r', 's', '!', 0);
+
+  // ...and SetProperty can only write as much as is there
+  CHECK_FRAME(t.gateway.request(t.adapter, { SETPROPERTY, 1, 1, 'e', 'l', 'e', 'v', 'e', 'n', ' ', 'c', 'h', 'a', 'r', 0 })[0],
+              ERROR, ERROR_VALUE_INVALID);
+  CHECK_EQUAL(1, t.gateway.request(t.adapter, { SETPROPERTY, 1, 1, 'o', 'k', 0 }).size());
+  CHECK_EQUAL("ok", std::string(text));
+
+  // setString() puts it back in its storage
+  CHECK(t.adapter.setString(t.label, "back"));
+  CHECK(t.label.getValue() != text);
+  t.adapter.update();
+  CHECK_FRAME(t.gateway.receive()[0], PROPERTYSTATUS, 1, 1, 'b', 'a', 'c', 'k', 0);
+}
+
+
+TEST(compactAndDeltaNumbers)
+{
+  TestAdapter t;
+
+  t.pairAll();
+  t.gateway.request(t.adapter, { SETOPTIONS, OPTION_COMPACTNUMBER | OPTION_DELTANUMBER });
+
+  t.level.setValue(100);
+  t.adapter.update();
+  CHECK_FRAME(t.gateway.receive()[0], PROPERTYSTATUS, 1, 0, 0xc8, 0x01);
+
+  t.level.setValue(99);
+  t.adapter.update();
+  CHECK_FRAME(t.gateway.receive()[0], PROPERTYSTATUS, 1, 0, 0x01);
+
+  // SETPROPERTY takes a varint too
+  CHECK_EQUAL(1, t.gateway.request(t.adapter, { SETPROPERTY, 1, 0, 0x03 }).size());
+  CHECK_EQUAL(-2, t.level.getValue());
+}
+
+
+TEST(requestRepliesAreNeverDeltas)
+{
+  TestAdapter t;
+
+  t.pairAll();
+  t.gateway.request(t.adapter, { SETOPTIONS, OPTION_COMPACTNUMBER | OPTION_DELTANUMBER });
+
+  t.level.setValue(100);
+  t.adapter.update();
+  t.gateway.receive();
+
+  // Answers carry the value itself, and snapshots too
+  CHECK_FRAME(t.gateway.request(t.adapter, { GETPROPERTY, 1, 0 })[0], PROPERTYSTATUS, 1, 0, 0xc8, 0x01);
+  CHECK_FRAME(t.gateway.request(t.adapter, { SETPROPERTY, 1, 0, 0xca, 0x01 })[0], PROPERTYSTATUS, 1, 0, 0xca, 0x01);
+  Frame snapshot = t.gateway.request(t.adapter, { GETSNAPSHOT, 1, 0, 0 })[0];
+  CHECK_FRAME(Frame(snapshot.end() - 5, snapshot.end()), 0xca, 0x01, 'h', 'i', 0);
+
+  // ...and don't move the reference, which is still the 100 pushed
+  t.level.setValue(102);
+  t.adapter.setChanged(t.level);
+  t.adapter.update();
+  CHECK_FRAME(t.gateway.receive()[0], PROPERTYSTATUS, 1, 0, 0x04);
+}
+
+
+TEST(statsCountTraffic)
+{
+  TestAdapter t;
+
+  t.gateway.request(t.adapter, { DEFINEADAPTER });
+  t.gateway.request(t.adapter, { GETPROPERTY, 1, 0 });
+
+  const PackedSerialThingAdapterStats &stats = t.adapter.getStats();
+  CHECK_EQUAL(2, stats.packetsIn);
+  CHECK_EQUAL(2, stats.packetsOut);
+  CHECK_EQUAL(1, stats.errors[0]);
+
+  Frame reply = t.gateway.request(t.adapter, { GETSTATS, 1 })[0];
+  CHECK_EQUAL(STATS, reply[0]);
+  CHECK_EQUAL(1 + 8 * 4 + 1 + 2 * THINGERRORCODES, reply.size());
+  CHECK_EQUAL(0, t.adapter.getStats().packetsIn);
+}
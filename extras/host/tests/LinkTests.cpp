@@ -0,0 +1,214 @@
+/*
+|| LinkTests.cpp - Several gateway links (addLink()), and router mode (addRoute()).
+*/
+
+#define THINGMAXLINKS 3
+
+#include <PackedSerialThingAdapter.h>
+#include <LoopbackStream.h>
+
+#include "TestHarness.h"
+
+
+// A router with an LED, served to two gateways, and a board behind it with a meter as thing 1.
+struct TestAdapter
+{
+  TestAdapter()
+    : router("Router", "Test router"),
+      board("Board", "Test board"),
+      led("LED", "Test LED", ONOFFLIGHT),
+      meter("Meter", "Test meter", THING),
+      on("on", "LED on"),
+      level("level", "Level"),
+      gateway(stream),
+      second(secondStream)
+  {
+    led.addProperty(on);
+    router.addDevice(led);
+    router.begin(stream);
+    router.addLink(secondStream);
+    routerEnd.connect(boardEnd);
+    router.addRoute(routerEnd, 1, 1);
+
+    meter.addProperty(level);
+    board.addDevice(meter);
+    board.setThingOffset(1);
+    board.begin(boardEnd);
+  }
+
+  // Sends request from gateway, and returns what came back once the board has answered.
+  Frames ask(TestGateway &from, const Frame &request)
+  {
+    from.send(request);
+    run();
+
+    return from.receive();
+  }
+
+  void run()
+  {
+    router.update();
+    board.update();
+    router.update();
+  }
+
+  PackedSerialThingAdapter router;
+  PackedSerialThingAdapter board;
+  ThingDevice led;
+  ThingDevice meter;
+  ThingPropertyBoolean on;
+  ThingPropertyNumber level;
+  TestStream stream;
+  TestStream secondStream;
+  LoopbackStream routerEnd;
+  LoopbackStream boardEnd;
+  TestGateway gateway;
+  TestGateway second;
+};
+
+
+TEST(routedRepliesGoToTheLinkThatAsked)
+{
+  TestAdapter t;
+
+  Frames frames = t.ask(t.second, { DEFINETHINGBYIDX, 1 });
+  CHECK_EQUAL(1, frames.size());
+  CHECK_EQUAL(DETAILTHINGBYIDX, frames[0][0]);
+  CHECK_EQUAL(0, t.gateway.receive().size());
+
+  CHECK_FRAME(t.ask(t.gateway, { GETPROPERTY, 1, 0 })[0], ERROR, ERROR_NOT_PAIRED);
+  CHECK_EQUAL(0, t.second.receive().size());
+
+  // Both asking at once, each gets its own
+  t.gateway.send({ DEFINEPROPERTYBYIDX, 1, 0 });
+  t.second.send({ DEFINETHINGBYIDX, 1 });
+  t.run();
+  frames = t.gateway.receive();
+  CHECK_EQUAL(1, frames.size());
+  CHECK_EQUAL(DETAILPROPERTYBYIDX, frames[0][0]);
+  frames = t.second.receive();
+  CHECK_EQUAL(1, frames.size());
+  CHECK_EQUAL(DETAILTHINGBYIDX, frames[0][0]);
+}
+
+
+TEST(routedThingsPairForEachLink)
+{
+  TestAdapter t;
+
+  CHECK_FRAME(t.ask(t.gateway, { PAIR, 1 })[0], PAIRED, 1);
+  CHECK_FRAME(t.ask(t.second, { PAIR, 1 })[0], PAIRED, 1);
+
+  // The first gateway still has it, so the board stays paired
+  CHECK_FRAME(t.ask(t.second, { UNPAIR, 1 })[0], UNPAIRED, 1);
+  CHECK(t.meter.paired);
+
+  // ...and only the first gateway hears of changes
+  t.level.setValue(5);
+  t.run();
+  Frames frames = t.gateway.receive();
+  CHECK_EQUAL(1, frames.size());
+  CHECK_FRAME(frames[0], PROPERTYSTATUS, 1, 0, 0, 0, 0, 5);
+  CHECK_EQUAL(0, t.second.receive().size());
+
+  CHECK_FRAME(t.ask(t.gateway, { UNPAIR, 1 })[0], UNPAIRED, 1);
+  CHECK(!t.meter.paired);
+}
+
+
+TEST(routedStatusOnlyGoesWherePaired)
+{
+  TestAdapter t;
+
+  t.ask(t.second, { PAIR, 1 });
+  t.level.setValue(7);
+  t.run();
+  CHECK_FRAME(t.second.receive()[0], PROPERTYSTATUS, 1, 0, 0, 0, 0, 7);
+  CHECK_EQUAL(0, t.gateway.receive().size());
+
+  // A SETPROPERTY reply goes to the asker, even though it looks like a change
+  CHECK_FRAME(t.ask(t.second, { SETPROPERTY, 1, 0, 0, 0, 0, 9 })[0], PROPERTYSTATUS, 1, 0, 0, 0, 0, 9);
+  CHECK_EQUAL(0, t.gateway.receive().size());
+}
+
+
+TEST(routedRepliesFollowSequenceIds)
+{
+  TestAdapter t;
+
+  CHECK_FRAME(t.ask(t.gateway, { SETOPTIONS, OPTION_SEQUENCE })[0], OPTIONS, OPTION_SEQUENCE);
+  CHECK_FRAME(t.ask(t.second, { SETOPTIONS, OPTION_SEQUENCE })[0], OPTIONS, OPTION_SEQUENCE);
+
+  // The same sequence id from both gateways
+  t.gateway.send({ PAIR, 3, 1 });
+  t.second.send({ PAIR, 3, 1 });
+  t.run();
+  CHECK_FRAME(t.gateway.receive()[0], PAIRED, 3, 1);
+  CHECK_FRAME(t.second.receive()[0], PAIRED, 3, 1);
+
+  CHECK_FRAME(t.ask(t.second, { GETPROPERTY, 4, 1, 0 })[0], PROPERTYSTATUS, 4, 1, 0, 0, 0, 0, 0);
+  CHECK_EQUAL(0, t.gateway.receive().size());
+}
+
+
+TEST(optionsAreKeptForEachLink)
+{
+  TestAdapter t;
+
+  CHECK_FRAME(t.ask(t.second, { SETOPTIONS, OPTION_SEQUENCE })[0], OPTIONS, OPTION_SEQUENCE);
+
+  // The first gateway still talks without sequence ids
+  CHECK_FRAME(t.ask(t.gateway, { PAIR, 0 })[0], PAIRED, 0);
+  CHECK_FRAME(t.ask(t.gateway, { GETPROPERTY, 0, 0 })[0], PROPERTYSTATUS, 0, 0, 0);
+  CHECK_FRAME(t.ask(t.second, { DEFINETHINGBYIDX, 5, 0 })[0], DETAILTHINGBYIDX, 5, 0, ONOFFLIGHT, 'L', 'E', 'D', 0,
+              'T', 'e', 's', 't', ' ', 'L', 'E', 'D', 0, 1, 0, 0);
+}
+
+
+TEST(optionsThatChangePushedFramesAreRefused)
+{
+  TestAdapter t;
+
+  t.ask(t.gateway, { PAIR, 0 });
+
+  // Status messages for the first gateway are built without batches
+  CHECK_FRAME(t.ask(t.second, { SETOPTIONS, OPTION_BATCHSTATUS })[0], ERROR, ERROR_OPTIONS_CONFLICT);
+  CHECK_FRAME(t.ask(t.second, { SETOPTIONS, 0 })[0], OPTIONS, 0);
+
+  // With nothing paired there, the second gateway can choose its own, but can't then pair
+  CHECK_FRAME(t.ask(t.gateway, { UNPAIR, 0 })[0], UNPAIRED, 0);
+  CHECK_FRAME(t.ask(t.second, { SETOPTIONS, OPTION_BATCHSTATUS })[0], OPTIONS, OPTION_BATCHSTATUS);
+  CHECK_FRAME(t.ask(t.gateway, { PAIR, 0 })[0], PAIRED, 0);
+  CHECK_FRAME(t.ask(t.second, { PAIR, 0 })[0], ERROR, ERROR_OPTIONS_CONFLICT);
+
+  t.on.setValue(true);
+  t.run();
+  CHECK_FRAME(t.gateway.receive()[0], PROPERTYSTATUS, 0, 0, 1);
+  CHECK_EQUAL(0, t.second.receive().size());
+}
+
+
+TEST(routedRequestsNeedTheRoutesOptions)
+{
+  TestAdapter t;
+
+  // The board behind follows the last options accepted
+  CHECK_FRAME(t.ask(t.second, { SETOPTIONS, OPTION_SEQUENCE })[0], OPTIONS, OPTION_SEQUENCE);
+  CHECK_FRAME(t.ask(t.gateway, { DEFINETHINGBYIDX, 1 })[0], ERROR, ERROR_OPTIONS_CONFLICT);
+  CHECK_EQUAL(DETAILTHINGBYIDX, t.ask(t.second, { DEFINETHINGBYIDX, 7, 1 })[0][0]);
+  CHECK_FRAME(t.ask(t.second, { PAIR, 8, 1 })[0], PAIRED, 8, 1);
+
+  t.level.setValue(3);
+  t.run();
+  CHECK_FRAME(t.second.receive()[0], PROPERTYSTATUS, 0, 1, 0, 0, 0, 0, 3);
+}
+
+
+TEST(fingerprintIsZeroWithRoutes)
+{
+  TestAdapter t;
+
+  Frame detail = t.ask(t.gateway, { DEFINEADAPTER })[0];
+  CHECK_EQUAL(DETAILADAPTER, detail[0]);
+  CHECK_FRAME(Frame(detail.end() - 5, detail.end()), 2, 0, 0, 0, 0);
+}
@@ -0,0 +1,151 @@
+/*
+|| QueueTests.cpp - The transmit queue (THINGTXQUEUESIZE), and frames bigger than the stream's
+|| transmit buffer.
+*/
+
+#define THINGTXQUEUESIZE 128
+
+#include <PackedSerialThingAdapter.h>
+
+#include "TestHarness.h"
+
+
+// A sign with a long label and a level, on a stream with a 40 byte transmit buffer.
+struct TestAdapter
+{
+  TestAdapter()
+    : adapter("Adapter", "An adapter with a long description"),
+      sign("Sign", "Test sign", THING),
+      label("label", "Label"),
+      level("level", "Level"),
+      gateway(stream)
+  {
+    sign.addProperty(label);
+    sign.addProperty(level);
+    adapter.addDevice(sign);
+    stream.setRoom(40);
+    adapter.begin(stream);
+  }
+
+  PackedSerialThingAdapter adapter;
+  ThingDevice sign;
+  ThingPropertyString label;
+  ThingPropertyNumber level;
+  TestStream stream;
+  TestGateway gateway;
+};
+
+
+TEST(responsesWaitForRoom)
+{
+  TestAdapter t;
+
+  t.gateway.request(t.adapter, { PAIR, 0 });
+
+  // The buffer has filled up, so this waits in the queue
+  t.stream.setRoom(2);
+  CHECK_EQUAL(0, t.gateway.request(t.adapter, { GETPROPERTY, 0, 1 }).size());
+  CHECK(t.adapter.hasPendingWork());
+
+  t.stream.setRoom(40);
+  t.adapter.update();
+  CHECK_FRAME(t.gateway.receive()[0], PROPERTYSTATUS, 0, 1, 0, 0, 0, 0);
+}
+
+
+TEST(framesBiggerThanTheBufferStillGo)
+{
+  TestAdapter t;
+
+  // 43 bytes framed, which never fits in 40, so it goes once the buffer is empty
+  Frames frames = t.gateway.request(t.adapter, { DEFINEADAPTER });
+  CHECK_EQUAL(1, frames.size());
+  CHECK_EQUAL(DETAILADAPTER, frames[0][0]);
+
+  // ...and only then: queued behind a partly full buffer
+  t.stream.setRoom(39);
+  CHECK_EQUAL(0, t.gateway.request(t.adapter, { DEFINEADAPTER }).size());
+  t.stream.setRoom(40);
+  t.adapter.update();
+  CHECK_EQUAL(1, t.gateway.receive().size());
+}
+
+
+TEST(changesThatDontFitArePassedOver)
+{
+  TestAdapter t;
+
+  t.gateway.request(t.adapter, { PAIR, 0 });
+
+  // A label too long for the room left, but the level fits
+  t.label.setValue("a label of thirty characters!!");
+  t.level.setValue(7);
+  t.stream.setRoom(12);
+  t.adapter.update();
+  Frames frames = t.gateway.receive();
+  CHECK_EQUAL(1, frames.size());
+  CHECK_FRAME(frames[0], PROPERTYSTATUS, 0, 1, 0, 0, 0, 7);
+
+  // The label goes first next time
+  t.level.setValue(8);
+  t.stream.setRoom(39);
+  t.adapter.update();
+  frames = t.gateway.receive();
+  CHECK_EQUAL(1, frames.size());
+  CHECK_EQUAL(34, frames[0].size());
+}
+
+
+TEST(changesBiggerThanTheBufferStillGo)
+{
+  TestAdapter t;
+
+  t.gateway.request(t.adapter, { PAIR, 0 });
+  t.stream.setRoom(40);
+
+  t.label.setValue("a label that never fits in the buffer");
+  t.level.setValue(7);
+  t.adapter.update();
+
+  Frames frames = t.gateway.receive();
+  CHECK_EQUAL(1, frames.size());
+  CHECK_EQUAL(41, frames[0].size());
+
+  // Which filled it up for now
+  t.stream.setRoom(40);
+  t.adapter.update();
+  CHECK_FRAME(t.gateway.receive()[0], PROPERTYSTATUS, 0, 1, 0, 0, 0, 7);
+}
+
+
+// A stream with a banner still going out when the adapter starts: 40 bytes of room once flushed.
+class BannerStream : public TestStream
+{
+  public:
+    BannerStream()
+    {
+      setRoom(30);
+    }
+
+    void flush()
+    {
+      setRoom(40);
+    }
+};
+
+
+TEST(theBufferIsMeasuredOnceFlushed)
+{
+  PackedSerialThingAdapter adapter("Adapter", "An adapter with a long description");
+  BannerStream stream;
+  TestGateway gateway(stream);
+
+  adapter.begin(stream);
+
+  // 30 bytes of room is a partly full buffer, not an empty one, so this waits
+  stream.setRoom(30);
+  CHECK_EQUAL(0, gateway.request(adapter, { DEFINEADAPTER }).size());
+  stream.setRoom(40);
+  adapter.update();
+  CHECK_EQUAL(1, gateway.receive().size());
+}
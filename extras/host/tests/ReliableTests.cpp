@@ -0,0 +1,161 @@
+/*
+|| ReliableTests.cpp - OPTION_RELIABLE: CRCs, the acknowledgement window and retransmits.
+*/
+
+#define THINGRELIABLEWINDOW 4
+#define THINGRELIABLETIMEOUT 100
+#define THINGTXQUEUESIZE 128
+#define THINGSTATS 1
+
+#include <PackedSerialThingAdapter.h>
+
+#include "TestHarness.h"
+
+
+// A meter with a level, with OPTION_RELIABLE on and the meter paired (frame 0 is PAIRED).
+struct TestAdapter
+{
+  TestAdapter()
+    : adapter("Adapter", "Test adapter"),
+      meter("Meter", "Test meter", THING),
+      level("level", "Level"),
+      gateway(stream)
+  {
+    meter.addProperty(level);
+    adapter.addDevice(meter);
+    adapter.begin(stream);
+
+    gateway.request(adapter, { SETOPTIONS, OPTION_RELIABLE });
+    request({ PAIR, 0 });
+    adapter.resetStats();
+  }
+
+  // Sends request with its CRC, and returns what came back.
+  Frames request(Frame request)
+  {
+    uint16_t crc = PackedSerialThingAdapter::crc16(request.data(), request.size());
+
+    request.push_back(crc >> 8);
+    request.push_back(crc & 0xff);
+
+    return gateway.request(adapter, request);
+  }
+
+  // Pushes a change of level, which goes out as the next frame in the window.
+  void change(int32_t value)
+  {
+    level.setValue(value);
+    adapter.update();
+  }
+
+  PackedSerialThingAdapter adapter;
+  ThingDevice meter;
+  ThingPropertyNumber level;
+  TestStream stream;
+  TestGateway gateway;
+};
+
+
+TEST(framesCarryTheirSequenceNumber)
+{
+  TestAdapter t;
+
+  t.change(1);
+  Frame frame = t.gateway.receive()[0];
+  CHECK_EQUAL(PROPERTYSTATUS, frame[0]);
+  CHECK_EQUAL(1, frame[frame.size() - 3]);
+  CHECK_EQUAL(PackedSerialThingAdapter::crc16(frame.data(), frame.size() - 2),
+              (frame[frame.size() - 2] << 8) | frame[frame.size() - 1]);
+}
+
+
+TEST(gapsAreResentOncePerTimeout)
+{
+  TestAdapter t;
+
+  t.change(1);
+  t.change(2);
+  t.change(3);
+  t.gateway.receive();
+
+  // 1 and 3 arrived, 0 and 2 didn't
+  Frames frames = t.request({ LINKACK, 0, 0x05 });
+  CHECK_EQUAL(2, frames.size());
+  CHECK_EQUAL(0, frames[0][frames[0].size() - 3]);
+  CHECK_EQUAL(2, frames[1][frames[1].size() - 3]);
+
+  // Reporting the same gaps again sends nothing more...
+  CHECK_EQUAL(0, t.request({ LINKACK, 0, 0x05 }).size());
+  CHECK_EQUAL(2, t.adapter.getStats().retransmits);
+
+  // ...until the timeout, which sends them once more
+  hostAdvanceMillis(100);
+  t.adapter.update();
+  CHECK_EQUAL(2, t.gateway.receive().size());
+  CHECK_EQUAL(0, t.request({ LINKACK, 0, 0x05 }).size());
+  CHECK_EQUAL(4, t.adapter.getStats().retransmits);
+}
+
+
+TEST(resendsWaitForRoomInTheStream)
+{
+  TestAdapter t;
+
+  t.change(1);
+  t.change(2);
+  t.change(3);
+  t.gateway.receive();
+
+  // Nothing is acknowledged, but nothing fits either
+  t.stream.setRoom(0);
+  hostAdvanceMillis(100);
+  t.adapter.update();
+  CHECK_EQUAL(0, t.gateway.receive().size());
+  CHECK(t.adapter.hasPendingWork());
+
+  // Room for the first two of the four
+  t.stream.setRoom(19);
+  t.adapter.update();
+  Frames frames = t.gateway.receive();
+  CHECK_EQUAL(2, frames.size());
+  CHECK_EQUAL(0, frames[0][frames[0].size() - 3]);
+  CHECK_EQUAL(1, frames[1][frames[1].size() - 3]);
+
+  // Frame 0 is acknowledged, and a change takes its place in the window behind the other two
+  CHECK_EQUAL(0, t.request({ LINKACK, 1, 0 }).size());
+  t.level.setValue(4);
+  t.stream.setRoom(1024);
+  t.adapter.update();
+  frames = t.gateway.receive();
+  CHECK_EQUAL(3, frames.size());
+  CHECK_EQUAL(2, frames[0][frames[0].size() - 3]);
+  CHECK_EQUAL(3, frames[1][frames[1].size() - 3]);
+  CHECK_FRAME(frames[2], PROPERTYSTATUS, 0, 0, 0, 0, 0, 4, 4, frames[2][8], frames[2][9]);
+  CHECK_EQUAL(4, t.adapter.getStats().retransmits);
+}
+
+
+TEST(responsesWaitForRoomInTheWindow)
+{
+  TestAdapter t;
+
+  // Frames 0 to 3 fill the window
+  t.change(1);
+  t.change(2);
+  t.change(3);
+  t.gateway.receive();
+
+  CHECK_EQUAL(0, t.request({ GETPROPERTY, 0, 0 }).size());
+  CHECK_EQUAL(0, t.request({ GETPROPERTY, 0, 0 }).size());
+  CHECK(t.adapter.hasPendingWork());
+
+  // Acknowledging them lets both responses go on the next update(), nothing given up on
+  CHECK_EQUAL(0, t.request({ LINKACK, 4, 0 }).size());
+  t.adapter.update();
+  Frames frames = t.gateway.receive();
+  CHECK_EQUAL(2, frames.size());
+  CHECK_EQUAL(PROPERTYSTATUS, frames[0][0]);
+  CHECK_EQUAL(4, frames[0][frames[0].size() - 3]);
+  CHECK_EQUAL(5, frames[1][frames[1].size() - 3]);
+  CHECK_EQUAL(0, t.adapter.getStats().abandoned);
+}
@@ -0,0 +1,399 @@
+/*
+|| RequestTests.cpp - The request table, DEFINE*, pairing, properties and status encodings,
+|| with the default options.
+*/
+
+#include <PackedSerialThingAdapter.h>
+
+#include "TestHarness.h"
+
+
+// Two things: an LED with a BOOLEAN, and a meter with two NUMBERs.
+struct TestAdapter
+{
+  TestAdapter()
+    : adapter("Adapter", "Test adapter"),
+      led("LED", "Test LED", ONOFFLIGHT),
+      meter("Meter", "Test meter", THING),
+      on("on", "LED on"),
+      level("level", "Level"),
+      peak("peak", "Peak"),
+      gateway(stream)
+  {
+    led.addProperty(on);
+    meter.addProperty(level);
+    meter.addProperty(peak);
+    adapter.addDevice(led);
+    adapter.addDevice(meter);
+    adapter.begin(stream);
+  }
+
+  void pairAll()
+  {
+    gateway.request(adapter, { PAIR, 0 });
+    gateway.request(adapter, { PAIR, 1 });
+  }
+
+  PackedSerialThingAdapter adapter;
+  ThingDevice led;
+  ThingDevice meter;
+  ThingPropertyBoolean on;
+  ThingPropertyNumber level;
+  ThingPropertyNumber peak;
+  TestStream stream;
+  TestGateway gateway;
+};
+
+
+TEST(defineAdapterDescribesTheAdapter)
+{
+  TestAdapter t;
+  Frames frames = t.gateway.request(t.adapter, { DEFINEADAPTER });
+
+  CHECK_EQUAL(1, frames.size());
+  CHECK_EQUAL(DETAILADAPTER, frames[0][0]);
+  CHECK_EQUAL("Adapter", stringAt(frames[0], 1));
+  CHECK_EQUAL("Test adapter", stringAt(frames[0], 9));
+  CHECK_EQUAL(2, frames[0][22]);
+  CHECK_EQUAL(27, frames[0].size());  // ends with the 4 byte fingerprint
+}
+
+
+TEST(defineThingAndProperty)
+{
+  TestAdapter t;
+  Frames frames = t.gateway.request(t.adapter, { DEFINETHINGBYIDX, 1 });
+
+  CHECK_FRAME(frames[0], DETAILTHINGBYIDX, 1, THING, 'M', 'e', 't', 'e', 'r', 0,
+              'T', 'e', 's', 't', ' ', 'm', 'e', 't', 'e', 'r', 0, 2, 0, 0);
+
+  t.level.setValue(258);
+  frames = t.gateway.request(t.adapter, { DEFINEPROPERTYBYIDX, 1, 0 });
+  CHECK_FRAME(frames[0], DETAILPROPERTYBYIDX, 1, 0, NUMBER, 'l', 'e', 'v', 'e', 'l', 0,
+              'L', 'e', 'v', 'e', 'l', 0, 0, 0, 1, 2);
+}
+
+
+TEST(badIndexesAreRefused)
+{
+  TestAdapter t;
+
+  CHECK_FRAME(t.gateway.request(t.adapter, { DEFINETHINGBYIDX, 2 })[0], ERROR, ERROR_THINGIDX_OUTOFRANGE);
+  CHECK_FRAME(t.gateway.request(t.adapter, { DEFINEPROPERTYBYIDX, 0, 1 })[0], ERROR, ERROR_PROPERTYIDX_OUTOFRANGE);
+}
+
+
+TEST(shortAndUnknownRequestsAreRefused)
+{
+  TestAdapter t;
+
+  CHECK_FRAME(t.gateway.request(t.adapter, { DEFINETHINGBYIDX })[0], ERROR, ERROR_REQUEST_INVALID);
+  CHECK_FRAME(t.gateway.request(t.adapter, { GETPROPERTY, 1 })[0], ERROR, ERROR_REQUEST_INVALID);
+  CHECK_FRAME(t.gateway.request(t.adapter, { SETBITRATE, 0, 1 })[0], ERROR, ERROR_REQUEST_INVALID);
+  CHECK_FRAME(t.gateway.request(t.adapter, { 0x40 })[0], ERROR, ERROR_REQUEST_INVALID);
+  CHECK_FRAME(t.gateway.request(t.adapter, { GETSTATS, 0 })[0], ERROR, ERROR_REQUEST_INVALID);
+  CHECK_FRAME(t.gateway.request(t.adapter, { LINKACK, 0, 0 })[0], ERROR, ERROR_REQUEST_INVALID);
+
+  // Events, actions and subscriptions are left out by default
+  CHECK_FRAME(t.gateway.request(t.adapter, { DEFINEEVENTBYIDX, 0, 0 })[0], ERROR, ERROR_REQUEST_INVALID);
+  CHECK_FRAME(t.gateway.request(t.adapter, { INVOKEACTION, 0, 0 })[0], ERROR, ERROR_REQUEST_INVALID);
+  CHECK_FRAME(t.gateway.request(t.adapter, { SUBSCRIBE, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0 })[0], ERROR, ERROR_REQUEST_INVALID);
+}
+
+
+TEST(propertiesNeedPairing)
+{
+  TestAdapter t;
+
+  CHECK_FRAME(t.gateway.request(t.adapter, { GETPROPERTY, 0, 0 })[0], ERROR, ERROR_NOT_PAIRED);
+  CHECK_FRAME(t.gateway.request(t.adapter, { PAIR, 0 })[0], PAIRED, 0);
+  CHECK_FRAME(t.gateway.request(t.adapter, { GETPROPERTY, 0, 0 })[0], PROPERTYSTATUS, 0, 0, 0);
+  CHECK_FRAME(t.gateway.request(t.adapter, { UNPAIR, 0 })[0], UNPAIRED, 0);
+  CHECK_FRAME(t.gateway.request(t.adapter, { GETPROPERTY, 0, 0 })[0], ERROR, ERROR_NOT_PAIRED);
+}
+
+
+TEST(setPropertySetsAndAnswers)
+{
+  TestAdapter t;
+
+  t.pairAll();
+  CHECK_FRAME(t.gateway.request(t.adapter, { SETPROPERTY, 0, 0, 1 })[0], PROPERTYSTATUS, 0, 0, 1);
+  CHECK(t.on.getValue());
+  CHECK_FRAME(t.gateway.request(t.adapter, { SETPROPERTY, 1, 1, 0xff, 0xff, 0xff, 0xfe })[0],
+              PROPERTYSTATUS, 1, 1, 0xff, 0xff, 0xff, 0xfe);
+  CHECK_EQUAL(-2, t.peak.getValue());
+
+  // Changes made by the gateway aren't echoed back by update()
+  t.adapter.update();
+  CHECK_EQUAL(0, t.gateway.receive().size());
+
+  // A NUMBER cut short is refused, and the value left alone
+  CHECK_FRAME(t.gateway.request(t.adapter, { SETPROPERTY, 1, 1, 0, 0, 0 })[0], ERROR, ERROR_VALUE_INVALID);
+  CHECK_EQUAL(-2, t.peak.getValue());
+}
+
+
+TEST(updateSendsChangesOfPairedThings)
+{
+  TestAdapter t;
+
+  t.level.setValue(5);
+  t.adapter.update();
+  CHECK_EQUAL(0, t.gateway.receive().size());
+
+  // Changes made while unpaired go out on PAIR
+  Frames frames = t.gateway.request(t.adapter, { PAIR, 1 });
+  CHECK_EQUAL(2, frames.size());
+  CHECK_FRAME(frames[1], PROPERTYSTATUS, 1, 0, 0, 0, 0, 5);
+
+  t.peak.setValue(7);
+  t.adapter.update();
+  frames = t.gateway.receive();
+  CHECK_EQUAL(1, frames.size());
+  CHECK_FRAME(frames[0], PROPERTYSTATUS, 1, 1, 0, 0, 0, 7);
+
+  // Only once
+  t.adapter.update();
+  CHECK_EQUAL(0, t.gateway.receive().size());
+}
+
+
+TEST(setChangedMarksTheProperty)
+{
+  TestAdapter t;
+
+  t.pairAll();
+  t.level.value = 9;
+  t.adapter.setChanged(t.level);
+  t.adapter.update();
+  CHECK_FRAME(t.gateway.receive()[0], PROPERTYSTATUS, 1, 0, 0, 0, 0, 9);
+}
+
+
+TEST(batchStatusPacksChanges)
+{
+  TestAdapter t;
+
+  t.pairAll();
+  CHECK_FRAME(t.gateway.request(t.adapter, { SETOPTIONS, OPTION_BATCHSTATUS })[0], OPTIONS, OPTION_BATCHSTATUS);
+
+  t.on.setValue(true);
+  t.level.setValue(1);
+  t.peak.setValue(2);
+  t.adapter.update();
+
+  Frames frames = t.gateway.receive();
+  CHECK_EQUAL(1, frames.size());
+  CHECK_FRAME(frames[0], PROPERTYSTATUSBATCH, 3, 0, 0, 1, 1, 0, 0, 0, 0, 1, 1, 1, 0, 0, 0, 2);
+}
+
+
+TEST(unsupportedOptionsAreNotAccepted)
+{
+  TestAdapter t;
+
+  CHECK_FRAME(t.gateway.request(t.adapter, { SETOPTIONS, 0xff })[0], OPTIONS, THINGSUPPORTEDOPTIONS);
+  // OPTION_SEQUENCE is on now, and OPTION_DELTANUMBER needs OPTION_COMPACTNUMBER
+  CHECK_FRAME(t.gateway.request(t.adapter, { SETOPTIONS, 1, OPTION_DELTANUMBER })[0], OPTIONS, 1, 0);
+}
+
+
+TEST(sequenceIdsTagResponses)
+{
+  TestAdapter t;
+
+  t.gateway.request(t.adapter, { SETOPTIONS, OPTION_SEQUENCE });
+  CHECK_FRAME(t.gateway.request(t.adapter, { PAIR, 7, 1 })[0], PAIRED, 7, 1);
+  CHECK_FRAME(t.gateway.request(t.adapter, { GETPROPERTY, 8, 1, 0 })[0], PROPERTYSTATUS, 8, 1, 0, 0, 0, 0, 0);
+  CHECK_FRAME(t.gateway.request(t.adapter, { DEFINETHINGBYIDX, 9 })[0], ERROR, 9, ERROR_REQUEST_INVALID);
+
+  // Pushed by update(), so 0
+  t.level.setValue(3);
+  t.adapter.update();
+  CHECK_FRAME(t.gateway.receive()[0], PROPERTYSTATUS, 0, 1, 0, 0, 0, 0, 3);
+}
+
+
+TEST(defineAllSendsTheWholeSchema)
+{
+  TestAdapter t;
+  Frames frames = t.gateway.request(t.adapter, { DEFINEALL });
+
+  // Adapter, 2 things, 3 properties, then DETAILCOMPLETE
+  CHECK_EQUAL(7, frames.size());
+  CHECK_EQUAL(DETAILADAPTER, frames[0][0]);
+  CHECK_EQUAL(DETAILTHINGBYIDX, frames[1][0]);
+  CHECK_EQUAL(DETAILPROPERTYBYIDX, frames[2][0]);
+  CHECK_EQUAL(DETAILTHINGBYIDX, frames[3][0]);
+  CHECK_FRAME(frames[6], DETAILCOMPLETE, 6);
+}
+
+
+TEST(fingerprintFollowsTheSchema)
+{
+  TestAdapter a;
+  TestAdapter b;
+  Frame first = a.gateway.request(a.adapter, { DEFINEADAPTER })[0];
+
+  CHECK_EQUAL(first, b.gateway.request(b.adapter, { DEFINEADAPTER })[0]);
+
+  b.peak.name = "max";
+  b.adapter.begin(b.stream);
+  CHECK(first != b.gateway.request(b.adapter, { DEFINEADAPTER })[0]);
+}
+
+
+TEST(bitratesNeedAHandler)
+{
+  TestAdapter t;
+
+  CHECK_FRAME(t.gateway.request(t.adapter, { DEFINEBITRATES })[0], DETAILBITRATES, 0);
+  CHECK_FRAME(t.gateway.request(t.adapter, { SETBITRATE, 0, 0x07, 0xa1, 0x20 })[0], ERROR, ERROR_BITRATE_UNSUPPORTED);
+}
+
+
+static uint32_t switchedTo;
+
+TEST(bitrateSwitchesAfterTheResponse)
+{
+  TestAdapter t;
+
+  switchedTo = 0;
+  t.adapter.setBitrateHandler([](uint32_t bps) { switchedTo = bps; }, 115200, 500000);
+
+  CHECK_FRAME(t.gateway.request(t.adapter, { DEFINEBITRATES })[0], DETAILBITRATES, 5,
+              0x00, 0x01, 0xc2, 0x00, 0x00, 0x03, 0x84, 0x00, 0x00, 0x03, 0xd0, 0x90, 0x00, 0x07, 0x08, 0x00,
+              0x00, 0x07, 0xa1, 0x20);
+  CHECK_FRAME(t.gateway.request(t.adapter, { SETBITRATE, 0x00, 0x07, 0xa1, 0x20 })[0], BITRATE, 0x00, 0x07, 0xa1, 0x20);
+  t.adapter.update();
+  CHECK_EQUAL(500000, switchedTo);
+
+  // Nothing heard at the new rate, so fall back
+  hostAdvanceMillis(THINGBITRATETIMEOUT + 1);
+  t.adapter.update();
+  CHECK_EQUAL(115200, switchedTo);
+}
+
+
+TEST(snapshotsAreConditional)
+{
+  TestAdapter t;
+
+  t.pairAll();
+  t.level.setValue(4);
+  t.adapter.update();
+  t.gateway.receive();
+
+  Frames frames = t.gateway.request(t.adapter, { GETSNAPSHOT, 1, 0, 0 });
+  CHECK_EQUAL(1, frames.size());
+  CHECK_EQUAL(SNAPSHOT, frames[0][0]);
+
+  // Thing 1 at the generation just reported
+  const Frame &snapshot = frames[0];
+  uint8_t high = snapshot[6];
+  uint8_t low = snapshot[7];
+
+  CHECK_FRAME(t.gateway.request(t.adapter, { GETSNAPSHOT, 1, high, low })[0], SNAPSHOTUNCHANGED, 1, high, low);
+
+  t.level.setValue(5);
+  t.adapter.update();
+  t.gateway.receive();
+  CHECK_EQUAL(SNAPSHOT, t.gateway.request(t.adapter, { GETSNAPSHOT, 1, high, low })[0][0]);
+}
+
+
+TEST(snapshotOfEveryPairedThing)
+{
+  TestAdapter t;
+
+  t.pairAll();
+  t.on.setValue(true);
+  t.level.setValue(-1);
+  t.adapter.update();
+  t.gateway.receive();
+
+  Frame snapshot = t.gateway.request(t.adapter, { GETSNAPSHOT, 0xff, 0, 0 })[0];
+
+  CHECK_EQUAL(SNAPSHOT, snapshot[0]);
+  CHECK_EQUAL(0, snapshot[1]);  // no more frames
+  CHECK_EQUAL(2, snapshot[4]);  // things
+  CHECK_EQUAL(5 + (4 + 1) + (4 + 4 + 4), snapshot.size());
+}
+
+
+TEST(updateBudgetGoesRoundRobin)
+{
+  TestAdapter t;
+
+  t.pairAll();
+  t.adapter.setUpdateBudget(1, 0);
+
+  t.on.setValue(true);
+  t.level.setValue(1);
+  t.peak.setValue(2);
+  t.adapter.update();
+  CHECK_FRAME(t.gateway.receive()[0], PROPERTYSTATUS, 0, 0, 1);
+
+  // The LED changes again, but the rest go first
+  t.on.setValue(false);
+  t.adapter.update();
+  CHECK_FRAME(t.gateway.receive()[0], PROPERTYSTATUS, 1, 0, 0, 0, 0, 1);
+  t.adapter.update();
+  CHECK_FRAME(t.gateway.receive()[0], PROPERTYSTATUS, 1, 1, 0, 0, 0, 2);
+  t.adapter.update();
+  CHECK_FRAME(t.gateway.receive()[0], PROPERTYSTATUS, 0, 0, 0);
+}
+
+
+TEST(pendingWorkAndDueTimes)
+{
+  TestAdapter t;
+
+  t.pairAll();
+  CHECK(!t.adapter.hasPendingWork());
+  CHECK_EQUAL(0xffffffff, t.adapter.millisUntilDue());
+
+  t.level.setValue(1);
+  CHECK(t.adapter.hasPendingWork());
+  t.adapter.update();
+  t.gateway.receive();
+  CHECK(!t.adapter.hasPendingWork());
+
+  t.gateway.send({ GETPROPERTY, 1, 0 });
+  CHECK(t.adapter.hasPendingWork());
+}
+
+
+static int wakeCount;
+
+TEST(wakeHandlerRunsOnChanges)
+{
+  TestAdapter t;
+
+  wakeCount = 0;
+  t.adapter.setWakeHandler([]() { wakeCount++; });
+  t.adapter.setChanged(t.level);
+  CHECK_EQUAL(1, wakeCount);
+}
+
+
+TEST(thingOffsetNumbersThingsOnTheWire)
+{
+  TestAdapter t;
+
+  t.adapter.setThingOffset(3);
+  CHECK_FRAME(t.gateway.request(t.adapter, { PAIR, 4 })[0], PAIRED, 4);
+  CHECK_FRAME(t.gateway.request(t.adapter, { GETPROPERTY, 4, 1 })[0], PROPERTYSTATUS, 4, 1, 0, 0, 0, 0);
+  CHECK_FRAME(t.gateway.request(t.adapter, { PAIR, 1 })[0], ERROR, ERROR_THINGIDX_OUTOFRANGE);
+}
+
+
+TEST(responsesThatDontFitAreReplacedByAnError)
+{
+  TestAdapter t;
+  static const char longName[] = "A name much too long to fit in one frame along with everything else";
+
+  t.meter.name = longName;
+  CHECK_FRAME(t.gateway.request(t.adapter, { DEFINETHINGBYIDX, 1 })[0], ERROR, ERROR_FRAME_OVERFLOW);
+}
@@ -0,0 +1,275 @@
+/*
+|| TestHarness.h - A small test runner, and a scripted gateway to drive an adapter with.
+||
+|| Each test file defines its THING* options, includes PackedSerialThingAdapter.h and this
+|| header, and registers tests with TEST().  TestMain.cpp runs them, with the clock frozen at 0
+|| at the start of each (see hostSetMicros()).
+||
+|| More notes at the bottom.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+#include <PackedSerial.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+
+// A frame as sent or received, without its framing.  Indexing past the end gives 0 (and
+// Frames below an empty frame), so a missing or short reply fails its check rather than the
+// test run.
+class Frame : public std::vector<uint8_t>
+{
+  public:
+    Frame()
+    {
+    }
+
+    Frame(std::initializer_list<uint8_t> bytes)
+      : std::vector<uint8_t>(bytes)
+    {
+    }
+
+    template<class Iterator> Frame(Iterator first, Iterator last)
+      : std::vector<uint8_t>(first, last)
+    {
+    }
+
+    uint8_t operator[](size_t i) const
+    {
+      return (i < size()) ? std::vector<uint8_t>::operator[](i) : 0;
+    }
+};
+
+
+class Frames : public std::vector<Frame>
+{
+  public:
+    const Frame &operator[](size_t i) const
+    {
+      static const Frame none;
+
+      return (i < size()) ? std::vector<Frame>::operator[](i) : none;
+    }
+};
+
+
+struct TestCase
+{
+  const char *name;
+  void (*run)();
+};
+
+
+std::vector<TestCase> &testCases();
+void testFailed(const char *file, int line, const std::string &message);
+
+
+struct TestRegistrar
+{
+  TestRegistrar(const char *name, void (*run)())
+  {
+    TestCase test = { name, run };
+
+    testCases().push_back(test);
+  }
+};
+
+
+#define TEST(name) \
+  static void name(); \
+  static TestRegistrar name##Registrar(#name, name); \
+  static void name()
+
+#define CHECK(condition) \
+  do { if (!(condition)) testFailed(__FILE__, __LINE__, "CHECK(" #condition ")"); } while (0)
+
+#define CHECK_EQUAL(expected, actual) \
+  do { \
+    std::string e = describe(expected), a = describe(actual); \
+    if (e != a) testFailed(__FILE__, __LINE__, #actual ": expected " + e + ", got " + a); \
+  } while (0)
+
+// The NUL terminated string at index in frame (or up to its end).
+inline std::string stringAt(const Frame &frame, size_t index)
+{
+  std::string s;
+
+  while (index < frame.size() && frame[index] != 0)
+    s += (char) frame[index++];
+
+  return s;
+}
+
+
+// Compare a frame with the bytes given, e.g. CHECK_FRAME(frames[0], PAIRED, 0)
+#define CHECK_FRAME(actual, ...) CHECK_EQUAL(Frame({ __VA_ARGS__ }), actual)
+
+
+inline std::string describe(long long value)
+{
+  return std::to_string(value);
+}
+
+
+inline std::string describe(const std::string &value)
+{
+  return "\"" + value + "\"";
+}
+
+
+inline std::string describe(const Frame &frame)
+{
+  static const char digits[] = "0123456789abcdef";
+  std::string s = "[";
+
+  for (size_t i = 0; i < frame.size(); i++)
+  {
+    if (i > 0)
+      s += ' ';
+    s += digits[frame[i] >> 4];
+    s += digits[frame[i] & 0x0f];
+  }
+
+  return s + "]";
+}
+
+
+// The adapter's end of the link.  Requests queued by TestGateway are read from input, and
+// what the adapter writes collects in output.  room limits availableForWrite() and, like a
+// full transmit buffer, shrinks as bytes are written until setRoom() is called again.
+class TestStream : public Stream
+{
+  public:
+    TestStream()
+      : room(1024)
+    {
+    }
+
+    int available()
+    {
+      return input.size();
+    }
+
+    int read()
+    {
+      if (input.empty())
+        return -1;
+
+      uint8_t c = input.front();
+      input.pop_front();
+
+      return c;
+    }
+
+    int peek()
+    {
+      return input.empty() ? -1 : input.front();
+    }
+
+    size_t write(uint8_t c)
+    {
+      output.push_back(c);
+      if (room > 0)
+        room--;
+
+      return 1;
+    }
+
+    using Print::write;
+
+    int availableForWrite()
+    {
+      return room;
+    }
+
+    void setRoom(int bytes)
+    {
+      room = bytes;
+    }
+
+    std::deque<uint8_t> input;
+    std::vector<uint8_t> output;
+
+
+  private:
+    int room;
+};
+
+
+// Collects whatever PackedSerial decodes into a list of frames.
+class FrameCollector : public IPacketReceiver
+{
+  public:
+    void onPacketReceive(const uint8_t *buffer, size_t size)
+    {
+      frames.push_back(Frame(buffer, buffer + size));
+    }
+
+    Frames frames;
+};
+
+
+// Plays the gateway on a TestStream: send() frames requests into the adapter's input, and
+// receive() decodes everything the adapter has written since the last call.
+class TestGateway
+{
+  public:
+    TestGateway(TestStream &adapterStream)
+      : stream(adapterStream)
+    {
+      decoder.setStream(encoded);
+      decoder.setPacketReceiver(&collector);
+    }
+
+    void send(const Frame &request)
+    {
+      TestStream out;
+      PackedSerial encoder;
+
+      encoder.setStream(out);
+      encoder.send(request.data(), request.size());
+      stream.input.insert(stream.input.end(), out.output.begin(), out.output.end());
+    }
+
+    Frames receive()
+    {
+      encoded.input.insert(encoded.input.end(), stream.output.begin(), stream.output.end());
+      stream.output.clear();
+      collector.frames.clear();
+      decoder.update();
+
+      return collector.frames;
+    }
+
+    // Sends request, runs one update(), and returns what came back.
+    template<class Adapter> Frames request(Adapter &adapter, const Frame &request)
+    {
+      send(request);
+      adapter.update();
+
+      return receive();
+    }
+
+
+  private:
+    TestStream &stream;
+    TestStream encoded;
+    PackedSerial decoder;
+    FrameCollector collector;
+};
+
+
+/*
+||
+|| @description
+|| | Tests build their own adapter and things, so each starts from a clean state.  The frozen
+|| | clock only moves when a test calls hostAdvanceMillis(), which keeps timing tests exact.
+|| #
+||
+|| @license Please see LICENSE.
+||
+*/
@@ -0,0 +1,42 @@
+/*
+|| TestMain.cpp - Runs every test registered with TEST() in the executable, and exits non-zero
+|| if any check failed.
+*/
+
+#include "TestHarness.h"
+
+#include <stdio.h>
+
+
+static int failures = 0;
+static const char *currentTest = "";
+
+
+std::vector<TestCase> &testCases()
+{
+  static std::vector<TestCase> cases;
+
+  return cases;
+}
+
+
+void testFailed(const char *file, int line, const std::string &message)
+{
+  printf("FAIL %s (%s:%d): %s\n", currentTest, file, line, message.c_str());
+  failures++;
+}
+
+
+int main()
+{
+  for (size_t i = 0; i < testCases().size(); i++)
+  {
+    currentTest = testCases()[i].name;
+    hostSetMicros(0);
+    testCases()[i].run();
+  }
+
+  printf("%u tests, %d failures\n", (unsigned) testCases().size(), failures);
+
+  return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,1159 @@
+/*
+|| GatewayLoad.cpp - A load generator that plays the part of the Things Gateway.  Enumerates an
+|| adapter, pairs all of its things, then drives SETPROPERTY/GETPROPERTY traffic at a set rate
+|| (or replays a capture file), and reports round trip latency percentiles, throughput, and
+|| errored and dropped responses.
+||
+|| The adapter under test is built in, and reached over an in-memory loopback or, with --pty,
+|| through a pseudo-terminal pair.  With --device, it is whatever is on the other end of a serial
+|| port, pty or FIFO instead (a board, or another program).
+||
+||   GatewayLoad [--rate N] [--duration S] [--depth N] [--timeout MS] [--reliable]
+||               [--things N] [--properties N] [--routed N] [--changes N] [--corruption N]
+||               [--pty | --device PATH [--baud N]] [--replay FILE [--loops N]] [--record FILE]
+||               [--seed N]
+||
+|| More notes at the bottom.
+*/
+
+// Room for sizing runs well past what fits on a board
+#define THINGMAXDEVICES 16
+#define THINGMAXPROPERTIES 128
+// A route to a second built in adapter, for --routed
+#define THINGMAXLINKS 2
+// For --reliable
+#define THINGRELIABLEWINDOW 8
+#define THINGRELIABLETIMEOUT 20
+#define THINGTXQUEUESIZE 1024
+// Room for a whole DEFINEALL response in the loopback buffer
+#define LOOPBACKBUFFERSIZE 8192
+
+// With --reliable, acknowledge after this many frames, or this many ms, whichever comes first
+#define ACKFRAMES 4
+#define ACKINTERVAL 5
+
+#include <PackedSerialThingAdapter.h>
+#include <LoopbackStream.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+
+struct Options
+{
+  uint32_t rate = 1000;          // requests per second once paired
+  uint32_t duration = 5;         // seconds of load
+  uint8_t depth = 4;             // requests in flight; more than 1 turns on OPTION_SEQUENCE
+  uint32_t timeout = 100;        // ms before a request without a response is counted as dropped
+  bool reliable = false;         // turn on OPTION_RELIABLE
+  uint8_t things = 2;            // built in adapter only
+  uint8_t properties = 4;        // NUMBER properties per thing, built in adapter only
+  uint8_t routed = 0;            // things on a board behind a route of the built in adapter
+  uint32_t changes = 0;          // property changes per second pushed by the built in adapter
+  uint16_t corruption = 0;       // flip a bit in about one of this many bytes over the loopback
+  bool pty = false;
+  const char *device = nullptr;
+  uint32_t baud = 115200;
+  const char *replay = nullptr;
+  uint32_t loops = 1;
+  const char *record = nullptr;
+  uint32_t seed = 1;
+};
+
+
+// A Stream on a file descriptor (a pty, serial port or FIFO), read and written without
+// blocking.  Writes wait for room for up to 100 ms, and the rest is dropped.
+class FdStream : public Stream
+{
+  public:
+    FdStream(int fd)
+      : fd(fd),
+        head(0),
+        tail(0),
+        bytesDropped(0)
+    {
+    }
+
+    int available()
+    {
+      fill();
+
+      return tail - head;
+    }
+
+    int read()
+    {
+      fill();
+
+      return (head < tail) ? buffer[head++] : -1;
+    }
+
+    int peek()
+    {
+      fill();
+
+      return (head < tail) ? buffer[head] : -1;
+    }
+
+    size_t write(uint8_t c)
+    {
+      return write(&c, 1);
+    }
+
+    size_t write(const uint8_t *data, size_t size)
+    {
+      size_t sent = 0;
+
+      while (sent < size)
+      {
+        ssize_t n = ::write(fd, data + sent, size - sent);
+
+        if (n > 0)
+        {
+          sent += n;
+        }
+        else if (n < 0 && errno == EAGAIN)
+        {
+          struct pollfd p = { fd, POLLOUT, 0 };
+
+          if (poll(&p, 1, 100) <= 0)
+            break;
+        }
+        else if (n < 0 && errno != EINTR)
+        {
+          break;
+        }
+      }
+
+      bytesDropped += size - sent;
+
+      return sent;
+    }
+
+    int availableForWrite()
+    {
+      return sizeof(buffer);
+    }
+
+    uint32_t dropped() const
+    {
+      return bytesDropped;
+    }
+
+
+  private:
+    void fill()
+    {
+      if (head < tail)
+        return;
+
+      ssize_t n = ::read(fd, buffer, sizeof(buffer));
+
+      head = 0;
+      tail = (n > 0) ? n : 0;
+    }
+
+    int fd;
+    uint8_t buffer[4096];
+    size_t head;
+    size_t tail;
+    uint32_t bytesDropped;
+};
+
+
+typedef std::vector<uint8_t> Frame;
+
+
+// Read a capture: one frame per line as hex bytes (spaces optional), with # comments.
+static bool readCapture(const char *path, std::vector<Frame> &frames)
+{
+  FILE *file = fopen(path, "r");
+  char line[1024];
+  unsigned lineNumber = 0;
+
+  if (file == nullptr)
+  {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return false;
+  }
+
+  while (fgets(line, sizeof(line), file) != nullptr)
+  {
+    Frame frame;
+    char *comment = strchr(line, '#');
+    int digits = 0;
+    uint8_t byte = 0;
+
+    lineNumber++;
+    if (comment != nullptr)
+      *comment = '\0';
+
+    for (char *c = line; *c != '\0'; c++)
+    {
+      if (isspace((unsigned char) *c))
+      {
+        if (digits == 1)
+          frame.push_back(byte);
+        digits = 0;
+        byte = 0;
+        continue;
+      }
+
+      if (!isxdigit((unsigned char) *c))
+      {
+        fprintf(stderr, "%s:%u: not a hex byte\n", path, lineNumber);
+        fclose(file);
+        return false;
+      }
+
+      byte = (byte << 4) | (isdigit((unsigned char) *c) ? *c - '0' : (tolower(*c) - 'a' + 10));
+      if (++digits == 2)
+      {
+        frame.push_back(byte);
+        digits = 0;
+        byte = 0;
+      }
+    }
+
+    if (digits == 1)
+      frame.push_back(byte);
+
+    if (!frame.empty())
+      frames.push_back(frame);
+  }
+
+  fclose(file);
+
+  if (frames.empty())
+  {
+    fprintf(stderr, "%s: no frames\n", path);
+    return false;
+  }
+
+  return true;
+}
+
+
+// Open a pty pair, raw, both ends non-blocking.  master is the adapter's end.
+static bool openPty(int &master, int &slave)
+{
+  struct termios tio;
+
+  master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0)
+  {
+    perror("pty");
+    return false;
+  }
+
+  slave = open(ptsname(master), O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (slave < 0)
+  {
+    perror(ptsname(master));
+    return false;
+  }
+
+  tcgetattr(slave, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(slave, TCSANOW, &tio);
+
+  return true;
+}
+
+
+static speed_t baudConstant(uint32_t baud)
+{
+  switch (baud)
+  {
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+    case 460800: return B460800;
+    case 500000: return B500000;
+    case 921600: return B921600;
+    case 1000000: return B1000000;
+    default: return B0;
+  }
+}
+
+
+// Open a serial port (raw, at baud), pty or FIFO.
+static int openDevice(const char *path, uint32_t baud)
+{
+  int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+  struct termios tio;
+
+  if (fd < 0)
+  {
+    perror(path);
+    return -1;
+  }
+
+  // Not a terminal (e.g. a FIFO or socket) is fine, there is just nothing to set
+  if (tcgetattr(fd, &tio) == 0)
+  {
+    speed_t speed = baudConstant(baud);
+
+    if (speed == B0)
+    {
+      fprintf(stderr, "%s: unsupported baud rate %u\n", path, (unsigned) baud);
+      close(fd);
+      return -1;
+    }
+
+    cfmakeraw(&tio);
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+    tcsetattr(fd, TCSANOW, &tio);
+    tcflush(fd, TCIOFLUSH);
+  }
+
+  return fd;
+}
+
+
+// LoadGateway - enumerates, pairs and then loads an adapter, keeping statistics.
+class LoadGateway : public IPacketReceiver
+{
+  public:
+    LoadGateway(const Options &options)
+      : options(options),
+        state(ENUMERATING),
+        thingCount(0),
+        pairedCount(0),
+        outstanding(0),
+        sequence(0),
+        reliable(false),
+        nextExpected(0),
+        received(0),
+        unacked(0),
+        lastAck(0),
+        captureIndex(0),
+        captureLoop(0),
+        record(nullptr),
+        requests(0),
+        errors(0),
+        dropped(0),
+        pushed(0),
+        corrupted(0),
+        duplicates(0),
+        acks(0),
+        bytesOut(0),
+        bytesIn(0)
+    {
+      inFlight.resize(depth());
+      memset(defined, 0, sizeof(defined));
+      memset(errorCounts, 0, sizeof(errorCounts));
+    }
+
+
+    void begin(Stream &stream, const std::vector<Frame> &replayFrames, FILE *recordFile)
+    {
+      conn.setStream(stream);
+      conn.setPacketReceiver(this);
+      capture = replayFrames;
+      record = recordFile;
+      started = micros();
+
+      if (!capture.empty())
+      {
+        // The capture does its own enumeration
+        run();
+      }
+      else
+      {
+        uint8_t request[] = { DEFINEALL };
+
+        send(request, sizeof(request));
+      }
+    }
+
+
+    void update()
+    {
+      conn.update();
+
+      if (unacked > 0 && (unacked >= ACKFRAMES || (millis() - lastAck) >= ACKINTERVAL))
+        sendAck();
+
+      uint32_t now = micros();
+
+      for (size_t i = 0; i < inFlight.size(); i++)
+      {
+        if (inFlight[i].seq != 0 && (now - inFlight[i].start) > options.timeout * 1000UL)
+        {
+          inFlight[i].seq = 0;
+          dropped++;
+        }
+      }
+
+      if (state == RUNNING && !finished() && (now - lastRequest) >= 1000000UL / options.rate)
+      {
+        for (size_t i = 0; i < inFlight.size(); i++)
+        {
+          if (inFlight[i].seq == 0)
+          {
+            sendRequest(inFlight[i]);
+            lastRequest = now;
+            break;
+          }
+        }
+      }
+    }
+
+
+    void onPacketReceive(const uint8_t *data, size_t len)
+    {
+      bytesIn += len;
+
+      if (reliable)
+      {
+        // Check the CRC, and drop frames we've already had (sent again before our ack got there)
+        if (len < 4 || PackedSerialThingAdapter::crc16(data, len - 2) != (((uint16_t) data[len - 2] << 8) | data[len - 1]))
+        {
+          corrupted++;
+          return;
+        }
+
+        if (!receivedSequence(data[len - 3]))
+        {
+          duplicates++;
+          return;
+        }
+
+        len -= 3;
+      }
+
+      switch (data[0])
+      {
+        case DETAILADAPTER:
+          thingCount = (len > 1) ? data[skipString(data, len, skipString(data, len, 1))] : 0;
+          break;
+        case DETAILTHINGBYIDX:
+          if (len >= 3 && state == ENUMERATING)
+            defined[data[1]] = true;
+          else if (len >= 3 && state == DEFINING)
+            defineProperties(data, len);
+          break;
+        case DETAILPROPERTYBYIDX:
+          if (len >= 4 && (state == ENUMERATING || state == DEFINING))
+            properties.push_back(Property { data[1], data[2], data[3] });
+          break;
+        case DETAILCOMPLETE:
+          if (state == ENUMERATING)
+            defineRest();
+          break;
+        case PAIRED:
+          if (state == PAIRING && ++pairedCount == thingCount)
+            negotiate();
+          break;
+        case OPTIONS:
+          if (state == NEGOTIATING)
+          {
+            // The adapter only does OPTION_RELIABLE if built with THINGRELIABLEWINDOW
+            reliable = (len >= 2 && (data[1] & OPTION_RELIABLE));
+            run();
+          }
+          break;
+        case ERROR:
+          errors++;
+          if (len >= 2)
+            errorCounts[data[len - 1]]++;
+          break;
+        default:
+          break;
+      }
+
+      // Each DEFINE*BYIDX is answered with one frame, its detail or an error
+      if (state == DEFINING && (data[0] == DETAILTHINGBYIDX || data[0] == DETAILPROPERTYBYIDX || data[0] == ERROR) &&
+          --outstanding == 0)
+        pairAll();
+
+      if (state != RUNNING)
+        return;
+
+      for (size_t i = 0; i < inFlight.size(); i++)
+      {
+        if (inFlight[i].seq != 0 && answers(inFlight[i], data, len))
+        {
+          latencies.push_back(micros() - inFlight[i].start);
+          inFlight[i].seq = 0;
+          return;
+        }
+      }
+
+      pushed++;
+    }
+
+
+    // Paired and sending requests
+    bool running() const
+    {
+      return state == RUNNING;
+    }
+
+
+    // Nothing more to send: the capture has been replayed, or the run has lasted its duration
+    bool finished() const
+    {
+      if (!capture.empty())
+        return captureLoop >= options.loops;
+
+      return state == RUNNING && (micros() - started) >= options.duration * 1000000UL;
+    }
+
+
+    bool idle() const
+    {
+      for (size_t i = 0; i < inFlight.size(); i++)
+      {
+        if (inFlight[i].seq != 0)
+          return false;
+      }
+
+      return true;
+    }
+
+
+    void report()
+    {
+      double seconds = (micros() - started) / 1e6;
+
+      std::sort(latencies.begin(), latencies.end());
+
+      if (!capture.empty())
+        printf("%u frames replayed, %.2f s\n", requests, seconds);
+      else
+        printf("%u things, %u properties, %.2f s\n", thingCount, (unsigned) properties.size(), seconds);
+      printf("requests/s: %.0f  responses/s: %.0f  pushed/s: %.0f  bytes/s out/in: %.0f/%.0f\n",
+             requests / seconds, latencies.size() / seconds, pushed / seconds, bytesOut / seconds, bytesIn / seconds);
+      printf("latency us p50 %u  p90 %u  p99 %u  p99.9 %u  max %u\n",
+             percentile(500), percentile(900), percentile(990), percentile(999),
+             latencies.empty() ? 0 : latencies.back());
+      printf("errors: %u  dropped: %u\n", errors, dropped);
+      if (reliable)
+        printf("corrupted: %u  duplicates: %u  acks: %u\n", corrupted, duplicates, acks);
+
+      for (unsigned code = 0; code < 256; code++)
+      {
+        if (errorCounts[code] != 0)
+          printf("  error 0x%02x: %u\n", code, errorCounts[code]);
+      }
+    }
+
+
+    uint32_t droppedCount() const
+    {
+      return dropped;
+    }
+
+
+    uint32_t answeredCount() const
+    {
+      return latencies.size();
+    }
+
+
+  private:
+    enum State { ENUMERATING, DEFINING, PAIRING, NEGOTIATING, RUNNING };
+
+    struct Property
+    {
+      uint8_t thingIdx;
+      uint8_t propertyIdx;
+      uint8_t type;
+    };
+
+    // A request waiting for its response, seq is 0 for a free slot
+    struct Request
+    {
+      uint8_t seq;
+      uint8_t thingIdx;
+      uint8_t propertyIdx;
+      uint32_t start;
+    };
+
+
+    uint8_t depth() const
+    {
+      return options.replay != nullptr ? 1 : options.depth;
+    }
+
+
+    // DEFINEALL only covers the adapter's own things, not those behind its routes, so any
+    // DETAILADAPTER counted that didn't come are defined one at a time.
+    void defineRest()
+    {
+      state = DEFINING;
+      outstanding = 0;
+
+      for (unsigned thingIdx = 0; thingIdx < thingCount; thingIdx++)
+      {
+        if (!defined[thingIdx])
+        {
+          uint8_t request[] = { DEFINETHINGBYIDX, (uint8_t) thingIdx };
+
+          send(request, sizeof(request));
+          outstanding++;
+        }
+      }
+
+      if (outstanding == 0)
+        pairAll();
+    }
+
+
+    // Ask for each property of the thing in a DETAILTHINGBYIDX.
+    void defineProperties(const uint8_t *data, size_t len)
+    {
+      size_t i = skipString(data, len, skipString(data, len, 3));
+      uint8_t propertyCount = (i < len) ? data[i] : 0;
+
+      for (uint8_t propertyIdx = 0; propertyIdx < propertyCount; propertyIdx++)
+      {
+        uint8_t request[] = { DEFINEPROPERTYBYIDX, data[1], propertyIdx };
+
+        send(request, sizeof(request));
+        outstanding++;
+      }
+    }
+
+
+    void pairAll()
+    {
+      state = PAIRING;
+
+      if (thingCount == 0)
+        negotiate();
+
+      for (uint8_t i = 0; i < thingCount; i++)
+      {
+        uint8_t request[] = { PAIR, i };
+
+        send(request, sizeof(request));
+      }
+    }
+
+
+    void negotiate()
+    {
+      // Sequence ids let several requests be in flight
+      uint8_t wanted = (depth() > 1 ? OPTION_SEQUENCE : 0) | (options.reliable ? OPTION_RELIABLE : 0);
+
+      if (wanted != 0)
+      {
+        uint8_t request[] = { SETOPTIONS, wanted };
+
+        state = NEGOTIATING;
+        send(request, sizeof(request));
+      }
+      else
+      {
+        run();
+      }
+    }
+
+
+    void run()
+    {
+      state = RUNNING;
+      started = micros();
+      lastRequest = started;
+    }
+
+
+    // With sequence ids, the id tells us which request a frame answers (0 is pushed by
+    // update()).  Without, a status for the property asked about (or an error) answers it.
+    // Frames of a capture are answered by whatever comes back first.
+    bool answers(const Request &request, const uint8_t *data, size_t len) const
+    {
+      if (!capture.empty())
+        return true;
+
+      if (depth() > 1)
+        return len >= 2 && data[1] == request.seq;
+
+      return data[0] == ERROR ||
+             (data[0] == PROPERTYSTATUS && len >= 3 && data[1] == request.thingIdx && data[2] == request.propertyIdx);
+    }
+
+
+    void sendRequest(Request &slot)
+    {
+      uint8_t request[16];
+      uint8_t len = 0;
+
+      if (!capture.empty())
+      {
+        const Frame &frame = capture[captureIndex];
+
+        send(frame.data(), frame.size());
+        slot.seq = 1;
+        slot.start = micros();
+        requests++;
+
+        if (++captureIndex == capture.size())
+        {
+          captureIndex = 0;
+          captureLoop++;
+        }
+
+        return;
+      }
+
+      if (properties.empty())
+        return;
+
+      const Property &p = properties[random(properties.size())];
+
+      slot.thingIdx = p.thingIdx;
+      slot.propertyIdx = p.propertyIdx;
+
+      request[len++] = random(2) ? SETPROPERTY : GETPROPERTY;
+      if (depth() > 1)
+        request[len++] = slot.seq = nextSequence();
+      else
+        slot.seq = 1;
+      request[len++] = p.thingIdx;
+      request[len++] = p.propertyIdx;
+
+      if (request[0] == SETPROPERTY)
+      {
+        switch (p.type)
+        {
+          case BOOLEAN:
+            request[len++] = random(2);
+            break;
+          case NUMBER:
+            len = SimplePack::writeInt32BE(request, random(100000), len);
+            break;
+          default:
+            // Strings aren't set by the simulator, ask for the value instead
+            request[0] = GETPROPERTY;
+            break;
+        }
+      }
+
+      send(request, len);
+      slot.start = micros();
+      requests++;
+    }
+
+
+    // Send a request, with a CRC once OPTION_RELIABLE is on.
+    void send(const uint8_t *request, size_t len)
+    {
+      Frame frame(request, request + len);
+
+      if (reliable)
+      {
+        uint16_t crc = PackedSerialThingAdapter::crc16(request, len);
+
+        frame.push_back(crc >> 8);
+        frame.push_back(crc & 0xff);
+      }
+
+      conn.send(frame.data(), frame.size());
+      bytesOut += frame.size();
+
+      if (record != nullptr)
+      {
+        for (size_t i = 0; i < len; i++)
+          fprintf(record, (i == 0) ? "%02x" : " %02x", request[i]);
+        fputc('\n', record);
+      }
+    }
+
+
+    // Note a frame's sequence number.  Returns false if we've had it already.  A gap means
+    // frames were lost, so we ack straight away to have them sent again.
+    bool receivedSequence(uint8_t seq)
+    {
+      uint8_t ahead = seq - nextExpected;
+
+      if (ahead >= 128 || (ahead < 8 && (received & (1 << ahead))))
+        return false;
+
+      // Too far ahead: the adapter gave up on the frames in between when its window filled
+      while (ahead >= 8)
+      {
+        received >>= 1;
+        nextExpected++;
+        ahead--;
+      }
+
+      received |= (1 << ahead);
+      while (received & 1)
+      {
+        received >>= 1;
+        nextExpected++;
+      }
+
+      unacked++;
+      if (received != 0)
+        sendAck();
+
+      return true;
+    }
+
+
+    // LinkAck: the next frame we're waiting for, and which of the 8 after it we already have.
+    void sendAck()
+    {
+      uint8_t request[4];
+      uint8_t len = 0;
+
+      request[len++] = LINKACK;
+      if (depth() > 1)
+        request[len++] = 0;
+      request[len++] = nextExpected;
+      request[len++] = received >> 1;
+
+      send(request, len);
+      acks++;
+      unacked = 0;
+      lastAck = millis();
+    }
+
+
+    // Sequence ids run 1-255, 0 is for messages pushed by the adapter
+    uint8_t nextSequence()
+    {
+      if (++sequence == 0)
+        sequence = 1;
+
+      return sequence;
+    }
+
+
+    static size_t skipString(const uint8_t *data, size_t len, size_t i)
+    {
+      while (i < len && data[i] != 0)
+        i++;
+
+      return std::min(i + 1, len - 1);
+    }
+
+
+    // Latency below which permille of the responses came back.
+    uint32_t percentile(uint32_t permille) const
+    {
+      if (latencies.empty())
+        return 0;
+
+      return latencies[std::min(latencies.size() - 1, latencies.size() * permille / 1000)];
+    }
+
+
+    const Options &options;
+    PackedSerial conn;
+    State state;
+    uint8_t thingCount;
+    uint8_t pairedCount;
+    bool defined[256];  // things DEFINEALL described
+    uint32_t outstanding;  // DEFINE*BYIDX requests not yet answered
+    std::vector<Property> properties;
+    std::vector<Request> inFlight;
+    uint8_t sequence;
+    uint32_t started;
+    uint32_t lastRequest;
+
+    // OPTION_RELIABLE: received has bit i set if frame nextExpected + i is already here
+    bool reliable;
+    uint8_t nextExpected;
+    uint8_t received;
+    uint8_t unacked;
+    uint32_t lastAck;
+
+    std::vector<Frame> capture;
+    size_t captureIndex;
+    uint32_t captureLoop;
+    FILE *record;
+
+    std::vector<uint32_t> latencies;
+    uint32_t errorCounts[256];
+    uint32_t requests;
+    uint32_t errors;
+    uint32_t dropped;
+    uint32_t pushed;
+    uint32_t corrupted;
+    uint32_t duplicates;
+    uint32_t acks;
+    uint32_t bytesOut;
+    uint32_t bytesIn;
+};
+
+
+static void usage()
+{
+  fprintf(stderr,
+          "usage: GatewayLoad [options]\n"
+          "  --rate N          requests per second once paired (1000)\n"
+          "  --duration S      seconds of load (5)\n"
+          "  --depth N         requests in flight, over 1 uses sequence ids (4)\n"
+          "  --timeout MS      a request unanswered this long is dropped (100)\n"
+          "  --reliable        turn on OPTION_RELIABLE: CRCs, acknowledgements and resends\n"
+          "  --things N        things in the built in adapter (2)\n"
+          "  --properties N    NUMBER properties per thing (4)\n"
+          "  --routed N        things on a board behind a route of the built in adapter (0)\n"
+          "  --changes N       changes per second the built in adapter pushes (0)\n"
+          "  --corruption N    flip a bit in about one in N bytes over the loopback (0)\n"
+          "  --pty             reach the built in adapter through a pseudo-terminal\n"
+          "  --device PATH     load the adapter at PATH instead (serial port, pty or FIFO)\n"
+          "  --baud N          bitrate for --device (115200)\n"
+          "  --replay FILE     send the frames in FILE, one at a time, instead\n"
+          "  --loops N         times to replay FILE (1)\n"
+          "  --record FILE     write every frame sent to FILE, for --replay\n"
+          "  --seed N          seed for the random requests (1)\n");
+}
+
+
+static bool parseOptions(int argc, char **argv, Options &options)
+{
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    const char *value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+
+    if (arg == "--pty")
+    {
+      options.pty = true;
+      continue;
+    }
+
+    if (arg == "--reliable")
+    {
+      options.reliable = true;
+      continue;
+    }
+
+    if (value == nullptr)
+      return false;
+    i++;
+
+    if (arg == "--rate")
+      options.rate = strtoul(value, nullptr, 10);
+    else if (arg == "--duration")
+      options.duration = strtoul(value, nullptr, 10);
+    else if (arg == "--depth")
+      options.depth = constrain(strtoul(value, nullptr, 10), 1UL, 255UL);
+    else if (arg == "--timeout")
+      options.timeout = strtoul(value, nullptr, 10);
+    else if (arg == "--things")
+      options.things = constrain(strtoul(value, nullptr, 10), 1UL, (unsigned long) THINGMAXDEVICES);
+    else if (arg == "--properties")
+      options.properties = constrain(strtoul(value, nullptr, 10), 1UL, 255UL);
+    else if (arg == "--routed")
+      options.routed = constrain(strtoul(value, nullptr, 10), 0UL, (unsigned long) THINGMAXDEVICES);
+    else if (arg == "--changes")
+      options.changes = strtoul(value, nullptr, 10);
+    else if (arg == "--corruption")
+      options.corruption = constrain(strtoul(value, nullptr, 10), 0UL, 65535UL);
+    else if (arg == "--device")
+      options.device = value;
+    else if (arg == "--baud")
+      options.baud = strtoul(value, nullptr, 10);
+    else if (arg == "--replay")
+      options.replay = value;
+    else if (arg == "--loops")
+      options.loops = strtoul(value, nullptr, 10);
+    else if (arg == "--record")
+      options.record = value;
+    else if (arg == "--seed")
+      options.seed = strtoul(value, nullptr, 10);
+    else
+      return false;
+  }
+
+  return options.rate > 0 && (options.things * options.properties) <= THINGMAXPROPERTIES &&
+         (options.routed * options.properties) <= THINGMAXPROPERTIES;
+}
+
+
+int main(int argc, char **argv)
+{
+  Options options;
+  std::vector<Frame> capture;
+  FILE *record = nullptr;
+
+  if (!parseOptions(argc, argv, options))
+  {
+    usage();
+    return 2;
+  }
+
+  if (options.replay != nullptr && !readCapture(options.replay, capture))
+    return 2;
+
+  if (options.record != nullptr && (record = fopen(options.record, "w")) == nullptr)
+  {
+    perror(options.record);
+    return 2;
+  }
+
+  randomSeed(options.seed);
+
+  // The adapter under test, unless it's at the end of --device, and with --routed, the board
+  // behind it
+  PackedSerialThingAdapter adapter("Simulated", "Adapter under load");
+  PackedSerialThingAdapter board("Board", "Simulated board behind a route");
+  std::vector<ThingDevice *> things;
+  std::vector<ThingPropertyNumber *> properties;
+  std::vector<PackedSerialThingAdapter *> owners;  // of each of properties
+  LoopbackStream adapterEnd;
+  LoopbackStream gatewayEnd;
+  LoopbackStream routerEnd;
+  LoopbackStream boardEnd;
+  Stream *adapterStream = &adapterEnd;
+  Stream *gatewayStream = &gatewayEnd;
+  int master = -1;
+  int slave = -1;
+
+  if (options.device != nullptr)
+  {
+    if ((slave = openDevice(options.device, options.baud)) < 0)
+      return 2;
+    gatewayStream = new FdStream(slave);
+    adapterStream = nullptr;
+  }
+  else if (options.pty)
+  {
+    if (!openPty(master, slave))
+      return 2;
+    adapterStream = new FdStream(master);
+    gatewayStream = new FdStream(slave);
+  }
+  else
+  {
+    adapterEnd.connect(gatewayEnd);
+    adapterEnd.setCorruption(options.corruption);
+    gatewayEnd.setCorruption(options.corruption);
+  }
+
+  if (adapterStream != nullptr)
+  {
+    for (uint8_t t = 0; t < options.things + options.routed; t++)
+    {
+      PackedSerialThingAdapter &owner = (t < options.things) ? adapter : board;
+
+      things.push_back(new ThingDevice("Thing", "Simulated thing", THING));
+
+      for (uint8_t p = 0; p < options.properties; p++)
+      {
+        properties.push_back(new ThingPropertyNumber("value", "Simulated value"));
+        owners.push_back(&owner);
+        things.back()->addProperty(*properties.back());
+      }
+
+      owner.addDevice(*things.back());
+    }
+
+    adapter.begin(*adapterStream);
+
+    if (options.routed > 0)
+    {
+      routerEnd.connect(boardEnd);
+      board.setThingOffset(options.things);
+      board.begin(boardEnd);
+      adapter.addRoute(routerEnd, options.things, options.routed);
+    }
+  }
+
+  LoadGateway gateway(options);
+  uint32_t lastChange = micros();
+  uint32_t start = millis();
+
+  gateway.begin(*gatewayStream, capture, record);
+
+  // Run until there is nothing more to send or wait for
+  while (!gateway.finished() || !gateway.idle())
+  {
+    if (adapterStream != nullptr)
+    {
+      if (options.changes > 0 && !properties.empty() && (micros() - lastChange) >= 1000000UL / options.changes)
+      {
+        size_t i = random(properties.size());
+
+        properties[i]->setValue(properties[i]->getValue() + 1);
+        owners[i]->setChanged(*properties[i]);
+        lastChange = micros();
+      }
+
+      adapter.update();
+      if (options.routed > 0)
+        board.update();
+    }
+
+    gateway.update();
+
+    if (!gateway.running() && millis() - start > 2000)
+    {
+      fprintf(stderr, "no answer from the adapter\n");
+      return 2;
+    }
+  }
+
+  gateway.report();
+
+  if (record != nullptr)
+    fclose(record);
+
+  return (gateway.droppedCount() == 0 && gateway.answeredCount() > 0) ? 0 : 1;
+}
+
+
+/*
+||
+|| @description
+|| | A load generator that plays the part of the Things Gateway, for sizing how many properties
+|| | and what request rate an adapter can sustain.
+|| #
+||
+|| @notes
+|| |
+|| | Latencies are kept whole, so the percentiles are exact.  Each run ends once the duration
+|| | (or the last loop of the capture) is over and every request in flight is answered or has
+|| | timed out.  The exit status is 0 if nothing was dropped, 1 if something was, and 2 if the
+|| | adapter couldn't be reached at all.
+|| |
+|| | Captures are text, one frame (without its COBS framing) per line in hex:
+|| |
+|| |   # Enumerate and pair thing 0
+|| |   00
+|| |   01 00
+|| |   fd 00
+|| |
+|| | --record writes what the gateway sends in the same form, so one run can be replayed in
+|| | the next (with the same --things and --properties).  Replayed frames are sent one at a
+|| | time, and the first frame that comes back is taken as the response, so leave --changes
+|| | at 0 while replaying.
+|| |
+|| | Enumeration starts with DEFINEALL, and any thing it didn't describe (the things behind a
+|| | route don't come back from it) is asked for with DEFINETHINGBYIDX and DEFINEPROPERTYBYIDX.
+|| | --routed N puts N more things on a second adapter behind a route, to exercise that path.
+|| |
+|| | --reliable asks for OPTION_RELIABLE: every frame then carries a CRC, frames with a bad CRC
+|| | are counted as corrupted and dropped, and the sequence numbers pushed are acknowledged with
+|| | LINKACK every ACKFRAMES frames or ACKINTERVAL ms.  --corruption N flips a bit in about one
+|| | byte in N on the loopback, in both directions, to watch retransmits at work.
+|| |
+|| | To load an adapter on a board, give its serial port to --device.  An adapter in another
+|| | program can be reached through a pty pair, e.g. socat -d -d pty,raw,echo=0 pty,raw,echo=0.
+|| #
+||
+|| @license Please see LICENSE.
+||
+*/
@@ -0,0 +1,179 @@
+/*
+|| LoopbackStream.h - An in-memory Stream for exercising PackedSerialThingAdapter without a serial port.
+||
+||
+|| More notes at the bottom.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+
+// Bytes each end of a loopback pair can hold before writes are dropped.
+#ifndef LOOPBACKBUFFERSIZE
+#define LOOPBACKBUFFERSIZE 256
+#endif
+
+
+// LoopbackStream - one end of an in-memory link.  Bytes written to one end are read from the other.
+class LoopbackStream : public Stream
+{
+  public:
+    LoopbackStream()
+      : bytesWritten(0),
+        bytesDropped(0),
+        bytesCorrupted(0),
+        peer(nullptr),
+        receiveHandler(nullptr),
+        corruption(0),
+        head(0),
+        tail(0)
+    {
+    }
+
+
+    // Join two ends into a link.
+    void connect(LoopbackStream &other)
+    {
+      peer = &other;
+      other.peer = this;
+    }
+
+
+    int available()
+    {
+      return (uint16_t) (head + LOOPBACKBUFFERSIZE - tail) % LOOPBACKBUFFERSIZE;
+    }
+
+
+    int read()
+    {
+      if (head == tail)
+        return -1;
+
+      uint8_t c = buffer[tail];
+      tail = (tail + 1) % LOOPBACKBUFFERSIZE;
+
+      return c;
+    }
+
+
+    int peek()
+    {
+      if (head == tail)
+        return -1;
+
+      return buffer[tail];
+    }
+
+
+    size_t write(uint8_t c)
+    {
+      if (corruption != 0 && random(corruption) == 0)
+      {
+        c ^= 1 << random(8);
+        bytesCorrupted++;
+      }
+
+      if (peer == nullptr || !peer->receive(c))
+      {
+        bytesDropped++;
+        return 0;
+      }
+
+      bytesWritten++;
+
+      return 1;
+    }
+
+    using Print::write;
+
+
+    int availableForWrite()
+    {
+      if (peer == nullptr)
+        return 0;
+
+      return LOOPBACKBUFFERSIZE - 1 - peer->available();
+    }
+
+
+    void flush()
+    {
+    }
+
+
+    // Call handler whenever bytes arrive at this end, as a serial port's receive interrupt would.
+    void setReceiveHandler(void (*handler)())
+    {
+      receiveHandler = handler;
+    }
+
+
+    // Flip a bit in about one of every oneIn bytes written to this end (0 for none), to see how
+    // the protocol copes with a noisy line.
+    void setCorruption(uint16_t oneIn)
+    {
+      corruption = oneIn;
+    }
+
+
+    // Discard anything waiting to be read.
+    void clear()
+    {
+      tail = head;
+    }
+
+
+    uint32_t bytesWritten;
+    uint32_t bytesDropped;
+    uint32_t bytesCorrupted;
+
+
+  private:
+    boolean receive(uint8_t c)
+    {
+      uint16_t next = (head + 1) % LOOPBACKBUFFERSIZE;
+
+      if (next == tail)
+        return false;
+
+      buffer[head] = c;
+      head = next;
+
+      if (receiveHandler != nullptr)
+        receiveHandler();
+
+      return true;
+    }
+
+
+    LoopbackStream *peer;
+    void (*receiveHandler)();
+    uint16_t corruption;
+    uint8_t buffer[LOOPBACKBUFFERSIZE];
+    volatile uint16_t head;
+    volatile uint16_t tail;
+};
+
+
+/*
+||
+|| @author         Brett Hagman <bhagman@roguerobotics.com>
+|| @url            http://roguerobotics.com/
+|| @url            http://oryng.org/
+||
+|| @description
+|| | LoopbackStream
+|| | A pair of connected LoopbackStreams behaves like a serial cable between an adapter and a
+|| | gateway, which lets sketches benchmark or simulate the gateway side on a single board.
+|| |
+|| |   LoopbackStream adapterEnd, gatewayEnd;
+|| |   adapterEnd.connect(gatewayEnd);
+|| |   adapter.begin(adapterEnd);
+|| |
+|| #
+||
+|| @license Please see LICENSE.
+||
+*/
@@ -11,9 +11,180 @@
 #include <Thing.h>
 #include <PackedSerial.h>
 
-// TODO: We fix the bitrate for now -- see @todo below for more info
+// Bitrate the link always starts at.  The gateway may then negotiate a faster rate,
+// up to the bitrate given to begin() -- see notes below.
 #define THINGBITRATE 115200
 
+// How long (ms) a negotiated bitrate has to prove itself before we fall back.
+#ifndef THINGBITRATETIMEOUT
+#define THINGBITRATETIMEOUT 1000
+#endif
+
+// Capacity of the adapter's flat property table (see buildIndex()).
+// Define before including this header to change.
+#ifndef THINGMAXDEVICES
+#define THINGMAXDEVICES 8
+#endif
+
+#ifndef THINGMAXPROPERTIES
+#define THINGMAXPROPERTIES 32
+#endif
+
+// Both are kept in uint8_t, where the value itself means "none" (e.g. an unresolved slot)
+#if THINGMAXDEVICES > 255
+#error THINGMAXDEVICES must be 255 or less
+#endif
+
+#if THINGMAXPROPERTIES > 255
+#error THINGMAXPROPERTIES must be 255 or less
+#endif
+
+// When set, update() also sweeps every property's "changed" flag, so sketches that
+// only call setValue() keep working.  Define as 0 when all changes are reported
+// with adapter.setChanged(), making an idle update() nearly free.
+#ifndef THINGCHANGESCAN
+#define THINGCHANGESCAN 1
+#endif
+
+// Size of the adapter's frame buffer, which every outgoing frame is built in.  Responses
+// that don't fit (e.g. long names or string values) are replaced by ERROR_FRAME_OVERFLOW.
+#ifndef THINGFRAMESIZE
+#define THINGFRAMESIZE 64
+#endif
+
+#if THINGFRAMESIZE > 254
+#error THINGFRAMESIZE must be 254 or less
+#endif
+
+// Index returned by the frame writers once a frame has overflowed.
+#define THINGFRAMEOVERFLOW 0xff
+
+// Largest PropertyStatusBatch frame update() will build when OPTION_BATCHSTATUS is set.
+#ifndef THINGBATCHSIZE
+#define THINGBATCHSIZE THINGFRAMESIZE
+#endif
+
+#if THINGBATCHSIZE > THINGFRAMESIZE
+#error THINGBATCHSIZE must not be larger than THINGFRAMESIZE
+#endif
+
+// Bytes set aside for responses waiting for room in the stream's transmit buffer.  With 0 (the
+// default) frames are written straight to the stream, blocking until they fit.  Otherwise
+// update() never blocks on the stream; it needs a Stream with a working availableForWrite().
+#ifndef THINGTXQUEUESIZE
+#define THINGTXQUEUESIZE 0
+#endif
+
+// Streams the adapter can serve: the one given to begin(), and up to THINGMAXLINKS - 1 more
+// added with addLink() (another gateway) or addRoute() (a board behind this one).
+#ifndef THINGMAXLINKS
+#define THINGMAXLINKS 1
+#endif
+
+#if THINGMAXLINKS < 1 || THINGMAXLINKS > 8
+#error THINGMAXLINKS must be from 1 to 8
+#endif
+
+// Things behind routes (see addRoute()) whose pairing is kept for each gateway link, and
+// requests passed on to routes still waiting for their reply, so it goes back to the link
+// that asked.
+#ifndef THINGMAXROUTEDDEVICES
+#define THINGMAXROUTEDDEVICES 16
+#endif
+
+#ifndef THINGROUTEPENDING
+#define THINGROUTEPENDING 8
+#endif
+
+#if THINGMAXROUTEDDEVICES > 255 || THINGROUTEPENDING > 255
+#error THINGMAXROUTEDDEVICES and THINGROUTEPENDING must be 255 or less
+#endif
+
+// Frames kept on the stream given to begin() until the gateway acknowledges them, when it turns
+// on OPTION_RELIABLE.  0 (the default) leaves reliable delivery out.  See notes below.
+#ifndef THINGRELIABLEWINDOW
+#define THINGRELIABLEWINDOW 0
+#endif
+
+#if THINGRELIABLEWINDOW > 8 || (THINGRELIABLEWINDOW & (THINGRELIABLEWINDOW - 1))
+#error THINGRELIABLEWINDOW must be 0, 1, 2, 4 or 8
+#endif
+
+#if THINGRELIABLEWINDOW && !THINGTXQUEUESIZE
+#error THINGRELIABLEWINDOW needs THINGTXQUEUESIZE, for frames to wait in while the window is full
+#endif
+
+// How long (ms) unacknowledged frames wait before they are sent again.
+#ifndef THINGRELIABLETIMEOUT
+#define THINGRELIABLETIMEOUT 100
+#endif
+
+// Keep the last NUMBER value sent for each property, so the gateway can turn on
+// OPTION_DELTANUMBER.  0 (the default) leaves it out, saving 4 bytes of RAM per property.
+#ifndef THINGDELTANUMBER
+#define THINGDELTANUMBER 0
+#endif
+
+// Number of properties the gateway can SUBSCRIBE to with reporting intervals and deadbands.
+// 0 (the default) leaves subscriptions out, and SUBSCRIBE is refused as ERROR_REQUEST_INVALID.
+#ifndef THINGMAXSUBSCRIPTIONS
+#define THINGMAXSUBSCRIPTIONS 0
+#endif
+
+// Number of events and actions that can be registered with addEvent()/addAction().  0 (the
+// default) leaves events, or actions, out along with their queue and requests.
+#ifndef THINGMAXEVENTS
+#define THINGMAXEVENTS 0
+#endif
+
+#ifndef THINGMAXACTIONS
+#define THINGMAXACTIONS 0
+#endif
+
+// Events posted with postEvent() wait here until update() sends them.  One entry is kept
+// free, so this holds THINGEVENTQUEUESIZE - 1 events.
+#ifndef THINGEVENTQUEUESIZE
+#define THINGEVENTQUEUESIZE 16
+#endif
+
+// Action invocations waiting for update() to run their handlers.
+#ifndef THINGACTIONQUEUESIZE
+#define THINGACTIONQUEUESIZE 4
+#endif
+
+#if THINGEVENTQUEUESIZE > 255 || THINGACTIONQUEUESIZE > 255
+#error THINGEVENTQUEUESIZE and THINGACTIONQUEUESIZE must be 255 or less
+#endif
+
+// Number of NUMBER/BOOLEAN properties that can be fed from interrupt handlers with publish().
+// 0 (the default) leaves publish() out.
+#ifndef THINGMAXPUBLISHED
+#define THINGMAXPUBLISHED 0
+#endif
+
+// Storage for STRING property values, shared out by addStringStorage().  Each property takes
+// its capacity plus 2 bytes (a length and a terminator).  0 (the default) leaves string
+// storage out: STRING properties then keep the value the sketch gives them, and SETPROPERTY
+// may only write as many characters as they already hold.
+#ifndef THINGSTRINGPOOLSIZE
+#define THINGSTRINGPOOLSIZE 0
+#endif
+
+#ifndef THINGMAXSTRINGS
+#define THINGMAXSTRINGS 4
+#endif
+
+// Define as 1 when every adapter, thing, property, event and action name and description
+// is in flash (PROGMEM).  See notes below.
+#ifndef THINGFLASHSTRINGS
+#define THINGFLASHSTRINGS 0
+#endif
+
+// Define as 1 to keep performance counters, readable by the gateway with GETSTATS.
+#ifndef THINGSTATS
+#define THINGSTATS 0
+#endif
+
 
 enum ThingAdapterRequest
 {
@@ -24,6 +195,15 @@ enum ThingAdapterRequest
   DEFINEACTIONBYIDX   = 0x04,
   SETPROPERTY         = 0x05,
   GETPROPERTY         = 0x06,
+  SETOPTIONS          = 0x07,
+  DEFINEBITRATES      = 0x08,
+  SETBITRATE          = 0x09,
+  DEFINEALL           = 0x0a,
+  GETSTATS            = 0x0b,
+  SUBSCRIBE           = 0x0c,
+  INVOKEACTION        = 0x0d,
+  GETSNAPSHOT         = 0x0e,
+  LINKACK             = 0xfc, // OPTION_RELIABLE acknowledgement, never answered
   PAIR                = 0xfd, // Enable Thing communication with host
   UNPAIR              = 0xfe
 };
@@ -37,6 +217,17 @@ enum ThingAdapterResponse
   DETAILEVENTBYIDX    = 0x03,
   DETAILACTIONBYIDX   = 0x04,
   PROPERTYSTATUS      = 0x05,
+  PROPERTYSTATUSBATCH = 0x06,
+  OPTIONS             = 0x07,
+  DETAILBITRATES      = 0x08,
+  BITRATE             = 0x09,
+  DETAILCOMPLETE      = 0x0a,
+  STATS               = 0x0b,
+  SUBSCRIBED          = 0x0c,
+  ACTIONSTATUS        = 0x0d,
+  EVENTBATCH          = 0x0e,
+  SNAPSHOT            = 0x0f,
+  SNAPSHOTUNCHANGED   = 0x10,
   PAIRED              = 0xfd,
   UNPAIRED            = 0xfe,
   ERROR               = 0xff
@@ -49,10 +240,127 @@ enum PackedSerialThingAdapterError
   ERROR_PROPERTYIDX_OUTOFRANGE = 0x02,
   ERROR_THING_NULLPTR          = 0x03,
   ERROR_PROPERTY_NULLPTR       = 0x04,
+  ERROR_BITRATE_UNSUPPORTED    = 0x05,
+  ERROR_FRAME_OVERFLOW         = 0x06,
+  ERROR_SUBSCRIPTIONS_FULL     = 0x07,
+  ERROR_EVENTIDX_OUTOFRANGE    = 0x08,
+  ERROR_ACTIONIDX_OUTOFRANGE   = 0x09,
+  ERROR_ACTIONS_FULL           = 0x0a,
+  ERROR_VALUE_INVALID          = 0x0b,
+  ERROR_REQUEST_INVALID        = 0x0c, // unknown request, or too short
+  ERROR_OPTIONS_CONFLICT       = 0x0d, // another link's options don't allow it (see Several links)
   ERROR_NOT_PAIRED             = 0xff
 };
 
 
+// Status reported in ACTIONSTATUS.
+enum ThingActionStatus
+{
+  ACTION_QUEUED    = 0x00, // accepted, the handler will run in update()
+  ACTION_COMPLETED = 0x01  // the handler has returned
+};
+
+
+// Protocol options, enabled by the gateway with SETOPTIONS.
+enum ThingAdapterOption
+{
+  OPTION_BATCHSTATUS  = 0x01, // update() sends PROPERTYSTATUSBATCH instead of one PROPERTYSTATUS per change
+  OPTION_COMPACTNUMBER = 0x02, // NUMBER values in PROPERTYSTATUS(BATCH) and SETPROPERTY are zigzag varints
+  OPTION_DELTANUMBER  = 0x04, // with OPTION_COMPACTNUMBER, NUMBER values pushed by update() are deltas
+  OPTION_SEQUENCE     = 0x08, // requests and responses carry a sequence id after their type
+  OPTION_RELIABLE     = 0x10  // frames carry a CRC, and ours are sent again until acknowledged
+};
+
+#define THINGSUPPORTEDOPTIONS (OPTION_BATCHSTATUS | OPTION_COMPACTNUMBER | OPTION_SEQUENCE | \
+                               (THINGDELTANUMBER ? OPTION_DELTANUMBER : 0) | \
+                               (THINGRELIABLEWINDOW ? OPTION_RELIABLE : 0))
+
+
+// Errors are counted by code, with ERROR_NOT_PAIRED in errors[0].
+#define THINGERRORCODES 14
+
+
+// Performance counters kept when THINGSTATS is set.  Times are in microseconds.
+struct PackedSerialThingAdapterStats
+{
+  uint32_t packetsIn;
+  uint32_t bytesIn;
+  uint32_t packetsOut;
+  uint32_t bytesOut;
+  uint32_t statusMessages;  // PropertyStatus messages pushed by update()
+  uint32_t updateCount;
+  uint32_t updateTotal;
+  uint32_t updateWorst;
+  uint32_t receiveWorst;    // onPacketReceive() service time
+  uint16_t errors[THINGERRORCODES];
+  uint32_t crcErrors;       // OPTION_RELIABLE requests dropped for a bad CRC
+  uint32_t retransmits;     // OPTION_RELIABLE frames sent again
+  uint32_t abandoned;       // OPTION_RELIABLE frames pushed out of a full window unacknowledged
+};
+
+
+// Reporting limits the gateway has set for one property with SUBSCRIBE.
+struct PackedSerialThingSubscription
+{
+  uint8_t slot;
+  uint16_t minInterval;  // ms between PropertyStatus messages, changes in between are coalesced
+  uint16_t maxInterval;  // ms before the value is sent again even if unchanged, 0 for never
+  int32_t deadband;      // NUMBER changes smaller than this from the last value sent are not sent
+  int32_t lastValue;
+  uint32_t lastSent;
+};
+
+
+// Called from update() to carry out an action the gateway has invoked.
+typedef void (*ThingActionHandler)(int32_t input);
+
+
+// An event or action registered with addEvent()/addAction().
+struct PackedSerialThingInteraction
+{
+  ThingDevice *thing;
+  uint8_t thingIdx;      // resolved by begin()
+  uint8_t index;         // eventIdx/actionIdx within the thing
+  const char *name;
+  const char *description;
+  ThingActionHandler handler;  // actions only
+};
+
+
+// A property fed by publish().  publish() is the only writer of seq and value, and sets
+// pending once value is written; update() clears pending before reading value, so a publish()
+// in between sets it again.  Neither side ever waits on the other.
+struct PackedSerialThingPublished
+{
+  ThingProperty *property;
+  uint8_t slot;            // resolved by begin()
+  volatile uint8_t seq;    // odd while publish() is writing value
+  volatile int32_t value;
+  volatile boolean pending;  // value not yet copied into the property
+};
+
+
+// A STRING property with storage in the adapter's string pool.  The pool holds the length
+// at offset, then the characters and a terminator, so getValue() still works.
+struct PackedSerialThingString
+{
+  ThingPropertyString *property;
+  uint8_t slot;        // resolved by begin()
+  uint16_t offset;
+  uint8_t capacity;    // characters, not counting the terminator
+};
+
+
+// Called when the sketch gives the adapter work to do outside update() (see setWakeHandler()).
+// May be called from an interrupt handler, by postEvent() and publish().
+typedef void (*ThingWakeHandler)();
+
+
+// Called to switch the link to a new bitrate.  Must not return until pending output
+// at the old rate has been sent.
+typedef void (*ThingBitrateHandler)(uint32_t bps);
+
+
 // PackedSerialThingAdapter - maintains connection between devices and Gateway.
 class PackedSerialThingAdapter : public ThingAdapter, public IPacketReceiver
 {
@@ -61,48 +369,296 @@ class PackedSerialThingAdapter : public ThingAdapter, public IPacketReceiver
     // NOTES: adapterName is the name used for the board on the gateway.
     PackedSerialThingAdapter(const char *adapterName, const char *adapterDescription)
       : ThingAdapter(adapterName, adapterDescription),
-        connected(false)
+        serialStream(nullptr),
+        #if THINGMAXLINKS > 1
+        linkCount(1),
+        routedCount(0),
+        routePendingCount(0),
+        #endif
+        gatewayLinks(1),
+        thingOffset(0),
+        #if THINGTXQUEUESIZE
+        txHead(0),
+        txTail(0),
+        txCount(0),
+        #endif
+        connected(false),
+        serialOptions(0),
+        options(0),
+        nextOptions(0),
+        sequence(0),
+        #if THINGRELIABLEWINDOW
+        windowBase(0),
+        windowNext(0),
+        windowAcked(0),
+        windowResent(0),
+        resendPending(0),
+        retransmitStart(0),
+        #endif
+        schemaFingerprint(0),
+        bitrateHandler(nullptr),
+        bitrate(0),
+        maxBitrate(0),
+        pendingBitrate(0),
+        previousBitrate(0),
+        bitrateProbeStart(0),
+        bitrateProbing(false),
+        wakeHandler(nullptr),
+        deviceCount(0),
+        slotCount(0),
+        dirtyCount(0),
+        scanCursor(0),
+        updateMaxMessages(0),
+        updateMaxMicros(0),
+        updateStart(0),
+        #if THINGMAXSUBSCRIPTIONS
+        subscriptionCount(0),
+        #endif
+        #if THINGMAXEVENTS
+        eventCount(0),
+        eventHead(0),
+        eventTail(0),
+        eventsDropped(0),
+        eventsDroppedReported(0),
+        #endif
+        #if THINGMAXACTIONS
+        actionCount(0),
+        actionHead(0),
+        actionTail(0),
+        #endif
+        #if THINGMAXPUBLISHED
+        publishedCount(0),
+        publishPending(false),
+        #endif
+        #if THINGSTRINGPOOLSIZE
+        stringCount(0),
+        stringPoolUsed(0),
+        #endif
+        adapterGeneration(1)
     {
+      memset(dirtyMap, 0, sizeof(dirtyMap));
+      #if THINGDELTANUMBER
+      memset(lastNumber, 0, sizeof(lastNumber));
+      #endif
+      memset(pairedLinks, 0, sizeof(pairedLinks));
+      #if THINGMAXLINKS > 1
+      memset(routedPairedLinks, 0, sizeof(routedPairedLinks));
+      #endif
+      #if THINGTXQUEUESIZE
+      memset(txRoomMax, 0, sizeof(txRoomMax));
+      #endif
+      for (uint8_t i = 0; i < THINGMAXDEVICES; i++)
+        thingGeneration[i] = 1;
+      #if THINGSTATS
+      resetStats();
+      #endif
     }
 
 
-    uint8_t preparePropertyStatusMessage(uint8_t *messageBuffer, uint8_t index, uint8_t thingIdx, uint8_t propertyIdx)
+    // Flag a property as changed so the next update() sends a PropertyStatus for it.
+    // Only properties flagged here (or swept by THINGCHANGESCAN) are visited by update().
+    void setChanged(ThingProperty &property)
     {
-      ThingDevice *thing = this->getDevice(thingIdx);
+      property.changed = true;
 
-      if (thing != nullptr)
+      for (uint8_t slot = 0; slot < slotCount; slot++)
       {
-        ThingProperty *property = thing->getProperty(propertyIdx);
-
-        if (property != nullptr)
+        if (propertySlot[slot] == &property)
         {
-          index = SimplePack::writeUInt8(messageBuffer, ThingAdapterResponse::PROPERTYSTATUS, index);
-          index = SimplePack::writeUInt8(messageBuffer, thingIdx, index);
-          index = SimplePack::writeUInt8(messageBuffer, propertyIdx, index);
+          markDirty(slot, true);
+          break;
+        }
+      }
 
-          switch ((ThingPropertyDatatype) property->type)
-          {
-            case BOOLEAN:
-              index = SimplePack::writeUInt8(messageBuffer, ((ThingPropertyBoolean *)property)->getValue(), index);
-              break;
-            case NUMBER:
-              index = SimplePack::writeInt32BE(messageBuffer, ((ThingPropertyNumber *)property)->getValue(), index);
-              break;
-            case STRING:
-              index = SimplePack::writeString(messageBuffer, ((ThingPropertyString *)property)->getValue(), index);
-              break;
-            default:
-              // TODO: invalid datatype
-              break;
-          }
+      wake();
+    }
 
-          return index;
-        }
-        else
+
+    #if THINGMAXEVENTS
+    // Register an event thing can raise, before begin().  Returns the id to give postEvent(),
+    // or 0xff if there is no room.  The event's eventIdx is the order it was added to thing.
+    uint8_t addEvent(ThingDevice &thing, const char *name, const char *description)
+    {
+      if (eventCount >= THINGMAXEVENTS)
+        return 0xff;
+
+      PackedSerialThingInteraction &event = events[eventCount];
+
+      event.thing = &thing;
+      event.thingIdx = THINGMAXDEVICES;
+      event.index = thing.eventCount++;
+      event.name = name;
+      event.description = description;
+      event.handler = nullptr;
+
+      return eventCount++;
+    }
+    #endif
+
+
+    #if THINGMAXACTIONS
+    // Register an action the gateway can invoke on thing, before begin().  handler is called
+    // from update() with the input given by the gateway.  Returns false if there is no room.
+    boolean addAction(ThingDevice &thing, const char *name, const char *description, ThingActionHandler handler)
+    {
+      if (actionCount >= THINGMAXACTIONS)
+        return false;
+
+      PackedSerialThingInteraction &action = actions[actionCount++];
+
+      action.thing = &thing;
+      action.thingIdx = THINGMAXDEVICES;
+      action.index = thing.actionCount++;
+      action.name = name;
+      action.description = description;
+      action.handler = handler;
+
+      return true;
+    }
+    #endif
+
+
+    #if THINGMAXEVENTS
+    // Queue an occurrence of event (as returned by addEvent()) for update() to send.  Safe to
+    // call from an interrupt handler, as long as only one context posts events.  Returns false,
+    // and counts the event as dropped, if the queue is full.
+    boolean postEvent(uint8_t event, int32_t value = 0)
+    {
+      uint8_t head = eventHead;
+      uint8_t next = (head + 1) % THINGEVENTQUEUESIZE;
+
+      if (event >= eventCount)
+        return false;
+
+      if (next == eventTail)
+      {
+        eventsDropped++;
+        return false;
+      }
+
+      eventQueueEvent[head] = event;
+      eventQueueValue[head] = value;
+      eventHead = next;
+      wake();
+
+      return true;
+    }
+    #endif
+
+
+    #if THINGMAXPUBLISHED
+    // Let the NUMBER or BOOLEAN property be set from an interrupt handler with publish(), before
+    // begin().  Returns the id to give publish(), or 0xff if there is no room.
+    uint8_t addPublished(ThingProperty &property)
+    {
+      if (publishedCount >= THINGMAXPUBLISHED)
+        return 0xff;
+
+      PackedSerialThingPublished &published = publishedSlot[publishedCount];
+
+      published.property = &property;
+      published.slot = THINGMAXPROPERTIES;
+      published.seq = 0;
+      published.value = 0;
+      published.pending = false;
+
+      return publishedCount++;
+    }
+
+
+    // Set the value of a property registered with addPublished() (BOOLEANs take 0 or 1).
+    // Safe to call from an interrupt handler, as long as only one context publishes to each
+    // property.  update() copies the value into the property, so the sketch, update() and
+    // preparePropertyStatusMessage() never see a half written value, and the last value
+    // published is always sent.
+    void publish(uint8_t id, int32_t value)
+    {
+      if (id >= publishedCount)
+        return;
+
+      PackedSerialThingPublished &published = publishedSlot[id];
+
+      published.seq = published.seq + 1;
+      published.value = value;
+      published.seq = published.seq + 1;
+      published.pending = true;
+      publishPending = true;
+      wake();
+    }
+    #endif
+
+
+    #if THINGSTRINGPOOLSIZE
+    // Give a STRING property room for capacity characters in the adapter's string pool, before
+    // begin().  Its current value is copied in (cut short if need be).  Gateway SetProperty
+    // requests are then checked against capacity, and setString() can be used from the sketch.
+    // Returns false if the pool or table is full.
+    boolean addStringStorage(ThingPropertyString &property, uint8_t capacity)
+    {
+      if (stringCount >= THINGMAXSTRINGS || (uint16_t) capacity + 2 > THINGSTRINGPOOLSIZE - stringPoolUsed)
+        return false;
+
+      PackedSerialThingString &storage = strings[stringCount++];
+      boolean changed = property.changed;
+
+      storage.property = &property;
+      storage.slot = THINGMAXPROPERTIES;
+      storage.offset = stringPoolUsed;
+      storage.capacity = capacity;
+      stringPoolUsed += capacity + 2;
+
+      storeString(storage, property.getValue());
+      property.setValue(&stringPool[storage.offset + 1]);
+      property.changed = changed;
+
+      return true;
+    }
+
+
+    // Set a STRING property given storage with addStringStorage(), cutting value short if it
+    // doesn't fit, and flag it changed.  The property is pointed back at its storage if the
+    // sketch has set it elsewhere.  Returns false if the property has no storage.
+    boolean setString(ThingPropertyString &property, const char *value)
+    {
+      for (uint8_t i = 0; i < stringCount; i++)
+      {
+        if (strings[i].property == &property)
         {
-          return 0;
+          storeString(strings[i], value);
+          property.setValue(&stringPool[strings[i].offset + 1]);
+          property.changed = true;
+
+          if (strings[i].slot < THINGMAXPROPERTIES)
+            markDirty(strings[i].slot, true);
+          wake();
+
+          return true;
         }
       }
+
+      return false;
+    }
+    #endif
+
+
+    // messageBuffer must hold THINGFRAMESIZE bytes.
+    uint8_t preparePropertyStatusMessage(uint8_t *messageBuffer, uint8_t index, uint8_t thingIdx, uint8_t propertyIdx)
+    {
+      uint8_t slot = slotOf(thingIdx, propertyIdx);
+
+      if (slot < THINGMAXPROPERTIES)
+      {
+        #if THINGMAXPUBLISHED
+        collectPublished();
+        #endif
+
+        index = writeHeader(messageBuffer, ThingAdapterResponse::PROPERTYSTATUS, index);
+        index = writeThingIdx(messageBuffer, thingIdx, index);
+        index = writeUInt8(messageBuffer, propertyIdx, index);
+        index = writeStatusValue(messageBuffer, index, slot);
+
+        return index;
+      }
       else
       {
         return 0;
@@ -110,464 +666,3301 @@ class PackedSerialThingAdapter : public ThingAdapter, public IPacketReceiver
     }
 
 
-    void onPacketReceive(const uint8_t *data, size_t len)
+    // DetailAdapter:
+    //  uint8  - DETAILADAPTER
+    //  string - adapterName
+    //  string - adapterDescription
+    //  uint8  - thingCount
+    //  uint32 - schema fingerprint (see buildIndex()), 0 with routes, as it can't cover theirs
+    uint8_t prepareAdapterDetail(uint8_t *messageBuffer, uint8_t index)
     {
-      // TODO: check len -- Need to keep track of index into data against data required
+      uint32_t fingerprint = schemaFingerprint;
 
-      uint8_t inputIndex = 0;
-      uint8_t resp[32];  // TODO: response size
-      uint8_t index = 0;
-      uint8_t thingIdx;
-      uint8_t propertyIdx;
-      boolean formedResponse = false;
+      #if THINGMAXLINKS > 1
+      if (routedCount != 0)
+        fingerprint = 0;
+      #endif
 
-      uint8_t request = SimplePack::readUInt8(data, inputIndex);
-      inputIndex += 1;
+      index = writeHeader(messageBuffer, ThingAdapterResponse::DETAILADAPTER, index);
+      index = writeDescriptor(messageBuffer, this->name, index);
+      index = writeDescriptor(messageBuffer, this->description, index);
+      index = writeUInt8(messageBuffer, reportedThingCount(), index);
+      index = writeInt32BE(messageBuffer, fingerprint, index);
 
-      // Interpret our request
-      switch ((ThingAdapterRequest) request)
-      {
-        case PAIR:
-        case UNPAIR:
-          // Pair/Unpair incoming parameters:
-          //  uint8 - thingIdx
-          //
-          // Pair/Unpair response:
-          //  uint8  - PAIRED/UNPAIRED
-          //  uint8  - thingIdx
+      return index;
+    }
 
-          // Get thingIdx from request
-          thingIdx = SimplePack::readUInt8(data, inputIndex);
-          inputIndex += 1;
 
-          if (thingIdx < this->thingCount)
-          {
-            ThingDevice *thing = this->getDevice(thingIdx);
-
-            if (thing != nullptr)
-            {
-              uint8_t responseValue;
-
-              if (((ThingAdapterRequest) request) == ThingAdapterRequest::PAIR)
-              {
-                thing->paired = true;
-                responseValue = ThingAdapterResponse::PAIRED;
-              }
-              else
-              {
-                thing->paired = false;
-                responseValue = ThingAdapterResponse::UNPAIRED;
-              }
-
-              // Now prepare response
-              // Response type
-              index = SimplePack::writeUInt8(resp, responseValue, index);
-              // thingIdx
-              index = SimplePack::writeUInt8(resp, thingIdx, index);
-
-              formedResponse = true;
-            }
-            else
-            {
-              // Error while getting the device - return an error
-              index = SimplePack::writeUInt8(resp, ThingAdapterResponse::ERROR, index);
-              index = SimplePack::writeUInt8(resp, PackedSerialThingAdapterError::ERROR_THING_NULLPTR, index);
-
-              formedResponse = true;
-            }
-          }
-          else
-          {
-            // thingIdx out of range
-            index = SimplePack::writeUInt8(resp, ThingAdapterResponse::ERROR, index);
-            index = SimplePack::writeUInt8(resp, PackedSerialThingAdapterError::ERROR_THINGIDX_OUTOFRANGE, index);
+    // DetailThingByIdx (thingIdx must be valid):
+    //  uint8  - DETAILTHINGBYIDX
+    //  uint8  - thingIdx
+    //  uint8  - thingType
+    //  string - thingName
+    //  string - thingDescription
+    //  uint8  - propertyCount
+    //  uint8  - eventCount
+    //  uint8  - actionCount
+    uint8_t prepareThingDetail(uint8_t *messageBuffer, uint8_t index, uint8_t thingIdx)
+    {
+      ThingDevice *thing = deviceSlot[thingIdx];
 
-            formedResponse = true;
-          }
-          break;
-        case DEFINEADAPTER:
-          // DefineAdapter incoming parameters:
-          // - none
-          //
-          // DefineAdapter response:
-          //  uint8  - DETAILADAPTER
-          //  string - adapterName
-          //  string - adapterDescription
-          //  uint8  - thingCount
-
-          index = SimplePack::writeUInt8(resp, ThingAdapterResponse::DETAILADAPTER, index);
-          index = SimplePack::writeString(resp, this->name, index);
-          index = SimplePack::writeString(resp, this->description, index);
-          index = SimplePack::writeUInt8(resp, this->thingCount, index);
-
-          formedResponse = true;
-          break;
-        case DEFINETHINGBYIDX:
-          // DefineThingByIdx incoming parameters:
-          //  uint8  - thingIdx
-          //
-          // DefineThingByIdx response:
-          //  uint8  - DETAILTHINGBYIDX
-          //  uint8  - thingIdx
-          //  uint8  - thingType
-          //  string - thingName
-          //  string - thingDescription
-          //  uint8  - propertyCount
-          //  uint8  - eventCount
-          //  uint8  - actionCount
-
-          // Get thingIdx from request
-          thingIdx = SimplePack::readUInt8(data, inputIndex);
-          inputIndex += 1;
-
-          if (thingIdx < this->thingCount)
-          {
-            ThingDevice *thing = this->getDevice(thingIdx);
-
-            if (thing != nullptr)
-            {
-              // Now prepare response
-              // Response type
-              index = SimplePack::writeUInt8(resp, ThingAdapterResponse::DETAILTHINGBYIDX, index);
-              // thingIdx, id, name, type, description, propertyCount, eventCount, actionCount
-              index = SimplePack::writeUInt8(resp, thingIdx, index);
-              index = SimplePack::writeUInt8(resp, thing->type, index);
-              index = SimplePack::writeString(resp, thing->name, index);
-              index = SimplePack::writeString(resp, thing->description, index);
-              index = SimplePack::writeUInt8(resp, thing->propertyCount, index);
-              index = SimplePack::writeUInt8(resp, thing->eventCount, index);
-              index = SimplePack::writeUInt8(resp, thing->actionCount, index);
-
-              formedResponse = true;
-            }
-            else
-            {
-              // Error while getting the device - return an error
-              index = SimplePack::writeUInt8(resp, ThingAdapterResponse::ERROR, index);
-              index = SimplePack::writeUInt8(resp, PackedSerialThingAdapterError::ERROR_THING_NULLPTR, index);
-
-              formedResponse = true;
-            }
-          }
-          else
-          {
-            // thingIdx out of range
-            index = SimplePack::writeUInt8(resp, ThingAdapterResponse::ERROR, index);
-            index = SimplePack::writeUInt8(resp, PackedSerialThingAdapterError::ERROR_THINGIDX_OUTOFRANGE, index);
+      index = writeHeader(messageBuffer, ThingAdapterResponse::DETAILTHINGBYIDX, index);
+      index = writeThingIdx(messageBuffer, thingIdx, index);
+      index = writeUInt8(messageBuffer, thing->type, index);
+      index = writeDescriptor(messageBuffer, thing->name, index);
+      index = writeDescriptor(messageBuffer, thing->description, index);
+      index = writeUInt8(messageBuffer, thing->propertyCount, index);
+      index = writeUInt8(messageBuffer, thing->eventCount, index);
+      index = writeUInt8(messageBuffer, thing->actionCount, index);
 
-            formedResponse = true;
-          }
-          break;
-        case DEFINEPROPERTYBYIDX:
-          // DefinePropertyByIdx incoming parameters:
-          //  uint8 - thingIdx
-          //  uint8 - propertyIdx
-          //
-          // DefinePropertyByIdx response:
-          //  uint8  - DETAILPROPERTYBYIDX
-          //  uint8  - thingIdx
-          //  uint8  - propertyIdx
-          //  uint8  - propertyType
-          //  string - propertyName
-          //  string - propertyDescription
-          //  x      - value
-
-          // Get thingIdx from request
-          thingIdx = SimplePack::readUInt8(data, inputIndex);
-          inputIndex += 1;
-          // Get propertyIdx from request
-          propertyIdx = SimplePack::readUInt8(data, inputIndex);
-          inputIndex += 1;
-
-          if (thingIdx < this->thingCount)
-          {
-            ThingDevice *thing = this->getDevice(thingIdx);
-
-            if (thing != nullptr)
-            {
-              if (propertyIdx < thing->propertyCount)
-              {
-                ThingProperty *property = thing->getProperty(propertyIdx);
-
-                if (property != nullptr)
-                {
-                  // TODO: check datatype validity -- respond with error if invalid
-                  // Now prepare response
-                  // Response type
-                  index = SimplePack::writeUInt8(resp, ThingAdapterResponse::DETAILPROPERTYBYIDX, index);
-                  // thingIdx, propertyIdx, name, type, value
-                  index = SimplePack::writeUInt8(resp, thingIdx, index);
-                  index = SimplePack::writeUInt8(resp, propertyIdx, index);
-                  index = SimplePack::writeUInt8(resp, property->type, index);
-                  index = SimplePack::writeString(resp, property->name, index);
-                  index = SimplePack::writeString(resp, property->description, index);
-                  // Identify type and cast to get value
-                  switch ((ThingPropertyDatatype) property->type)
-                  {
-                    case BOOLEAN:
-                      index = SimplePack::writeUInt8(resp, ((ThingPropertyBoolean *)property)->getValue(), index);
-                      break;
-                    case NUMBER:
-                      index = SimplePack::writeInt32BE(resp, ((ThingPropertyNumber *)property)->getValue(), index);
-                      break;
-                    case STRING:
-                      index = SimplePack::writeString(resp, ((ThingPropertyString *)property)->getValue(), index);
-                      break;
-                    default:
-                      // TODO: invalid datatype
-                      break;
-                  }
-
-                  formedResponse = true;
-                }
-                else
-                {
-                  // Error while getting the property - return an error
-                  index = SimplePack::writeUInt8(resp, ThingAdapterResponse::ERROR, index);
-                  index = SimplePack::writeUInt8(resp, PackedSerialThingAdapterError::ERROR_PROPERTY_NULLPTR, index);
-
-                  formedResponse = true;
-                }
-              }
-              else
-              {
-                // propertyIdx out of range
-                index = SimplePack::writeUInt8(resp, ThingAdapterResponse::ERROR, index);
-                index = SimplePack::writeUInt8(resp, PackedSerialThingAdapterError::ERROR_PROPERTYIDX_OUTOFRANGE, index);
-
-                formedResponse = true;
-              }
-            }
-            else
-            {
-              // Error while getting the device - return an error
-              index = SimplePack::writeUInt8(resp, ThingAdapterResponse::ERROR, index);
-              index = SimplePack::writeUInt8(resp, PackedSerialThingAdapterError::ERROR_THING_NULLPTR, index);
-
-              formedResponse = true;
-            }
-          }
-          else
-          {
-            // thingIdx out of range
-            index = SimplePack::writeUInt8(resp, ThingAdapterResponse::ERROR, index);
-            index = SimplePack::writeUInt8(resp, PackedSerialThingAdapterError::ERROR_THINGIDX_OUTOFRANGE, index);
+      return index;
+    }
 
-            formedResponse = true;
-          }
 
-          break;
-        case SETPROPERTY:
-          // SetProperty incoming parameters:
-          //  uint8 - thingIdx
-          //  uint8 - propertyIdx
-          //  x     - value
-          //
-          // SetProperty response:
-          //  uint8 - PROPERTYSTATUS
-          //  uint8 - thingIdx
-          //  uint8 - propertyIdx
-          //  x     - value
-        case GETPROPERTY:
-          // getProperty incoming parameters:
-          //  uint8 - thingIdx
-          //  uint8 - propertyIdx
-          //
-          // getProperty response:
-          //  uint8 - PROPERTYSTATUS
-          //  uint8 - thingIdx
-          //  uint8 - propertyIdx
-          //  x     - value
-
-          // Get thingIdx from request
-          thingIdx = SimplePack::readUInt8(data, inputIndex);
-          inputIndex += 1;
-          // Get propertyIdx from request
-          propertyIdx = SimplePack::readUInt8(data, inputIndex);
-          inputIndex += 1;
-
-          if (thingIdx < this->thingCount)
-          {
-            ThingDevice *thing = this->getDevice(thingIdx);
-
-            if (thing != nullptr)
-            {
-              if (thing->paired)
-              {
-                if (propertyIdx < thing->propertyCount)
-                {
-                  ThingProperty *property = thing->getProperty(propertyIdx);
-
-                  if (property != nullptr)
-                  {
-                    // First, if we are setting...
-                    if ((ThingAdapterRequest) request == SETPROPERTY)
-                    {
-                      // Get data and set the property value
-                      switch ((ThingPropertyDatatype) property->type)
-                      {
-                        case BOOLEAN:
-                          ((ThingPropertyBoolean *) property)->setValue(SimplePack::readUInt8(data, inputIndex) ? true : false);
-                          inputIndex += 1;
-                          break;
-                        case NUMBER:
-                          ((ThingPropertyNumber *) property)->setValue(SimplePack::readInt32BE(data, inputIndex));
-                          inputIndex += 4;
-                          break;
-                        case STRING:
-                          // TODO: Un-klugify... bah getValue!  Need to use setValue...?
-                          // char newS[32];  // This uses up more RAM
-                          // SimplePack::readString(newS, data, inputIndex);
-                          // ((ThingPropertyString *) property)->setValue(newS);
-                          SimplePack::readString(((ThingPropertyString *) property)->getValue(), data, inputIndex);
-                          inputIndex += strlen(((ThingPropertyString *) property)->getValue());
-                          // inputIndex += strlen(newS);
-                          break;
-                        default:
-                          // TODO: invalid datatype
-                          break;
-                      }
-
-                      // Since we fall through here, we need to invalidate the changed signal, so
-                      // update() doesn't pick it up again later.
-                      property->changed = false;
-                    }
-
-                    // Next (or if GetProperty)... build and send PropertyStatus
-                    index = preparePropertyStatusMessage(resp, index, thingIdx, propertyIdx);
-                    formedResponse = true;
-                  }
-                  else
-                  {
-                    // Error while getting the property - return an error
-                    index = SimplePack::writeUInt8(resp, ThingAdapterResponse::ERROR, index);
-                    index = SimplePack::writeUInt8(resp, PackedSerialThingAdapterError::ERROR_PROPERTY_NULLPTR, index);
-
-                    formedResponse = true;
-                  }
-                }
-                else
-                {
-                  // propertyIdx out of range
-                  index = SimplePack::writeUInt8(resp, ThingAdapterResponse::ERROR, index);
-                  index = SimplePack::writeUInt8(resp, PackedSerialThingAdapterError::ERROR_PROPERTYIDX_OUTOFRANGE, index);
-
-                  formedResponse = true;
-                }
-              }
-              else
-              {
-                // Not paired
-                index = SimplePack::writeUInt8(resp, ThingAdapterResponse::ERROR, index);
-                index = SimplePack::writeUInt8(resp, PackedSerialThingAdapterError::ERROR_NOT_PAIRED, index);
-
-                formedResponse = true;
-              }
-            }
-            else
-            {
-              // Error while getting the device - return an error
-              index = SimplePack::writeUInt8(resp, ThingAdapterResponse::ERROR, index);
-              index = SimplePack::writeUInt8(resp, PackedSerialThingAdapterError::ERROR_THING_NULLPTR, index);
-
-              formedResponse = true;
-            }
-          }
-          else
-          {
-            // thingIdx out of range
-            index = SimplePack::writeUInt8(resp, ThingAdapterResponse::ERROR, index);
-            index = SimplePack::writeUInt8(resp, PackedSerialThingAdapterError::ERROR_THINGIDX_OUTOFRANGE, index);
+    // DetailPropertyByIdx (slot must be valid):
+    //  uint8  - DETAILPROPERTYBYIDX
+    //  uint8  - thingIdx
+    //  uint8  - propertyIdx
+    //  uint8  - propertyType
+    //  string - propertyName
+    //  string - propertyDescription
+    //  x      - value
+    uint8_t preparePropertyDetail(uint8_t *messageBuffer, uint8_t index, uint8_t slot)
+    {
+      ThingProperty *property = propertySlot[slot];
+      uint8_t thingIdx = slotThing[slot];
+
+      index = writeHeader(messageBuffer, ThingAdapterResponse::DETAILPROPERTYBYIDX, index);
+      index = writeThingIdx(messageBuffer, thingIdx, index);
+      index = writeUInt8(messageBuffer, slot - thingSlotBase[thingIdx], index);
+      index = writeUInt8(messageBuffer, slotType[slot], index);
+      index = writeDescriptor(messageBuffer, property->name, index);
+      index = writeDescriptor(messageBuffer, property->description, index);
+      index = writePropertyValue(messageBuffer, index, slot);
+
+      return index;
+    }
+
+
+    #if THINGMAXEVENTS || THINGMAXACTIONS
+    // DetailEventByIdx/DetailActionByIdx (i must be a valid events/actions index):
+    //  uint8  - DETAILEVENTBYIDX/DETAILACTIONBYIDX
+    //  uint8  - thingIdx
+    //  uint8  - eventIdx/actionIdx
+    //  string - name
+    //  string - description
+    uint8_t prepareInteractionDetail(uint8_t *messageBuffer, uint8_t index, uint8_t type, const PackedSerialThingInteraction &interaction)
+    {
+      index = writeHeader(messageBuffer, type, index);
+      index = writeThingIdx(messageBuffer, interaction.thingIdx, index);
+      index = writeUInt8(messageBuffer, interaction.index, index);
+      index = writeDescriptor(messageBuffer, interaction.name, index);
+      index = writeDescriptor(messageBuffer, interaction.description, index);
+
+      return index;
+    }
+    #endif
 
-            formedResponse = true;
-          }
-          break;
-        default:
-          break;
-      }
 
-      if (formedResponse)
-        serialConn.send(resp, index);
+    void onPacketReceive(const uint8_t *data, size_t len)
+    {
+      receive(0, data, len);
     }
 
 
     void begin(Stream &stream)
     {
+      serialStream = &stream;
+
       // Register our packet processing function with PackedSerial
       serialConn.setStream(stream);
       // serialConn.setPacketHandler([this](const uint8_t* buffer, size_t size) { this->onPacketReceive(buffer, size); });
       serialConn.setPacketReceiver(this);
+      measureTxBuffer(0);
 
-      // TODO: other preps?
+      buildIndex();
     }
 
 
+    // Starts Serial at THINGBITRATE (or bps, if lower).  If bps is higher, the gateway may
+    // later negotiate a switch to any standard bitrate up to bps.
     void begin(uint32_t bps = THINGBITRATE)
     {
-      Serial.begin(bps);
+      uint32_t startBps = (bps < THINGBITRATE) ? bps : THINGBITRATE;
+
+      Serial.begin(startBps);
       #if ARDUINO >= 100
       while (!Serial);
       #endif
       begin(Serial);
+
+      setBitrateHandler([](uint32_t newBps) { Serial.flush(); Serial.begin(newBps); }, startBps, bps);
+    }
+
+
+    // Allow the gateway to negotiate the bitrate of a stream given to begin(Stream &).
+    // handler switches the stream to a new bitrate, currentBps is the rate the stream is
+    // running at now, and maxBps the fastest rate we may be switched to.
+    void setBitrateHandler(ThingBitrateHandler handler, uint32_t currentBps, uint32_t maxBps)
+    {
+      bitrateHandler = handler;
+      bitrate = currentBps;
+      maxBitrate = maxBps;
+    }
+
+
+    #if THINGMAXLINKS > 1
+    // Serve a gateway on another stream as well, e.g. a UART alongside USB.  Each link pairs
+    // things for itself, and gets status messages and events for the things it has paired.
+    // Returns false once THINGMAXLINKS streams are in use.
+    boolean addLink(Stream &stream)
+    {
+      return attachLink(stream, 0, 0);
+    }
+
+
+    // Router mode: pass requests for things firstThing to firstThing + thingCount - 1 on to
+    // the board on stream, and what it sends back on to the gateways.  That board numbers
+    // its things from firstThing with setThingOffset(), so frames go through unchanged.
+    // firstThing must come after this adapter's own things.  Returns false once links, or
+    // THINGMAXROUTEDDEVICES things behind routes, are used up.
+    boolean addRoute(Stream &stream, uint8_t firstThing, uint8_t thingCount)
+    {
+      if (thingCount == 0 || firstThing < this->thingCount || firstThing + thingCount > 0xff ||
+          thingCount > THINGMAXROUTEDDEVICES - routedCount)
+        return false;
+
+      if (!attachLink(stream, firstThing, thingCount))
+        return false;
+
+      links[linkCount - 2].pairedBase = routedCount;
+      routedCount += thingCount;
+
+      return true;
+    }
+    #endif
+
+
+    // Number this adapter's things from offset on the wire, for a board behind another
+    // adapter's route (see addRoute()).
+    void setThingOffset(uint8_t offset)
+    {
+      thingOffset = offset;
     }
 
 
     void update()
     {
+      #if THINGSTATS
+      uint32_t start = micros();
+      #endif
+
+      if (updateMaxMicros != 0)
+        updateStart = micros();
+
       // 1. check if there is incoming data
       // 2. handle request
       // 3. check for changes on all properties of devices
       // 3a. if something changed, send PropertyStatus message
 
+      #if THINGRELIABLEWINDOW
+      // Nothing acknowledged for a while: send everything not yet acknowledged again
+      if (windowNext != windowBase && (millis() - retransmitStart) >= THINGRELIABLETIMEOUT)
+      {
+        windowResent = ~windowAcked & ((1 << (uint8_t) (windowNext - windowBase)) - 1);
+        resendPending = windowResent;
+        retransmitStart = millis();
+      }
+
+      // Frames to send again go before anything new, as far as there is room for them
+      sendResends();
+      #endif
+
+      // Responses waiting for room go out first
+      drainTxQueue(false);
+
       serialConn.update();  // This handles incoming requests
+      #if THINGMAXLINKS > 1
+      for (uint8_t i = 0; i < linkCount - 1; i++)
+        links[i].conn.update();
+      #endif
 
-      // Now check for changes
-      // iterate through all properties and preparePropertyStatusMessage for "changed" properties
-      ThingDevice *thing = this->firstDevice;
-      uint8_t thingIdx = 0;
+      #if THINGMAXACTIONS
+      runActions();
+      #endif
 
-      while (thing != nullptr)
+      // Switch bitrate once the response to SetBitrate has gone out, and fall back if the
+      // gateway doesn't talk to us at the new rate.
+      if (pendingBitrate != 0 && txQueueEmpty())
       {
-        if (thing->paired)
-        {
-          ThingProperty *property = thing->firstProperty;
-          uint8_t propertyIdx = 0;
+        previousBitrate = bitrate;
+        bitrate = pendingBitrate;
+        pendingBitrate = 0;
+        bitrateHandler(bitrate);
+        bitrateProbeStart = millis();
+        bitrateProbing = true;
+      }
+      else if (bitrateProbing && (millis() - bitrateProbeStart) > THINGBITRATETIMEOUT)
+      {
+        bitrate = previousBitrate;
+        bitrateHandler(bitrate);
+        bitrateProbing = false;
+      }
 
-          while (property != nullptr)
-          {
-            if (property->changed)
-            {
-              // property has changed, send PropertyStatus message, and reset.
-              uint8_t message[32];  // TODO: message size
-              uint8_t index = 0;
-
-              index = this->preparePropertyStatusMessage(message, index, thingIdx, propertyIdx);
-              serialConn.send(message, index);
-
-              property->changed = false;
-            }
-            property = property->next;
-            propertyIdx++;
-          }
-        }
+      #if THINGMAXPUBLISHED
+      collectPublished();
+      #endif
 
-        thing = thing->next;
-        thingIdx++;
+      #if THINGCHANGESCAN
+      // Sweep for properties changed with setValue() alone.  Once the slot is dirty the flag is
+      // cleared, so it is only seen again if the value changes again before it is sent.
+      for (uint8_t slot = 0; slot < slotCount; slot++)
+      {
+        if (propertySlot[slot]->changed && markDirty(slot, true))
+          propertySlot[slot]->changed = false;
       }
+      #endif
+
+      #if THINGMAXEVENTS
+      sendEvents();
+      #endif
+      sendChanges();
+
+      #if THINGSTATS
+      uint32_t elapsed = micros() - start;
+      stats.updateCount++;
+      stats.updateTotal += elapsed;
+      if (elapsed > stats.updateWorst)
+        stats.updateWorst = elapsed;
+      #endif
     }
 
 
-  private:
-    PackedSerial serialConn;
-    boolean connected;
-    // uint32_t lastCommunication; // TODO: might need this to be a unix timestamp
-};
+    // Limit how many PropertyStatus messages (maxMessages), or how long (maxMicros, from the
+    // start of update()), each update() spends on changes.  0 means no limit.  Changes left
+    // over are sent by the next update(), which carries on from the first property it skipped.
+    void setUpdateBudget(uint8_t maxMessages, uint16_t maxMicros)
+    {
+      updateMaxMessages = maxMessages;
+      updateMaxMicros = maxMicros;
+    }
 
 
-/*
-||
-|| @author         Brett Hagman <bhagman@roguerobotics.com>
-|| @url            http://roguerobotics.com/
+    // True if update() has something to do right now: bytes from the gateway, changes, events
+    // or actions, responses waiting for room, or a bitrate switch.  A sketch that only calls
+    // update() when this is true, and millisUntilDue() when it isn't, can sleep in between.
+    // Without THINGCHANGESCAN it only looks at counters and the dirty bitmap; with it, it also
+    // checks every property's changed flag, as update() would.
+    boolean hasPendingWork()
+    {
+      for (uint8_t link = 0; link < THINGMAXLINKS; link++)
+      {
+        if (linkStream(link) != nullptr && linkStream(link)->available() > 0)
+          return true;
+      }
+
+      if (!txQueueEmpty() || pendingBitrate != 0)
+        return true;
+
+      #if THINGRELIABLEWINDOW
+      if (resendPending != 0)
+        return true;
+      #endif
+
+      #if THINGMAXEVENTS
+      if (eventTail != eventHead)
+        return true;
+      #endif
+
+      #if THINGMAXACTIONS
+      if (actionTail != actionHead)
+        return true;
+      #endif
+
+      #if THINGMAXPUBLISHED
+      if (publishPending)
+        return true;
+      #endif
+
+      #if THINGCHANGESCAN
+      // Changed with setValue() alone, and not swept up yet
+      for (uint8_t slot = 0; slot < slotCount; slot++)
+      {
+        if (propertySlot[slot]->changed && deviceSlot[slotThing[slot]]->paired &&
+            !(dirtyMap[slot >> 3] & (1 << (slot & 7))))
+          return true;
+      }
+      #endif
+
+      return millisUntilDue() == 0;
+    }
+
+
+    // Milliseconds until update() has work that is waiting on a timer: a change held back by
+    // a subscription's minInterval, a subscription heartbeat, the end of a bitrate probe, or
+    // frames to send again for want of an acknowledgement.
+    // 0 if a change can go out now, 0xffffffff if nothing is waiting.
+    uint32_t millisUntilDue()
+    {
+      uint32_t now = millis();
+      uint32_t due = 0xffffffff;
+
+      if (bitrateProbing)
+        due = remainingMillis(now - bitrateProbeStart, THINGBITRATETIMEOUT + 1);
+
+      #if THINGRELIABLEWINDOW
+      if (windowNext != windowBase)
+      {
+        uint32_t remaining = remainingMillis(now - retransmitStart, THINGRELIABLETIMEOUT);
+
+        if (remaining < due)
+          due = remaining;
+      }
+      #endif
+
+      #if THINGMAXSUBSCRIPTIONS
+      // Only dirty slots can be held back, so clean bytes of the map are skipped
+      for (uint16_t slot = 0; slot < slotCount && due != 0 && dirtyCount != 0; slot++)
+      {
+        if (dirtyMap[slot >> 3] == 0)
+          slot |= 7;
+        else if (dirtyMap[slot >> 3] & (1 << (slot & 7)))
+        {
+          if (slotSubscription[slot] >= THINGMAXSUBSCRIPTIONS)
+            return 0;
+
+          PackedSerialThingSubscription &sub = subscriptions[slotSubscription[slot]];
+          uint32_t remaining = remainingMillis(now - sub.lastSent, sub.minInterval);
+
+          if (remaining < due)
+            due = remaining;
+        }
+      }
+
+      // Heartbeats for unpaired things are held until PAIR
+      for (uint8_t i = 0; i < subscriptionCount && due != 0; i++)
+      {
+        if (subscriptions[i].maxInterval != 0 && deviceSlot[slotThing[subscriptions[i].slot]]->paired)
+        {
+          uint32_t remaining = remainingMillis(now - subscriptions[i].lastSent, subscriptions[i].maxInterval);
+
+          if (remaining < due)
+            due = remaining;
+        }
+      }
+      #else
+      if (dirtyCount != 0)
+        return 0;
+      #endif
+
+      return due;
+    }
+
+
+    // Call handler whenever setChanged(), setString(), postEvent() or publish() give update()
+    // something to do, e.g. to bring the sketch out of a sleep loop.  Requests from the gateway
+    // wake a sleeping board through the serial port's own receive interrupt.
+    void setWakeHandler(ThingWakeHandler handler)
+    {
+      wakeHandler = handler;
+    }
+
+
+    // True once we have received a request from the gateway.
+    boolean isConnected()
+    {
+      return connected;
+    }
+
+
+    #if THINGSTATS
+    const PackedSerialThingAdapterStats &getStats()
+    {
+      return stats;
+    }
+
+
+    void resetStats()
+    {
+      memset(&stats, 0, sizeof(stats));
+    }
+    #endif
+
+
+    // CRC-16/CCITT-FALSE (polynomial 0x1021, starting at 0xffff), as used by OPTION_RELIABLE.
+    // Worked a byte at a time without a table, to keep it out of RAM and flash.
+    static uint16_t crc16(const uint8_t *data, size_t len)
+    {
+      uint16_t crc = 0xffff;
+
+      for (size_t i = 0; i < len; i++)
+      {
+        uint8_t x = (crc >> 8) ^ data[i];
+
+        x ^= x >> 4;
+        crc = (crc << 8) ^ ((uint16_t) x << 12) ^ ((uint16_t) x << 5) ^ x;
+      }
+
+      return crc;
+    }
+
+
+  private:
+    // A request, as far as onPacketReceive() has worked it out.
+    struct Request
+    {
+      uint8_t type;
+      const uint8_t *data;
+      size_t len;
+      uint8_t inputIndex;  // next byte of data to read
+      uint8_t thingIdx;
+      uint8_t itemIdx;     // propertyIdx, eventIdx or actionIdx
+      uint8_t slot;
+      ThingDevice *thing;
+      uint8_t link;        // the request came in on, and is answered on
+    };
+
+
+    // Builds the response to request in resp, and returns its length (0 for no response).
+    typedef uint8_t (PackedSerialThingAdapter::*RequestHandler)(Request &request, uint8_t *resp);
+
+
+    // What onPacketReceive() checks and resolves before calling a request's handler.
+    enum
+    {
+      RESOLVE_THING    = 0x01, // uint8 thingIdx comes first, and must be a thing in the table
+      RESOLVE_PAIRED   = 0x02, // ... which must be paired
+      RESOLVE_INDEX    = 0x04, // uint8 itemIdx comes next
+      RESOLVE_PROPERTY = 0x0c  // ... and must be a property in the table, found in slot
+    };
+
+
+    struct RequestEntry
+    {
+      uint8_t minLength;  // bytes after the type (and sequence id)
+      uint8_t resolve;
+      RequestHandler handler;
+    };
+
+
+    #if THINGMAXLINKS > 1
+    // A stream added with addLink() or addRoute().  The stream given to begin() is link 0, and
+    // is served by serialConn.
+    struct Link : public IPacketReceiver
+    {
+      Link()
+        : adapter(nullptr),
+          stream(nullptr),
+          number(0),
+          firstThing(0),
+          thingCount(0),
+          pairedBase(0),
+          options(0)
+      {
+      }
+
+      PackedSerialThingAdapter *adapter;
+      PackedSerial conn;
+      Stream *stream;
+      uint8_t number;
+      uint8_t firstThing;  // for a route, the things behind it
+      uint8_t thingCount;  // 0 for a gateway
+      uint8_t pairedBase;  // for a route, where its things start in routedPairedLinks
+      uint8_t options;     // for a route, the options passed on to the board behind
+
+      void onPacketReceive(const uint8_t *data, size_t len)
+      {
+        adapter->receive(number, data, len);
+      }
+    };
+
+
+    // A request passed on to a route, waiting for the reply to go back to link.
+    struct RoutePending
+    {
+      uint8_t route;
+      uint8_t link;
+      uint8_t type;
+      uint8_t sequence;
+      uint8_t thingIdx;
+      uint8_t itemIdx;
+    };
+    #endif
+
+
+    // Handle a frame arriving on link: a request from a gateway, or (see addRoute()) a frame from
+    // a board behind us, which goes straight on to the gateways.
+    void receive(uint8_t link, const uint8_t *data, size_t len)
+    {
+      Request request;
+      RequestEntry entry;
+      uint8_t index = 0;
+      boolean forwarded = false;
+
+      // Requests are read, and answered, with the options of the link they came on
+      options = linkOptions(link);
+
+      #if THINGMAXLINKS > 1
+      if (!(gatewayLinks & (1 << link)))
+      {
+        forwardToGateways(link, data, len);
+        options = pushOptions();
+        return;
+      }
+      #endif
+
+      #if THINGSTATS
+      uint32_t start = micros();
+      stats.packetsIn++;
+      stats.bytesIn += len;
+      #endif
+
+      #if THINGRELIABLEWINDOW
+      // Requests end in a CRC.  A corrupted one is dropped; the gateway will ask again.
+      if (link == 0 && (options & OPTION_RELIABLE))
+      {
+        if (len < 2 || crc16(data, len - 2) != (((uint16_t) data[len - 2] << 8) | data[len - 1]))
+        {
+          #if THINGSTATS
+          stats.crcErrors++;
+          #endif
+          return;
+        }
+
+        len -= 2;
+      }
+      #endif
+
+      connected = true;
+
+      // Without a whole header, there is no way to tell what (or whom) to answer
+      if (len < headerSize())
+      {
+        options = pushOptions();
+        return;
+      }
+
+      request.type = data[0];
+      request.data = data;
+      request.len = len;
+      request.inputIndex = 1;
+      request.link = link;
+
+      // Responses echo the request's sequence id
+      if (options & OPTION_SEQUENCE)
+        sequence = data[request.inputIndex++];
+
+      nextOptions = options;
+
+      // Check the request against its entry in the table, resolve its thing and property, then
+      // hand it to its handler (or for a thing behind a route, to the board there).  Each step
+      // either passes, or leaves an error response.
+      if (!lookupRequest(request.type, entry) || (len - request.inputIndex) < entry.minLength)
+        index = writeError(frame, PackedSerialThingAdapterError::ERROR_REQUEST_INVALID);
+      else if (request.type == PAIR && optionsConflict(link, options))
+        index = writeError(frame, PackedSerialThingAdapterError::ERROR_OPTIONS_CONFLICT);
+      else if (forwardRequest(request, entry.resolve))
+        forwarded = true;
+      else
+        index = resolveRequest(request, entry.resolve, frame);
+
+      if (index == 0 && !forwarded)
+        index = (this->*entry.handler)(request, frame);
+
+      if (index != 0)
+      {
+        sendFrame(1 << link, frame, index);
+
+        // Answering a request at a newly negotiated bitrate confirms it
+        if (link == 0 && request.type != SETBITRATE)
+          bitrateProbing = false;
+      }
+
+      #if THINGRELIABLEWINDOW
+      // Everything up to this response goes out the way it was built for, then the window starts over
+      if ((options ^ nextOptions) & OPTION_RELIABLE)
+      {
+        drainTxQueue(true);
+        windowBase = 0;
+        windowNext = 0;
+        windowAcked = 0;
+        windowResent = 0;
+        resendPending = 0;
+      }
+      #endif
+
+      linkOptions(link) = nextOptions;
+      options = pushOptions();
+      sequence = 0;
+
+      #if THINGSTATS
+      uint32_t elapsed = micros() - start;
+      if (elapsed > stats.receiveWorst)
+        stats.receiveWorst = elapsed;
+      #endif
+    }
+
+
+    // Find the table entry for a request type.  Returns false for requests we don't handle.
+    static boolean lookupRequest(uint8_t type, RequestEntry &entry)
+    {
+      // In ThingAdapterRequest order, with LINKACK, PAIR and UNPAIR last
+      static const RequestEntry requests[] PROGMEM =
+      {
+        { 0,  0,                                 &PackedSerialThingAdapter::handleDefineAdapter },     // DEFINEADAPTER
+        { 1,  RESOLVE_THING,                     &PackedSerialThingAdapter::handleDefineThing },       // DEFINETHINGBYIDX
+        { 2,  RESOLVE_THING | RESOLVE_PROPERTY,  &PackedSerialThingAdapter::handleDefineProperty },    // DEFINEPROPERTYBYIDX
+        #if THINGMAXEVENTS
+        { 2,  RESOLVE_THING | RESOLVE_INDEX,     &PackedSerialThingAdapter::handleDefineInteraction }, // DEFINEEVENTBYIDX
+        #else
+        { 0,  0,                                 nullptr },                                            // DEFINEEVENTBYIDX
+        #endif
+        #if THINGMAXACTIONS
+        { 2,  RESOLVE_THING | RESOLVE_INDEX,     &PackedSerialThingAdapter::handleDefineInteraction }, // DEFINEACTIONBYIDX
+        #else
+        { 0,  0,                                 nullptr },                                            // DEFINEACTIONBYIDX
+        #endif
+        { 3,  RESOLVE_THING | RESOLVE_PAIRED | RESOLVE_PROPERTY, &PackedSerialThingAdapter::handleProperty }, // SETPROPERTY
+        { 2,  RESOLVE_THING | RESOLVE_PAIRED | RESOLVE_PROPERTY, &PackedSerialThingAdapter::handleProperty }, // GETPROPERTY
+        { 1,  0,                                 &PackedSerialThingAdapter::handleSetOptions },        // SETOPTIONS
+        { 0,  0,                                 &PackedSerialThingAdapter::handleDefineBitrates },    // DEFINEBITRATES
+        { 4,  0,                                 &PackedSerialThingAdapter::handleSetBitrate },        // SETBITRATE
+        { 0,  0,                                 &PackedSerialThingAdapter::handleDefineAll },         // DEFINEALL
+        #if THINGSTATS
+        { 1,  0,                                 &PackedSerialThingAdapter::handleGetStats },          // GETSTATS
+        #else
+        { 0,  0,                                 nullptr },                                            // GETSTATS
+        #endif
+        #if THINGMAXSUBSCRIPTIONS
+        { 10, RESOLVE_THING | RESOLVE_PROPERTY,  &PackedSerialThingAdapter::handleSubscribe },         // SUBSCRIBE
+        #else
+        { 0,  0,                                 nullptr },                                            // SUBSCRIBE
+        #endif
+        #if THINGMAXACTIONS
+        { 3,  RESOLVE_THING | RESOLVE_PAIRED | RESOLVE_INDEX, &PackedSerialThingAdapter::handleInvokeAction }, // INVOKEACTION
+        #else
+        { 0,  0,                                 nullptr },                                            // INVOKEACTION
+        #endif
+        { 3,  0,                                 &PackedSerialThingAdapter::handleGetSnapshot },       // GETSNAPSHOT
+        #if THINGRELIABLEWINDOW
+        { 2,  0,                                 &PackedSerialThingAdapter::handleLinkAck },           // LINKACK
+        #else
+        { 0,  0,                                 nullptr },                                            // LINKACK
+        #endif
+        { 1,  RESOLVE_THING,                     &PackedSerialThingAdapter::handlePair },              // PAIR
+        { 1,  RESOLVE_THING,                     &PackedSerialThingAdapter::handlePair }               // UNPAIR
+      };
+      uint8_t i;
+
+      if (type <= GETSNAPSHOT)
+        i = type;
+      else if (type >= LINKACK && type <= UNPAIR)
+        i = GETSNAPSHOT + 1 + (type - LINKACK);
+      else
+        return false;
+
+      memcpy_P(&entry, &requests[i], sizeof(entry));
+
+      return entry.handler != nullptr;
+    }
+
+
+    // Read the thingIdx and itemIdx the request's table entry asks for, and check them.
+    // Returns 0, or the length of the error response written to resp.
+    uint8_t resolveRequest(Request &request, uint8_t resolve, uint8_t *resp)
+    {
+      if (resolve & RESOLVE_THING)
+      {
+        request.thingIdx = request.data[request.inputIndex++] - thingOffset;
+
+        if (request.thingIdx >= this->thingCount)
+          return writeError(resp, PackedSerialThingAdapterError::ERROR_THINGIDX_OUTOFRANGE);
+
+        request.thing = lookupDevice(request.thingIdx);
+
+        // Error while getting the device
+        if (request.thing == nullptr)
+          return writeError(resp, PackedSerialThingAdapterError::ERROR_THING_NULLPTR);
+
+        if ((resolve & RESOLVE_PAIRED) && !(pairedLinks[request.thingIdx] & (1 << request.link)))
+          return writeError(resp, PackedSerialThingAdapterError::ERROR_NOT_PAIRED);
+      }
+
+      if (resolve & RESOLVE_INDEX)
+      {
+        request.itemIdx = request.data[request.inputIndex++];
+
+        if ((resolve & RESOLVE_PROPERTY) == RESOLVE_PROPERTY)
+        {
+          if (request.itemIdx >= request.thing->propertyCount)
+            return writeError(resp, PackedSerialThingAdapterError::ERROR_PROPERTYIDX_OUTOFRANGE);
+
+          request.slot = slotOf(request.thingIdx, request.itemIdx);
+
+          // Error while getting the property
+          if (request.slot >= THINGMAXPROPERTIES)
+            return writeError(resp, PackedSerialThingAdapterError::ERROR_PROPERTY_NULLPTR);
+        }
+      }
+
+      return 0;
+    }
+
+
+    uint8_t writeError(uint8_t *resp, uint8_t code)
+    {
+      uint8_t index = writeHeader(resp, ThingAdapterResponse::ERROR, 0);
+
+      return writeUInt8(resp, code, index);
+    }
+
+
+    #if THINGMAXLINKS > 1
+    boolean attachLink(Stream &stream, uint8_t firstThing, uint8_t thingCount)
+    {
+      if (linkCount >= THINGMAXLINKS)
+        return false;
+
+      Link &link = links[linkCount - 1];
+
+      link.adapter = this;
+      link.stream = &stream;
+      link.number = linkCount;
+      link.firstThing = firstThing;
+      link.thingCount = thingCount;
+      link.conn.setStream(stream);
+      link.conn.setPacketReceiver(&link);
+      measureTxBuffer(linkCount);
+
+      if (thingCount == 0)
+        gatewayLinks |= (1 << linkCount);
+
+      linkCount++;
+
+      return true;
+    }
+    #endif
+
+
+    // Pass a request for a thing behind a route on to that board, as it is.  Returns false if
+    // the request is for us.  Frames go through unchanged, so a link whose options don't match
+    // those passed on to the route (see handleSetOptions()) is refused.
+    boolean forwardRequest(const Request &request, uint8_t resolve)
+    {
+      #if THINGMAXLINKS > 1
+      boolean forThing = (resolve & RESOLVE_THING) || request.type == GETSNAPSHOT;
+
+      for (uint8_t i = 0; i < linkCount - 1; i++)
+      {
+        Link &link = links[i];
+
+        if (link.thingCount == 0)
+          continue;
+
+        if (forThing && (uint8_t) (request.data[request.inputIndex] - link.firstThing) < link.thingCount)
+        {
+          uint8_t thingIdx = request.data[request.inputIndex];
+          uint8_t &paired = routedPairedLinks[link.pairedBase + thingIdx - link.firstThing];
+
+          if ((options ^ link.options) & ~OPTION_RELIABLE)
+          {
+            sendFrame(1 << request.link, frame, writeError(frame, PackedSerialThingAdapterError::ERROR_OPTIONS_CONFLICT));
+            return true;
+          }
+
+          // Still paired on another link, so the board behind keeps it paired, and we answer
+          if (request.type == UNPAIR && (paired & ~(1 << request.link)) != 0)
+          {
+            uint8_t index;
+
+            paired &= ~(1 << request.link);
+            index = writeHeader(frame, ThingAdapterResponse::UNPAIRED, 0);
+            index = writeUInt8(frame, thingIdx, index);
+            sendFrame(1 << request.link, frame, index);
+            return true;
+          }
+
+          link.conn.send(request.data, request.len);
+          expectReply(link.number, request);
+          return true;
+        }
+      }
+      #else
+      (void) request;
+      (void) resolve;
+      #endif
+
+      return false;
+    }
+
+
+    #if THINGMAXLINKS > 1
+    // Note a request passed on to route, so its reply goes back to the link that asked.  With
+    // no room left, the oldest is given up on.
+    void expectReply(uint8_t route, const Request &request)
+    {
+      if (routePendingCount >= THINGROUTEPENDING)
+      {
+        memmove(routePending, routePending + 1, sizeof(RoutePending) * (THINGROUTEPENDING - 1));
+        routePendingCount--;
+      }
+
+      RoutePending &pending = routePending[routePendingCount++];
+
+      pending.route = route;
+      pending.link = request.link;
+      pending.type = request.type;
+      pending.sequence = sequence;
+      pending.thingIdx = request.data[request.inputIndex];
+      pending.itemIdx = (request.inputIndex + 1U < request.len) ? request.data[request.inputIndex + 1] : 0;
+    }
+
+
+    // Whether the frame from a route is the reply to pending.  The board answers requests in
+    // order, one frame each, with the sequence id they came with.
+    boolean isReplyTo(const RoutePending &pending, const uint8_t *data, size_t len)
+    {
+      uint8_t h = headerSize();
+
+      if ((options & OPTION_SEQUENCE) && data[1] != pending.sequence)
+        return false;
+
+      switch (data[0])
+      {
+        case ThingAdapterResponse::ERROR:
+          return true;
+        case ThingAdapterResponse::DETAILTHINGBYIDX:
+          return pending.type == DEFINETHINGBYIDX;
+        case ThingAdapterResponse::DETAILPROPERTYBYIDX:
+          return pending.type == DEFINEPROPERTYBYIDX;
+        case ThingAdapterResponse::DETAILEVENTBYIDX:
+          return pending.type == DEFINEEVENTBYIDX;
+        case ThingAdapterResponse::DETAILACTIONBYIDX:
+          return pending.type == DEFINEACTIONBYIDX;
+        case ThingAdapterResponse::SUBSCRIBED:
+          return pending.type == SUBSCRIBE;
+        case ThingAdapterResponse::SNAPSHOT:
+        case ThingAdapterResponse::SNAPSHOTUNCHANGED:
+          return pending.type == GETSNAPSHOT;
+        case ThingAdapterResponse::PAIRED:
+          return pending.type == PAIR;
+        case ThingAdapterResponse::UNPAIRED:
+          return pending.type == UNPAIR;
+        case ThingAdapterResponse::PROPERTYSTATUS:
+          // Or a change pushed by the board's update()
+          return (pending.type == GETPROPERTY || pending.type == SETPROPERTY) && len > h + 1U &&
+                 data[h] == pending.thingIdx && data[h + 1] == pending.itemIdx;
+        case ThingAdapterResponse::ACTIONSTATUS:
+          // Or an ACTION_COMPLETED
+          return pending.type == INVOKEACTION && len > h + 2U && data[h + 2] == ACTION_QUEUED;
+        default:
+          return false;
+      }
+    }
+
+
+    // Frames the board behind a route sends on its own, rather than in reply to a request.
+    static boolean isPushed(uint8_t type)
+    {
+      return type == ThingAdapterResponse::PROPERTYSTATUS || type == ThingAdapterResponse::PROPERTYSTATUSBATCH ||
+             type == ThingAdapterResponse::EVENTBATCH || type == ThingAdapterResponse::ACTIONSTATUS;
+    }
+
+
+    // A frame from the board behind route.  A reply goes back to the link that asked, and
+    // anything else to the links that have its thing paired (for a batch, any of the route's
+    // things).  The answers to the SETOPTIONS we passed on are dropped, as the gateway has had
+    // ours.
+    void forwardToGateways(uint8_t route, const uint8_t *data, size_t len)
+    {
+      Link &link = links[route - 1];
+      uint8_t h = headerSize();
+      uint8_t to = 0;
+
+      if (len < h || len > THINGFRAMESIZE || data[0] == ThingAdapterResponse::OPTIONS)
+        return;
+
+      for (uint8_t i = 0; i < routePendingCount; )
+      {
+        if (routePending[i].route != route)
+        {
+          i++;
+          continue;
+        }
+
+        RoutePending pending = routePending[i];
+        boolean reply = isReplyTo(pending, data, len);
+
+        // Only a pushed frame can come before the oldest reply; any other means it was lost
+        if (!reply && isPushed(data[0]))
+          break;
+
+        routePendingCount--;
+        memmove(routePending + i, routePending + i + 1, sizeof(RoutePending) * (routePendingCount - i));
+
+        if (reply)
+        {
+          uint8_t thing = pending.thingIdx - link.firstThing;
+
+          if (data[0] == ThingAdapterResponse::PAIRED && thing < link.thingCount)
+            routedPairedLinks[link.pairedBase + thing] |= (1 << pending.link);
+          else if (data[0] == ThingAdapterResponse::UNPAIRED && thing < link.thingCount)
+            routedPairedLinks[link.pairedBase + thing] &= ~(1 << pending.link);
+
+          sendFrame(1 << pending.link, data, len);
+          return;
+        }
+      }
+
+      if (data[0] == ThingAdapterResponse::PROPERTYSTATUS || data[0] == ThingAdapterResponse::ACTIONSTATUS)
+      {
+        uint8_t thing = (len > h) ? (uint8_t) (data[h] - link.firstThing) : 0xff;
+
+        if (thing < link.thingCount)
+          to = routedPairedLinks[link.pairedBase + thing];
+      }
+      else if (isPushed(data[0]))
+      {
+        for (uint8_t thing = 0; thing < link.thingCount; thing++)
+          to |= routedPairedLinks[link.pairedBase + thing];
+      }
+      else
+      {
+        // A reply we lost track of
+        to = gatewayLinks;
+      }
+
+      if (to != 0)
+        sendFrame(to, data, len);
+    }
+    #endif
+
+
+    // Things the gateway can address: our own, and with routes, those behind them.
+    uint8_t reportedThingCount()
+    {
+      uint8_t count = this->thingCount;
+
+      #if THINGMAXLINKS > 1
+      for (uint8_t i = 0; i < linkCount - 1; i++)
+      {
+        if (links[i].firstThing + links[i].thingCount > count)
+          count = links[i].firstThing + links[i].thingCount;
+      }
+      #endif
+
+      return count;
+    }
+
+
+    // Pair/Unpair incoming parameters:
+    //  uint8 - thingIdx
+    //
+    // Pair/Unpair response:
+    //  uint8  - PAIRED/UNPAIRED
+    //  uint8  - thingIdx
+    uint8_t handlePair(Request &request, uint8_t *resp)
+    {
+      uint8_t thingIdx = request.thingIdx;
+      uint8_t responseValue;
+      uint8_t index;
+
+      // Each link pairs for itself.  The thing counts as paired while any link has it paired.
+      if (request.type == PAIR)
+      {
+        pairedLinks[thingIdx] |= (1 << request.link);
+        request.thing->paired = true;
+        responseValue = ThingAdapterResponse::PAIRED;
+
+        // Pick up anything that changed while we were unpaired
+        for (uint8_t slot = slotOf(thingIdx, 0); slot < slotCount && slotThing[slot] == thingIdx; slot++)
+        {
+          if (propertySlot[slot]->changed)
+            markDirty(slot);
+        }
+      }
+      else
+      {
+        pairedLinks[thingIdx] &= ~(1 << request.link);
+        request.thing->paired = (pairedLinks[thingIdx] != 0);
+        responseValue = ThingAdapterResponse::UNPAIRED;
+
+        // Hand pending changes back to the changed flags, to be picked up again on PAIR
+        for (uint8_t slot = slotOf(thingIdx, 0); slot < slotCount && slotThing[slot] == thingIdx && !request.thing->paired; slot++)
+        {
+          if (dirtyMap[slot >> 3] & (1 << (slot & 7)))
+            propertySlot[slot]->changed = true;
+          clearDirty(slot);
+        }
+      }
+
+      // The set of things in an adapter snapshot has changed
+      bumpGeneration(thingIdx);
+
+      index = writeHeader(resp, responseValue, 0);
+      index = writeThingIdx(resp, thingIdx, index);
+
+      return index;
+    }
+
+
+    // DefineAdapter incoming parameters:
+    // - none
+    //
+    // DefineAdapter response:
+    //  DETAILADAPTER (see prepareAdapterDetail())
+    uint8_t handleDefineAdapter(Request &, uint8_t *resp)
+    {
+      return prepareAdapterDetail(resp, 0);
+    }
+
+
+    // DefineThingByIdx incoming parameters:
+    //  uint8  - thingIdx
+    //
+    // DefineThingByIdx response:
+    //  DETAILTHINGBYIDX (see prepareThingDetail())
+    uint8_t handleDefineThing(Request &request, uint8_t *resp)
+    {
+      return prepareThingDetail(resp, 0, request.thingIdx);
+    }
+
+
+    // DefinePropertyByIdx incoming parameters:
+    //  uint8 - thingIdx
+    //  uint8 - propertyIdx
+    //
+    // DefinePropertyByIdx response:
+    //  DETAILPROPERTYBYIDX (see preparePropertyDetail())
+    uint8_t handleDefineProperty(Request &request, uint8_t *resp)
+    {
+      // TODO: check datatype validity -- respond with error if invalid
+      return preparePropertyDetail(resp, 0, request.slot);
+    }
+
+
+    #if THINGMAXEVENTS || THINGMAXACTIONS
+    // DefineEventByIdx/DefineActionByIdx incoming parameters:
+    //  uint8 - thingIdx
+    //  uint8 - eventIdx/actionIdx
+    //
+    // DefineEventByIdx/DefineActionByIdx response:
+    //  DETAILEVENTBYIDX/DETAILACTIONBYIDX (see prepareInteractionDetail())
+    uint8_t handleDefineInteraction(Request &request, uint8_t *resp)
+    {
+      uint8_t i;
+
+      #if THINGMAXEVENTS
+      if (request.type == DEFINEEVENTBYIDX)
+      {
+        i = interactionOf(events, eventCount, request.thingIdx, request.itemIdx);
+
+        if (i < eventCount)
+          return prepareInteractionDetail(resp, 0, ThingAdapterResponse::DETAILEVENTBYIDX, events[i]);
+        else
+          return writeError(resp, PackedSerialThingAdapterError::ERROR_EVENTIDX_OUTOFRANGE);
+      }
+      #endif
+
+      #if THINGMAXACTIONS
+      i = interactionOf(actions, actionCount, request.thingIdx, request.itemIdx);
+
+      if (i < actionCount)
+        return prepareInteractionDetail(resp, 0, ThingAdapterResponse::DETAILACTIONBYIDX, actions[i]);
+      else
+        return writeError(resp, PackedSerialThingAdapterError::ERROR_ACTIONIDX_OUTOFRANGE);
+      #else
+      return writeError(resp, PackedSerialThingAdapterError::ERROR_EVENTIDX_OUTOFRANGE);
+      #endif
+    }
+    #endif
+
+
+    #if THINGMAXACTIONS
+    // InvokeAction incoming parameters:
+    //  uint8 - thingIdx
+    //  uint8 - actionIdx
+    //  int32 - input (a zigzag varint with OPTION_COMPACTNUMBER)
+    //
+    // InvokeAction response:
+    //  uint8 - ACTIONSTATUS
+    //  uint8 - thingIdx
+    //  uint8 - actionIdx
+    //  uint8 - ACTION_QUEUED
+    //
+    // The handler runs later in update(), which then sends another ActionStatus with
+    // ACTION_COMPLETED (and with OPTION_SEQUENCE, the sequence id of this request).
+    uint8_t handleInvokeAction(Request &request, uint8_t *resp)
+    {
+      uint8_t i = interactionOf(actions, actionCount, request.thingIdx, request.itemIdx);
+      uint8_t next = (actionHead + 1) % THINGACTIONQUEUESIZE;
+      int32_t input;
+
+      if (i >= actionCount)
+        return writeError(resp, PackedSerialThingAdapterError::ERROR_ACTIONIDX_OUTOFRANGE);
+
+      if (!readNumber(request, input))
+        return writeError(resp, PackedSerialThingAdapterError::ERROR_VALUE_INVALID);
+
+      // No room to queue another invocation
+      if (next == actionTail)
+        return writeError(resp, PackedSerialThingAdapterError::ERROR_ACTIONS_FULL);
+
+      actionQueue[actionHead].action = i;
+      actionQueue[actionHead].link = request.link;
+      actionQueue[actionHead].sequence = sequence;
+      actionQueue[actionHead].input = input;
+      actionHead = next;
+
+      return writeActionStatus(resp, 0, actions[i], ThingActionStatus::ACTION_QUEUED);
+    }
+    #endif
+
+
+    // SetProperty incoming parameters:
+    //  uint8 - thingIdx
+    //  uint8 - propertyIdx
+    //  x     - value
+    //
+    // GetProperty incoming parameters:
+    //  uint8 - thingIdx
+    //  uint8 - propertyIdx
+    //
+    // SetProperty/GetProperty response:
+    //  uint8 - PROPERTYSTATUS
+    //  uint8 - thingIdx
+    //  uint8 - propertyIdx
+    //  x     - value
+    uint8_t handleProperty(Request &request, uint8_t *resp)
+    {
+      uint8_t slot = request.slot;
+      ThingProperty *property = propertySlot[slot];
+      boolean validValue = true;
+      uint8_t index;
+      int32_t number;
+
+      #if THINGMAXPUBLISHED
+      // Pick up anything published, so a SetProperty isn't undone by an older value
+      collectPublished();
+      #endif
+
+      // First, if we are setting...
+      if (request.type == SETPROPERTY)
+      {
+        // Get data and set the property value
+        switch ((ThingPropertyDatatype) slotType[slot])
+        {
+          case BOOLEAN:
+            ((ThingPropertyBoolean *) property)->setValue(request.data[request.inputIndex++] ? true : false);
+            break;
+          case NUMBER:
+            validValue = readNumber(request, number);
+            if (validValue)
+              ((ThingPropertyNumber *) property)->setValue(number);
+            break;
+          case STRING:
+            validValue = readStringValue(slot, request.data, request.len, request.inputIndex);
+            break;
+          default:
+            // TODO: invalid datatype
+            break;
+        }
+
+        // Value doesn't fit, or runs past the end of the request
+        if (!validValue)
+          return writeError(resp, PackedSerialThingAdapterError::ERROR_VALUE_INVALID);
+
+        // Invalidate the changed signal, so update() doesn't pick it up again later.
+        property->changed = false;
+        clearDirty(slot);
+        bumpGeneration(request.thingIdx);
+      }
+
+      // Next (or if GetProperty)... build PropertyStatus
+      index = writeHeader(resp, ThingAdapterResponse::PROPERTYSTATUS, 0);
+      index = writeThingIdx(resp, request.thingIdx, index);
+      index = writeUInt8(resp, request.itemIdx, index);
+      index = writeReplyValue(resp, index, slot);
+
+      return index;
+    }
+
+
+    // GetSnapshot incoming parameters:
+    //  uint8  - thingIdx (0xff for every paired thing)
+    //  uint16 - generation the gateway has (0 to always get a snapshot)
+    //
+    // If generation is the thing's current one (or for 0xff, the adapter's), the response is:
+    //  uint8  - SNAPSHOTUNCHANGED
+    //  uint8  - thingIdx
+    //  uint16 - generation
+    //
+    // Otherwise it is one or more Snapshot frames (see writeSnapshotHeader()).  For 0xff, every
+    // frame but the last has the more flag set.
+    uint8_t handleGetSnapshot(Request &request, uint8_t *resp)
+    {
+      uint8_t thingIdx = request.data[request.inputIndex];
+      uint16_t known;
+      uint16_t current;
+      uint8_t index;
+
+      if (thingIdx == 0xff)
+      {
+        request.inputIndex++;
+        current = adapterGeneration;
+      }
+      else
+      {
+        index = resolveRequest(request, RESOLVE_THING | RESOLVE_PAIRED, resp);
+        if (index != 0)
+          return index;
+
+        current = thingGeneration[request.thingIdx];
+      }
+
+      known = ((uint16_t) request.data[request.inputIndex] << 8) | request.data[request.inputIndex + 1];
+      request.inputIndex += 2;
+
+      if (known == current)
+      {
+        index = writeHeader(resp, ThingAdapterResponse::SNAPSHOTUNCHANGED, 0);
+        index = writeUInt8(resp, thingIdx, index);
+        index = writeUInt16BE(resp, current, index);
+
+        return index;
+      }
+
+      if (thingIdx != 0xff)
+      {
+        index = writeSnapshotHeader(resp);
+        index = writeThingSnapshot(resp, index, request.thingIdx);
+        resp[snapshotCountIndex()] = 1;
+
+        return index;
+      }
+
+      // Every thing paired on the request's link, in as few frames as they fit in.  A thing too
+      // big for a frame of its own gets ERROR_FRAME_OVERFLOW.
+      index = writeSnapshotHeader(resp);
+
+      for (uint8_t i = 0; i < deviceCount; i++)
+      {
+        if (!(pairedLinks[i] & (1 << request.link)))
+          continue;
+
+        uint8_t next = writeThingSnapshot(resp, index, i);
+
+        if (next == THINGFRAMEOVERFLOW && resp[snapshotCountIndex()] > 0)
+        {
+          resp[headerSize()] = 1;  // more
+          sendFrame(1 << request.link, resp, index);
+          index = writeSnapshotHeader(resp);
+          next = writeThingSnapshot(resp, index, i);
+        }
+
+        index = next;
+        if (index == THINGFRAMEOVERFLOW)
+          break;
+
+        resp[snapshotCountIndex()]++;
+      }
+
+      return index;
+    }
+
+
+    // Snapshot:
+    //  uint8  - SNAPSHOT
+    //  uint8  - more (1 if another Snapshot frame follows)
+    //  uint16 - adapter generation
+    //  uint8  - count
+    //  count x
+    //   uint8  - thingIdx
+    //   uint16 - thing generation
+    //   uint8  - propertyCount
+    //   propertyCount x
+    //    x     - value (NUMBERs as zigzag varints with OPTION_COMPACTNUMBER, never deltas)
+    uint8_t writeSnapshotHeader(uint8_t *buffer)
+    {
+      uint8_t index = writeHeader(buffer, ThingAdapterResponse::SNAPSHOT, 0);
+
+      index = writeUInt8(buffer, 0, index);
+      index = writeUInt16BE(buffer, adapterGeneration, index);
+      index = writeUInt8(buffer, 0, index);  // count, filled in as things are added
+
+      return index;
+    }
+
+
+    uint8_t snapshotCountIndex()
+    {
+      return headerSize() + 3;
+    }
+
+
+    uint8_t writeThingSnapshot(uint8_t *buffer, uint8_t index, uint8_t thingIdx)
+    {
+      uint8_t countIndex;
+
+      index = writeThingIdx(buffer, thingIdx, index);
+      index = writeUInt16BE(buffer, thingGeneration[thingIdx], index);
+      countIndex = index;
+      index = writeUInt8(buffer, 0, index);
+
+      for (uint8_t slot = slotOf(thingIdx, 0); slot < slotCount && slotThing[slot] == thingIdx && index != THINGFRAMEOVERFLOW; slot++)
+      {
+        index = writeReplyValue(buffer, index, slot);
+        buffer[countIndex]++;
+      }
+
+      return index;
+    }
+
+
+    // SetOptions incoming parameters:
+    //  uint8 - options (ThingAdapterOption flags)
+    //
+    // SetOptions response:
+    //  uint8 - OPTIONS
+    //  uint8 - options accepted (the requested options we support)
+    //
+    // The accepted options take effect after the response is sent, for the link it came on.
+    // Every SetOptions also resets the OPTION_DELTANUMBER reference of every NUMBER property
+    // to 0.  Options that would change how status messages and events are built for another
+    // link with things paired are refused with ERROR_OPTIONS_CONFLICT.
+    uint8_t handleSetOptions(Request &request, uint8_t *resp)
+    {
+      uint8_t index;
+
+      nextOptions = request.data[request.inputIndex++] & THINGSUPPORTEDOPTIONS;
+
+      if (!(nextOptions & OPTION_COMPACTNUMBER))
+        nextOptions &= ~OPTION_DELTANUMBER;
+
+      // A delta is against the last value sent, which a second gateway may not have seen
+      if (gatewayLinks & (gatewayLinks - 1))
+        nextOptions &= ~OPTION_DELTANUMBER;
+
+      // Only the stream given to begin() does OPTION_RELIABLE
+      if (request.link != 0)
+        nextOptions = (nextOptions & ~OPTION_RELIABLE) | (options & OPTION_RELIABLE);
+
+      if (optionsConflict(request.link, nextOptions))
+      {
+        nextOptions = options;
+        return writeError(resp, PackedSerialThingAdapterError::ERROR_OPTIONS_CONFLICT);
+      }
+
+      #if THINGDELTANUMBER
+      memset(lastNumber, 0, sizeof(lastNumber));
+      #endif
+
+      #if THINGMAXLINKS > 1
+      // The boards behind routes build their frames for the gateways, so they get the same
+      // options, less OPTION_RELIABLE (which is for our link to the gateway, not theirs)
+      for (uint8_t i = 0; i < linkCount - 1; i++)
+      {
+        Link &link = links[i];
+        uint8_t forward[3];
+        uint8_t forwardIndex = 0;
+
+        if (link.thingCount == 0)
+          continue;
+
+        forward[forwardIndex++] = SETOPTIONS;
+        if (link.options & OPTION_SEQUENCE)
+          forward[forwardIndex++] = 0;
+        forward[forwardIndex++] = nextOptions & ~OPTION_RELIABLE;
+        link.conn.send(forward, forwardIndex);
+        link.options = nextOptions & ~OPTION_RELIABLE;
+      }
+      #endif
+
+      index = writeHeader(resp, ThingAdapterResponse::OPTIONS, 0);
+      index = writeUInt8(resp, nextOptions, index);
+
+      return index;
+    }
+
+
+    // DefineBitrates incoming parameters:
+    // - none
+    //
+    // DefineBitrates response:
+    //  uint8  - DETAILBITRATES
+    //  uint8  - count
+    //  count x
+    //   uint32 - bps, in increasing order (count is 0 if we can't change bitrate)
+    uint8_t handleDefineBitrates(Request &request, uint8_t *resp)
+    {
+      uint8_t index = writeHeader(resp, ThingAdapterResponse::DETAILBITRATES, 0);
+      uint8_t countIndex = index;
+
+      index = writeUInt8(resp, 0, index);
+
+      // Only the stream given to begin() has a bitrate handler
+      for (uint8_t i = 0; i < bitrateCount() && request.link == 0; i++)
+      {
+        if (supportsBitrate(standardBitrate(i)))
+        {
+          index = writeInt32BE(resp, standardBitrate(i), index);
+          resp[countIndex]++;
+        }
+      }
+
+      return index;
+    }
+
+
+    // SetBitrate incoming parameters:
+    //  uint32 - bps (one of those listed by DETAILBITRATES)
+    //
+    // SetBitrate response:
+    //  uint8  - BITRATE
+    //  uint32 - bps
+    //
+    // The response is sent at the current bitrate, and then we switch.  The gateway must
+    // send a request at the new bitrate within THINGBITRATETIMEOUT ms, or we fall back.
+    uint8_t handleSetBitrate(Request &request, uint8_t *resp)
+    {
+      uint32_t bps = (uint32_t) SimplePack::readInt32BE(request.data, request.inputIndex);
+      uint8_t index;
+
+      request.inputIndex += 4;
+
+      if (request.link != 0 || (!supportsBitrate(bps) && bps != bitrate))
+        return writeError(resp, PackedSerialThingAdapterError::ERROR_BITRATE_UNSUPPORTED);
+
+      index = writeHeader(resp, ThingAdapterResponse::BITRATE, 0);
+      index = writeInt32BE(resp, bps, index);
+
+      if (bps != bitrate)
+        pendingBitrate = bps;
+
+      return index;
+    }
+
+
+    // DefineAll incoming parameters:
+    // - none
+    //
+    // DefineAll response, sent back to back without waiting on the gateway:
+    //  DETAILADAPTER
+    //  DETAILTHINGBYIDX for each thing
+    //   DETAILPROPERTYBYIDX for each of its properties
+    //   DETAILEVENTBYIDX for each of its events
+    //   DETAILACTIONBYIDX for each of its actions
+    //  DETAILCOMPLETE:
+    //   uint8 - DETAILCOMPLETE
+    //   uint8 - number of frames sent before this one
+    uint8_t handleDefineAll(Request &request, uint8_t *resp)
+    {
+      uint8_t index = prepareAdapterDetail(resp, 0);
+      uint8_t frameCount = 1;
+
+      sendFrame(1 << request.link, resp, index);
+
+      for (uint8_t i = 0; i < deviceCount; i++)
+      {
+        index = prepareThingDetail(resp, 0, i);
+        sendFrame(1 << request.link, resp, index);
+        frameCount++;
+
+        for (uint8_t slot = slotOf(i, 0); slot < slotCount && slotThing[slot] == i; slot++)
+        {
+          index = preparePropertyDetail(resp, 0, slot);
+          sendFrame(1 << request.link, resp, index);
+          frameCount++;
+        }
+
+        #if THINGMAXEVENTS
+        for (uint8_t e = 0; e < eventCount; e++)
+        {
+          if (events[e].thingIdx == i)
+          {
+            index = prepareInteractionDetail(resp, 0, ThingAdapterResponse::DETAILEVENTBYIDX, events[e]);
+            sendFrame(1 << request.link, resp, index);
+            frameCount++;
+          }
+        }
+        #endif
+
+        #if THINGMAXACTIONS
+        for (uint8_t a = 0; a < actionCount; a++)
+        {
+          if (actions[a].thingIdx == i)
+          {
+            index = prepareInteractionDetail(resp, 0, ThingAdapterResponse::DETAILACTIONBYIDX, actions[a]);
+            sendFrame(1 << request.link, resp, index);
+            frameCount++;
+          }
+        }
+        #endif
+      }
+
+      index = writeHeader(resp, ThingAdapterResponse::DETAILCOMPLETE, 0);
+      index = writeUInt8(resp, frameCount, index);
+
+      return index;
+    }
+
+
+    #if THINGMAXSUBSCRIPTIONS
+    // Subscribe incoming parameters:
+    //  uint8  - thingIdx
+    //  uint8  - propertyIdx
+    //  uint16 - minInterval (ms)
+    //  uint16 - maxInterval (ms, 0 for no heartbeat)
+    //  int32  - deadband (NUMBER only, 0 for any change)
+    //
+    // All zeros removes the subscription, so every change is sent right away again.
+    //
+    // Subscribe response:
+    //  uint8  - SUBSCRIBED
+    //  uint8  - thingIdx
+    //  uint8  - propertyIdx
+    uint8_t handleSubscribe(Request &request, uint8_t *resp)
+    {
+      const uint8_t *data = request.data + request.inputIndex;
+      uint16_t minInterval = ((uint16_t) data[0] << 8) | data[1];
+      uint16_t maxInterval = ((uint16_t) data[2] << 8) | data[3];
+      int32_t deadband = SimplePack::readInt32BE(data, 4);
+      uint8_t index;
+
+      request.inputIndex += 8;
+
+      // No room for another subscription
+      if (!subscribe(request.slot, minInterval, maxInterval, deadband))
+        return writeError(resp, PackedSerialThingAdapterError::ERROR_SUBSCRIPTIONS_FULL);
+
+      index = writeHeader(resp, ThingAdapterResponse::SUBSCRIBED, 0);
+      index = writeThingIdx(resp, request.thingIdx, index);
+      index = writeUInt8(resp, request.itemIdx, index);
+
+      return index;
+    }
+    #endif
+
+
+    #if THINGSTATS
+    // GetStats incoming parameters:
+    //  uint8  - reset (non-zero to reset the counters once read)
+    //
+    // GetStats response:
+    //  uint8  - STATS
+    //  uint32 - packetsIn
+    //  uint32 - bytesIn
+    //  uint32 - packetsOut
+    //  uint32 - bytesOut
+    //  uint32 - statusMessages
+    //  uint32 - update() average (us)
+    //  uint32 - update() worst (us)
+    //  uint32 - onPacketReceive() worst (us)
+    //  uint8  - errorCount
+    //  errorCount x
+    //   uint16 - errors with that code (ERROR_NOT_PAIRED first, then codes 0x01 onward)
+    uint8_t handleGetStats(Request &request, uint8_t *resp)
+    {
+      uint8_t index = writeHeader(resp, ThingAdapterResponse::STATS, 0);
+
+      index = writeInt32BE(resp, stats.packetsIn, index);
+      index = writeInt32BE(resp, stats.bytesIn, index);
+      index = writeInt32BE(resp, stats.packetsOut, index);
+      index = writeInt32BE(resp, stats.bytesOut, index);
+      index = writeInt32BE(resp, stats.statusMessages, index);
+      index = writeInt32BE(resp, stats.updateCount ? (stats.updateTotal / stats.updateCount) : 0, index);
+      index = writeInt32BE(resp, stats.updateWorst, index);
+      index = writeInt32BE(resp, stats.receiveWorst, index);
+      index = writeUInt8(resp, THINGERRORCODES, index);
+      for (uint8_t i = 0; i < THINGERRORCODES; i++)
+      {
+        index = writeUInt8(resp, stats.errors[i] >> 8, index);
+        index = writeUInt8(resp, stats.errors[i] & 0xff, index);
+      }
+
+      if (request.data[request.inputIndex++])
+        resetStats();
+
+      return index;
+    }
+    #endif
+
+
+    #if THINGRELIABLEWINDOW
+    // LinkAck incoming parameters:
+    //  uint8 - next (sequence number of the first frame not received; every one before it was)
+    //  uint8 - received (bit i set if frame next + 1 + i was received)
+    //
+    // No response.  The stream keeps frames in order, so a frame missing from before one that
+    // was received is lost, and is sent again as soon as there is room.  Only once, though: every
+    // LINKACK until it arrives reports the same gap, and if it is lost again the timeout sends it.
+    uint8_t handleLinkAck(Request &request, uint8_t *)
+    {
+      uint8_t next = request.data[request.inputIndex++];
+      uint8_t received = request.data[request.inputIndex++];
+      uint8_t advance = next - windowBase;
+      uint8_t outstanding = windowNext - windowBase;
+
+      // Stale, or from before the window started over
+      if (request.link != 0 || !(options & OPTION_RELIABLE) || advance > outstanding)
+        return 0;
+
+      if (advance > 0)
+      {
+        windowBase = next;
+        windowAcked >>= advance;
+        windowResent >>= advance;
+        resendPending >>= advance;
+        retransmitStart = millis();
+        outstanding -= advance;
+      }
+
+      windowAcked |= received << 1;
+      windowAcked &= (1 << outstanding) - 1;
+      resendPending &= ~windowAcked;
+
+      // Everything below the highest frame received that is still missing
+      for (uint8_t i = 0; (windowAcked >> i) > 1; i++)
+      {
+        if (!(windowAcked & (1 << i)) && !(windowResent & (1 << i)))
+        {
+          resendPending |= (1 << i);
+          windowResent |= (1 << i);
+        }
+      }
+
+      sendResends();
+
+      return 0;
+    }
+    #endif
+
+
+    // Read a NUMBER from the request: 4 bytes, or a zigzag varint with OPTION_COMPACTNUMBER.
+    // Returns false if it runs past the end of the request.
+    boolean readNumber(Request &request, int32_t &value)
+    {
+      const uint8_t *data = request.data;
+      uint8_t index = request.inputIndex;
+
+      if (options & OPTION_COMPACTNUMBER)
+      {
+        uint32_t v = 0;
+        uint8_t shift = 0;
+        uint8_t b;
+
+        do
+        {
+          if (index >= request.len)
+            return false;
+
+          b = data[index++];
+          v |= (uint32_t) (b & 0x7f) << shift;
+          shift += 7;
+        } while ((b & 0x80) && shift < 35);
+
+        value = (int32_t) ((v >> 1) ^ (~(v & 1) + 1));
+      }
+      else
+      {
+        if (request.len < (size_t) index + 4)
+          return false;
+
+        value = SimplePack::readInt32BE(data, index);
+        index += 4;
+      }
+
+      request.inputIndex = index;
+
+      return true;
+    }
+
+
+    // Send a PropertyStatus for each dirty property.
+    void sendChanges()
+    {
+      #if THINGMAXSUBSCRIPTIONS
+      uint32_t now = millis();
+
+      // Subscriptions with a heartbeat are sent again once maxInterval has passed.  The value is
+      // the same, so snapshots taken before are still good.
+      for (uint8_t i = 0; i < subscriptionCount; i++)
+      {
+        if (subscriptions[i].maxInterval != 0 && (now - subscriptions[i].lastSent) >= subscriptions[i].maxInterval)
+          markDirty(subscriptions[i].slot, false, false);
+      }
+      #endif
+
+      // Nothing changed, nothing to do.  Also, responses waiting to go out come first.
+      if (dirtyCount == 0 || !txQueueEmpty())
+        return;
+
+      // Now send a PropertyStatus message for each dirty property, skipping over clean bytes of the map.
+      // The scan starts where the last one stopped, so with an update budget (see setUpdateBudget())
+      // every property gets its turn.
+      // With OPTION_BATCHSTATUS, changes are packed into as few PropertyStatusBatch frames as fit.
+      //
+      // PropertyStatusBatch:
+      //  uint8 - PROPERTYSTATUSBATCH
+      //  uint8 - count
+      //  count x
+      //   uint8 - thingIdx
+      //   uint8 - propertyIdx
+      //   x     - value
+      //
+      // Messages are only built while the stream has room for them (see THINGTXQUEUESIZE).
+      // Whatever doesn't fit stays dirty until the next update(), by which time it may have a
+      // newer value, so a slow link never builds up a backlog of stale values.
+      uint8_t *message = frame;
+      uint8_t index = 0;
+      uint8_t batchCount = 0;
+      uint8_t countIndex = 0;
+      uint8_t frameLinks = 0;
+      uint16_t room = 0;
+      boolean full = false;
+      uint8_t sent = 0;
+      uint8_t first = scanCursor;
+      uint8_t skipped = THINGMAXPROPERTIES;
+
+      for (uint8_t n = 0; n < slotCount && dirtyCount > 0 && !full; n++)
+      {
+        uint8_t slot = first + n;
+
+        if (slot >= slotCount)
+          slot -= slotCount;
+
+        if ((slot & 7) == 0 && dirtyMap[slot >> 3] == 0)
+        {
+          // Skip the rest of this clean byte, but not past the last slot
+          n += (slot + 7 < slotCount) ? 7 : (slotCount - 1 - slot);
+          continue;
+        }
+
+        if (!(dirtyMap[slot >> 3] & (1 << (slot & 7))))
+          continue;
+
+        // Out of budget, carry on from here next time
+        if ((updateMaxMessages != 0 && sent >= updateMaxMessages) ||
+            (updateMaxMicros != 0 && (micros() - updateStart) >= updateMaxMicros))
+        {
+          scanCursor = slot;
+          full = true;
+          continue;
+        }
+
+        uint8_t thingIdx = slotThing[slot];
+        uint8_t entrySize = 2 + statusValueSize(slot);
+
+        // Status goes to each link the thing is paired on, so a batch only holds things
+        // paired on the same links
+        if (pairedLinks[thingIdx] != frameLinks)
+        {
+          if (batchCount > 0)
+          {
+            message[countIndex] = batchCount;
+            sendFrame(frameLinks, message, index);
+            index = 0;
+            batchCount = 0;
+          }
+
+          frameLinks = pairedLinks[thingIdx];
+          room = txRoom(frameLinks);
+        }
+
+        if (options & OPTION_BATCHSTATUS)
+        {
+          // Flush the batch if this entry won't fit
+          if (batchCount > 0 && ((index + entrySize) > THINGBATCHSIZE || framedSize(index + entrySize) > room))
+          {
+            message[countIndex] = batchCount;
+            sendFrame(frameLinks, message, index);
+            index = 0;
+            batchCount = 0;
+            room = txRoom(frameLinks);
+          }
+
+          if (batchCount == 0 && framedSize(headerSize() + 1 + entrySize) > room)
+          {
+            full = skipChange(slot, skipped, room);
+            continue;
+          }
+        }
+        else if (framedSize(headerSize() + entrySize) > room)
+        {
+          full = skipChange(slot, skipped, room);
+          continue;
+        }
+
+        #if THINGMAXSUBSCRIPTIONS
+        if (slotSubscription[slot] < THINGMAXSUBSCRIPTIONS && !subscriptionDue(slot, now))
+          continue;
+        #endif
+
+        if (options & OPTION_BATCHSTATUS)
+        {
+          if (batchCount == 0)
+          {
+            index = writeHeader(message, ThingAdapterResponse::PROPERTYSTATUSBATCH, index);
+            countIndex = index;
+            index = writeUInt8(message, 0, index);  // count, filled in on flush
+          }
+
+          batchCount++;
+        }
+        else
+        {
+          index = writeHeader(message, ThingAdapterResponse::PROPERTYSTATUS, index);
+        }
+
+        // property has changed, reset it, and add it to the PropertyStatus message.  Resetting
+        // first means a change made while the message is built is sent next time, not lost.
+        propertySlot[slot]->changed = false;
+        clearDirty(slot);
+
+        index = writeThingIdx(message, thingIdx, index);
+        index = writeUInt8(message, slot - thingSlotBase[thingIdx], index);
+        index = writeStatusValue(message, index, slot);
+
+        if (batchCount == 0)
+        {
+          sendFrame(frameLinks, message, index);
+          index = 0;
+          room = txRoom(frameLinks);
+        }
+
+        sent++;
+        scanCursor = (slot + 1 < slotCount) ? slot + 1 : 0;
+
+        #if THINGSTATS
+        stats.statusMessages++;
+        #endif
+      }
+
+      if (batchCount > 0)
+      {
+        message[countIndex] = batchCount;
+        sendFrame(frameLinks, message, index);
+      }
+
+      // Whatever didn't fit goes first next time
+      if (skipped < THINGMAXPROPERTIES)
+        scanCursor = skipped;
+    }
+
+
+    // The change in slot doesn't fit in room.  Smaller ones after it may, so the scan carries
+    // on past it, unless room is too small for any status at all.  Returns true to stop.
+    boolean skipChange(uint8_t slot, uint8_t &skipped, uint16_t room)
+    {
+      if (skipped == THINGMAXPROPERTIES)
+        skipped = slot;
+
+      // Type, thingIdx, propertyIdx and a 1 byte value
+      return framedSize(headerSize() + 3) > room;
+    }
+
+
+    #if THINGSTRINGPOOLSIZE
+    // Returns the storage of the STRING property in slot, or THINGMAXSTRINGS if it has none.
+    // A property the sketch has since pointed elsewhere with setValue() has none either.
+    uint8_t stringOf(uint8_t slot)
+    {
+      for (uint8_t i = 0; i < stringCount; i++)
+      {
+        if (strings[i].slot == slot)
+        {
+          if (strings[i].property->getValue() != &stringPool[strings[i].offset + 1])
+            return THINGMAXSTRINGS;
+
+          return i;
+        }
+      }
+
+      return THINGMAXSTRINGS;
+    }
+    #endif
+
+
+    // Length of the STRING property in slot, from its length byte when it has storage.
+    uint8_t stringLength(uint8_t slot)
+    {
+      #if THINGSTRINGPOOLSIZE
+      uint8_t i = stringOf(slot);
+
+      if (i < THINGMAXSTRINGS)
+        return stringPool[strings[i].offset];
+      #endif
+
+      return strlen(((ThingPropertyString *)propertySlot[slot])->getValue());
+    }
+
+
+    #if THINGSTRINGPOOLSIZE
+    // Copy value into storage, up to its capacity, and set the length.
+    void storeString(const PackedSerialThingString &storage, const char *value)
+    {
+      char *dest = &stringPool[storage.offset + 1];
+      uint8_t length = 0;
+
+      while (length < storage.capacity && value[length] != '\0')
+      {
+        dest[length] = value[length];
+        length++;
+      }
+
+      dest[length] = '\0';
+      stringPool[storage.offset] = length;
+    }
+    #endif
+
+
+    // Set the STRING property in slot from the terminated string at data[inputIndex], and advance
+    // inputIndex past it.  The string must end within the request's len bytes and fit in the
+    // property's storage (or without storage, in the length of its current value), or the value
+    // is left alone and false returned.
+    boolean readStringValue(uint8_t slot, const uint8_t *data, size_t len, uint8_t &inputIndex)
+    {
+      char *value = ((ThingPropertyString *)propertySlot[slot])->getValue();
+      #if THINGSTRINGPOOLSIZE
+      uint8_t i = stringOf(slot);
+      size_t capacity = (i < THINGMAXSTRINGS) ? strings[i].capacity : strlen(value);
+      #else
+      size_t capacity = strlen(value);
+      #endif
+      size_t available;
+      const uint8_t *end;
+
+      if (inputIndex >= len)
+        return false;
+
+      available = len - inputIndex;
+      end = (const uint8_t *) memchr(data + inputIndex, '\0', (available < capacity + 1) ? available : capacity + 1);
+
+      if (end == nullptr)
+        return false;
+
+      uint8_t length = end - (data + inputIndex);
+
+      memcpy(value, data + inputIndex, length + 1);
+      #if THINGSTRINGPOOLSIZE
+      if (i < THINGMAXSTRINGS)
+        stringPool[strings[i].offset] = length;
+      #endif
+      inputIndex += length + 1;
+
+      return true;
+    }
+
+
+    #if THINGMAXPUBLISHED
+    // Copy values published since the last call into their properties, and mark the ones that
+    // changed dirty.  The pending flags are cleared before the values are read, so a publish()
+    // that lands while we are here sets them again and is picked up next time.
+    void collectPublished()
+    {
+      if (!publishPending)
+        return;
+
+      publishPending = false;
+
+      for (uint8_t i = 0; i < publishedCount; i++)
+      {
+        PackedSerialThingPublished &published = publishedSlot[i];
+        uint8_t seq;
+        int32_t value;
+
+        if (!published.pending || published.slot >= THINGMAXPROPERTIES)
+          continue;
+
+        published.pending = false;
+
+        // Read until we get a value no publish() was in the middle of
+        do
+        {
+          seq = published.seq;
+          value = published.value;
+        } while ((seq & 1) || seq != published.seq);
+
+        if (slotType[published.slot] == BOOLEAN)
+          ((ThingPropertyBoolean *) published.property)->setValue(value ? true : false);
+        else
+          ((ThingPropertyNumber *) published.property)->setValue(value);
+
+        if (published.property->changed)
+          markDirty(published.slot, true);
+      }
+    }
+    #endif
+
+
+    void wake()
+    {
+      if (wakeHandler != nullptr)
+        wakeHandler();
+    }
+
+
+    static uint32_t remainingMillis(uint32_t elapsed, uint32_t interval)
+    {
+      return (elapsed < interval) ? interval - elapsed : 0;
+    }
+
+
+    #if THINGMAXACTIONS
+    // Run the handlers of actions queued by INVOKEACTION, and report each one completed on the
+    // link that invoked it.
+    void runActions()
+    {
+      while (actionTail != actionHead)
+      {
+        PackedSerialThingActionRecord &record = actionQueue[actionTail];
+        PackedSerialThingInteraction &action = actions[record.action];
+        uint8_t index;
+
+        if (action.handler != nullptr)
+          action.handler(record.input);
+
+        actionTail = (actionTail + 1) % THINGACTIONQUEUESIZE;
+
+        // Tag the completion with the sequence id of the request that invoked it, in the
+        // options of the link it came on
+        sequence = record.sequence;
+        options = linkOptions(record.link);
+        index = writeActionStatus(frame, 0, action, ThingActionStatus::ACTION_COMPLETED);
+        options = pushOptions();
+        sequence = 0;
+
+        sendFrame(1 << record.link, frame, index);
+      }
+    }
+
+
+    // ActionStatus:
+    //  uint8 - ACTIONSTATUS
+    //  uint8 - thingIdx
+    //  uint8 - actionIdx
+    //  uint8 - status (ThingActionStatus)
+    uint8_t writeActionStatus(uint8_t *buffer, uint8_t index, const PackedSerialThingInteraction &action, uint8_t status)
+    {
+      index = writeHeader(buffer, ThingAdapterResponse::ACTIONSTATUS, index);
+      index = writeThingIdx(buffer, action.thingIdx, index);
+      index = writeUInt8(buffer, action.index, index);
+      index = writeUInt8(buffer, status, index);
+
+      return index;
+    }
+    #endif
+
+
+    #if THINGMAXEVENTS
+    // Send the events posted since the last update(), as many to a frame as fit.  Like status
+    // messages, events wait while responses are queued or the stream has no room, but they are
+    // never coalesced.  Each event goes to the links its thing is paired on, and events of
+    // unpaired things are discarded.
+    //
+    // EventBatch:
+    //  uint8 - EVENTBATCH
+    //  uint8 - dropped (events lost to a full queue since the last EventBatch, modulo 256)
+    //  uint8 - count
+    //  count x
+    //   uint8 - thingIdx
+    //   uint8 - eventIdx
+    //   int32 - value (a zigzag varint with OPTION_COMPACTNUMBER)
+    void sendEvents()
+    {
+      uint8_t *message = frame;
+      uint8_t index = 0;
+      uint8_t batchCount = 0;
+      uint8_t countIndex = 0;
+      uint8_t frameLinks = 0;
+      uint8_t dropped = 0;
+
+      if (eventTail == eventHead || !txQueueEmpty())
+        return;
+
+      while (eventTail != eventHead)
+      {
+        uint8_t tail = eventTail;
+        PackedSerialThingInteraction &event = events[eventQueueEvent[tail]];
+        int32_t value = eventQueueValue[tail];
+        uint8_t valueSize = (options & OPTION_COMPACTNUMBER) ? varIntSize(value) : 4;
+
+        if (event.thingIdx >= deviceCount || pairedLinks[event.thingIdx] == 0)
+        {
+          eventTail = (tail + 1) % THINGEVENTQUEUESIZE;
+          continue;
+        }
+
+        // Flush the batch if this event won't fit, or goes to other links
+        if (batchCount > 0 && (pairedLinks[event.thingIdx] != frameLinks || (index + 2 + valueSize) > THINGBATCHSIZE ||
+                               framedSize(index + 2 + valueSize) > txRoom(frameLinks)))
+        {
+          message[countIndex] = batchCount;
+          sendFrame(frameLinks, message, index);
+          index = 0;
+          batchCount = 0;
+        }
+
+        if (batchCount == 0)
+        {
+          frameLinks = pairedLinks[event.thingIdx];
+
+          if (framedSize(headerSize() + 4 + valueSize) > txRoom(frameLinks))
+            break;
+
+          // The producer only ever adds to eventsDropped
+          dropped = eventsDropped;
+
+          index = writeHeader(message, ThingAdapterResponse::EVENTBATCH, index);
+          index = writeUInt8(message, dropped - eventsDroppedReported, index);
+          countIndex = index;
+          index = writeUInt8(message, 0, index);  // count, filled in on flush
+          eventsDroppedReported = dropped;
+        }
+
+        index = writeThingIdx(message, event.thingIdx, index);
+        index = writeUInt8(message, event.index, index);
+        if (options & OPTION_COMPACTNUMBER)
+          index = writeVarInt(message, value, index);
+        else
+          index = writeInt32BE(message, value, index);
+        batchCount++;
+
+        eventTail = (tail + 1) % THINGEVENTQUEUESIZE;
+      }
+
+      if (batchCount > 0)
+      {
+        message[countIndex] = batchCount;
+        sendFrame(frameLinks, message, index);
+      }
+    }
+    #endif
+
+
+    #if THINGMAXEVENTS || THINGMAXACTIONS
+    // Returns the index into list of the event/action index of thingIdx, or count if there is none.
+    static uint8_t interactionOf(const PackedSerialThingInteraction *list, uint8_t count, uint8_t thingIdx, uint8_t index)
+    {
+      for (uint8_t i = 0; i < count; i++)
+      {
+        if (list[i].thingIdx == thingIdx && list[i].index == index)
+          return i;
+      }
+
+      return count;
+    }
+    #endif
+
+
+    #if THINGMAXSUBSCRIPTIONS
+    // Add, change or (with all zero limits) remove the subscription for slot.
+    // Returns false if there is no room for a new subscription.
+    boolean subscribe(uint8_t slot, uint16_t minInterval, uint16_t maxInterval, int32_t deadband)
+    {
+      uint8_t i = slotSubscription[slot];
+
+      if (minInterval == 0 && maxInterval == 0 && deadband == 0)
+      {
+        if (i < THINGMAXSUBSCRIPTIONS)
+        {
+          // Move the last subscription into the hole
+          subscriptionCount--;
+          subscriptions[i] = subscriptions[subscriptionCount];
+          slotSubscription[subscriptions[i].slot] = i;
+          slotSubscription[slot] = THINGMAXSUBSCRIPTIONS;
+        }
+
+        return true;
+      }
+
+      if (i >= THINGMAXSUBSCRIPTIONS)
+      {
+        if (subscriptionCount >= THINGMAXSUBSCRIPTIONS)
+          return false;
+
+        i = subscriptionCount++;
+        slotSubscription[slot] = i;
+        subscriptions[i].slot = slot;
+        subscriptions[i].lastValue = 0;
+        subscriptions[i].lastSent = millis() - 0xffff;  // allow the first change right away
+      }
+
+      subscriptions[i].minInterval = minInterval;
+      subscriptions[i].maxInterval = maxInterval;
+      subscriptions[i].deadband = (deadband < 0) ? -deadband : deadband;
+
+      return true;
+    }
+
+
+    // Decide whether a dirty, subscribed property should be sent now.
+    // Changes inside minInterval stay dirty, so the latest value goes out once it has passed.
+    // Changes inside the deadband are dropped, unless the heartbeat is due.
+    boolean subscriptionDue(uint8_t slot, uint32_t now)
+    {
+      PackedSerialThingSubscription &sub = subscriptions[slotSubscription[slot]];
+      uint32_t elapsed = now - sub.lastSent;
+
+      if (elapsed < sub.minInterval)
+        return false;
+
+      if (slotType[slot] == NUMBER)
+      {
+        int32_t value = ((ThingPropertyNumber *)propertySlot[slot])->getValue();
+        int32_t difference = value - sub.lastValue;
+
+        if (difference < 0)
+          difference = -difference;
+
+        if (difference < sub.deadband && (sub.maxInterval == 0 || elapsed < sub.maxInterval))
+        {
+          propertySlot[slot]->changed = false;
+          clearDirty(slot);
+          return false;
+        }
+
+        sub.lastValue = value;
+      }
+
+      sub.lastSent = now;
+
+      return true;
+    }
+    #endif
+
+
+    // Build the flat thing/property tables used for lookups and change tracking.
+    // Slots are allocated in thing order, so a thing's properties are contiguous from
+    // thingSlotBase[thingIdx].  Things and properties past THINGMAXDEVICES/THINGMAXPROPERTIES
+    // are not indexed, and requests for them are answered with a NULLPTR error.
+    void buildIndex()
+    {
+      ThingDevice *thing = this->firstDevice;
+      uint8_t thingIdx = 0;
+
+      // Pending changes are marked again from the changed flags below
+      for (uint8_t slot = 0; slot < slotCount; slot++)
+      {
+        if (dirtyMap[slot >> 3] & (1 << (slot & 7)))
+          propertySlot[slot]->changed = true;
+      }
+
+      deviceCount = 0;
+      slotCount = 0;
+      scanCursor = 0;
+      #if THINGMAXSUBSCRIPTIONS
+      subscriptionCount = 0;
+      #endif
+      dirtyCount = 0;
+      memset(dirtyMap, 0, sizeof(dirtyMap));
+
+      while (thing != nullptr && thingIdx < THINGMAXDEVICES)
+      {
+        ThingProperty *property = thing->firstProperty;
+
+        deviceSlot[thingIdx] = thing;
+        deviceCount++;
+        thingSlotBase[thingIdx] = slotCount;
+
+        while (property != nullptr && slotCount < THINGMAXPROPERTIES)
+        {
+          propertySlot[slotCount] = property;
+          slotThing[slotCount] = thingIdx;
+          slotType[slotCount] = property->type;
+          #if THINGMAXSUBSCRIPTIONS
+          slotSubscription[slotCount] = THINGMAXSUBSCRIPTIONS;
+          #endif
+
+          if (property->changed)
+            markDirty(slotCount);
+
+          slotCount++;
+          property = property->next;
+        }
+
+        thing = thing->next;
+        thingIdx++;
+      }
+
+      // Things without room in the table get an empty slot range
+      for (; thingIdx < THINGMAXDEVICES; thingIdx++)
+        thingSlotBase[thingIdx] = slotCount;
+
+      #if THINGMAXEVENTS
+      for (uint8_t i = 0; i < eventCount; i++)
+        events[i].thingIdx = thingIndexOf(events[i].thing);
+      #endif
+
+      #if THINGMAXACTIONS
+      for (uint8_t i = 0; i < actionCount; i++)
+        actions[i].thingIdx = thingIndexOf(actions[i].thing);
+      #endif
+
+      #if THINGSTRINGPOOLSIZE
+      for (uint8_t i = 0; i < stringCount; i++)
+      {
+        uint8_t slot = 0;
+
+        while (slot < slotCount && propertySlot[slot] != strings[i].property)
+          slot++;
+
+        strings[i].slot = (slot < slotCount) ? slot : THINGMAXPROPERTIES;
+      }
+      #endif
+
+      #if THINGMAXPUBLISHED
+      // Only NUMBER and BOOLEAN properties can be published
+      for (uint8_t i = 0; i < publishedCount; i++)
+      {
+        uint8_t slot = 0;
+
+        while (slot < slotCount && propertySlot[slot] != publishedSlot[i].property)
+          slot++;
+
+        if (slot < slotCount && (slotType[slot] == NUMBER || slotType[slot] == BOOLEAN))
+          publishedSlot[i].slot = slot;
+        else
+          publishedSlot[i].slot = THINGMAXPROPERTIES;
+      }
+      #endif
+
+      computeFingerprint();
+    }
+
+
+    // Returns the thingIdx of thing, or THINGMAXDEVICES if it is not in the table.
+    uint8_t thingIndexOf(const ThingDevice *thing)
+    {
+      uint8_t thingIdx = 0;
+
+      while (thingIdx < deviceCount && deviceSlot[thingIdx] != thing)
+        thingIdx++;
+
+      return (thingIdx < deviceCount) ? thingIdx : THINGMAXDEVICES;
+    }
+
+
+    ThingDevice *lookupDevice(uint8_t thingIdx)
+    {
+      if (thingIdx < deviceCount)
+        return deviceSlot[thingIdx];
+      else
+        return nullptr;
+    }
+
+
+    // 32 bit FNV-1a over everything the gateway learns from the DEFINE* requests, except values.
+    // If the fingerprint in DETAILADAPTER matches one the gateway has cached, it can skip
+    // enumeration and go straight to PAIR.
+    void computeFingerprint()
+    {
+      uint32_t hash = 2166136261UL;
+
+      hash = fingerprintString(hash, this->name);
+      hash = fingerprintString(hash, this->description);
+      hash = fingerprintByte(hash, this->thingCount);
+
+      for (uint8_t thingIdx = 0; thingIdx < deviceCount; thingIdx++)
+      {
+        ThingDevice *thing = deviceSlot[thingIdx];
+
+        hash = fingerprintByte(hash, thing->type);
+        hash = fingerprintString(hash, thing->name);
+        hash = fingerprintString(hash, thing->description);
+        hash = fingerprintByte(hash, thing->propertyCount);
+        hash = fingerprintByte(hash, thing->eventCount);
+        hash = fingerprintByte(hash, thing->actionCount);
+      }
+
+      for (uint8_t slot = 0; slot < slotCount; slot++)
+      {
+        hash = fingerprintByte(hash, slotThing[slot]);
+        hash = fingerprintByte(hash, slotType[slot]);
+        hash = fingerprintString(hash, propertySlot[slot]->name);
+        hash = fingerprintString(hash, propertySlot[slot]->description);
+      }
+
+      #if THINGMAXEVENTS
+      for (uint8_t i = 0; i < eventCount; i++)
+      {
+        hash = fingerprintByte(hash, events[i].thingIdx);
+        hash = fingerprintString(hash, events[i].name);
+        hash = fingerprintString(hash, events[i].description);
+      }
+      #endif
+
+      #if THINGMAXACTIONS
+      for (uint8_t i = 0; i < actionCount; i++)
+      {
+        hash = fingerprintByte(hash, actions[i].thingIdx);
+        hash = fingerprintString(hash, actions[i].name);
+        hash = fingerprintString(hash, actions[i].description);
+      }
+      #endif
+
+      schemaFingerprint = hash;
+    }
+
+
+    static uint32_t fingerprintByte(uint32_t hash, uint8_t b)
+    {
+      return (hash ^ b) * 16777619UL;
+    }
+
+
+    // Hashes a name or description (from flash with THINGFLASHSTRINGS).
+    // Includes the terminator, so "ab","c" and "a","bc" differ
+    static uint32_t fingerprintString(uint32_t hash, const char *s)
+    {
+      char c;
+
+      do
+      {
+        #if THINGFLASHSTRINGS
+        c = pgm_read_byte(s++);
+        #else
+        c = *s++;
+        #endif
+        hash = fingerprintByte(hash, c);
+      } while (c != '\0');
+
+      return hash;
+    }
+
+
+    // Returns the slot for (thingIdx, propertyIdx), or THINGMAXPROPERTIES if it is not tracked.
+    uint8_t slotOf(uint8_t thingIdx, uint8_t propertyIdx)
+    {
+      if (thingIdx >= THINGMAXDEVICES)
+        return THINGMAXPROPERTIES;
+
+      uint8_t slot = thingSlotBase[thingIdx] + propertyIdx;
+
+      if (slot < slotCount && slotThing[slot] == thingIdx)
+        return slot;
+      else
+        return THINGMAXPROPERTIES;
+    }
+
+
+    // Returns false if the thing is unpaired: its changes stay in property->changed until PAIR.
+    // The generation moves when the slot becomes dirty, and with changedAgain, when the value of
+    // a slot that already is has changed again since (it may have been in a snapshot).  Without
+    // bump (a heartbeat, where the value hasn't changed) it never moves.
+    boolean markDirty(uint8_t slot, boolean changedAgain = false, boolean bump = true)
+    {
+      if (!deviceSlot[slotThing[slot]]->paired)
+        return false;
+
+      if (!(dirtyMap[slot >> 3] & (1 << (slot & 7))))
+      {
+        dirtyMap[slot >> 3] |= (1 << (slot & 7));
+        dirtyCount++;
+      }
+      else if (!changedAgain)
+      {
+        return true;
+      }
+
+      if (bump)
+        bumpGeneration(slotThing[slot]);
+      return true;
+    }
+
+
+    // Generations start at 1 and skip 0, so a gateway can always get a snapshot by asking with 0.
+    void bumpGeneration(uint8_t thingIdx)
+    {
+      if (++thingGeneration[thingIdx] == 0)
+        thingGeneration[thingIdx] = 1;
+
+      if (++adapterGeneration == 0)
+        adapterGeneration = 1;
+    }
+
+
+    // Write the value of the property in slot, identified by its cached type.
+    uint8_t writePropertyValue(uint8_t *buffer, uint8_t index, uint8_t slot)
+    {
+      ThingProperty *property = propertySlot[slot];
+
+      switch ((ThingPropertyDatatype) slotType[slot])
+      {
+        case BOOLEAN:
+          index = writeUInt8(buffer, ((ThingPropertyBoolean *)property)->getValue(), index);
+          break;
+        case NUMBER:
+          index = writeInt32BE(buffer, ((ThingPropertyNumber *)property)->getValue(), index);
+          break;
+        case STRING:
+          index = writeStringValue(buffer, ((ThingPropertyString *)property)->getValue(), stringLength(slot), index);
+          break;
+        default:
+          // TODO: invalid datatype
+          break;
+      }
+
+      return index;
+    }
+
+
+    // Write the value of the property in slot for a PropertyStatus pushed by update(), in the
+    // NUMBER encoding selected by the OPTION_COMPACTNUMBER/OPTION_DELTANUMBER options.  The
+    // delta reference only moves once the value is in the frame.
+    uint8_t writeStatusValue(uint8_t *buffer, uint8_t index, uint8_t slot)
+    {
+      if (slotType[slot] == NUMBER && (options & OPTION_COMPACTNUMBER))
+      {
+        int32_t value = ((ThingPropertyNumber *)propertySlot[slot])->getValue();
+
+        index = writeVarInt(buffer, numberForStatus(slot, value), index);
+        #if THINGDELTANUMBER
+        if (index != THINGFRAMEOVERFLOW)
+          lastNumber[slot] = value;
+        #endif
+
+        return index;
+      }
+      else
+      {
+        return writePropertyValue(buffer, index, slot);
+      }
+    }
+
+
+    // Write the value of the property in slot in answer to a request.  NUMBERs are zigzag
+    // varints with OPTION_COMPACTNUMBER, but never deltas, and leave the delta reference alone.
+    uint8_t writeReplyValue(uint8_t *buffer, uint8_t index, uint8_t slot)
+    {
+      if (slotType[slot] == NUMBER && (options & OPTION_COMPACTNUMBER))
+        return writeVarInt(buffer, ((ThingPropertyNumber *)propertySlot[slot])->getValue(), index);
+      else
+        return writePropertyValue(buffer, index, slot);
+    }
+
+
+    // Number of bytes writeStatusValue() will write for the property in slot.
+    uint8_t statusValueSize(uint8_t slot)
+    {
+      switch ((ThingPropertyDatatype) slotType[slot])
+      {
+        case BOOLEAN:
+          return 1;
+        case NUMBER:
+          if (options & OPTION_COMPACTNUMBER)
+            return varIntSize(numberForStatus(slot, ((ThingPropertyNumber *)propertySlot[slot])->getValue()));
+          else
+            return 4;
+        case STRING:
+          return stringLength(slot) + 1;
+        default:
+          return 0;
+      }
+    }
+
+
+    int32_t numberForStatus(uint8_t slot, int32_t value)
+    {
+      #if THINGDELTANUMBER
+      if (options & OPTION_DELTANUMBER)
+        return (int32_t) ((uint32_t) value - (uint32_t) lastNumber[slot]);
+      #else
+      (void) slot;
+      #endif
+
+      return value;
+    }
+
+
+    // Zigzag varint: small magnitudes, positive or negative, take a single byte.
+    static uint32_t zigzag(int32_t value)
+    {
+      return ((uint32_t) value << 1) ^ (uint32_t) (value >> 31);
+    }
+
+
+    static uint8_t writeVarInt(uint8_t *buffer, int32_t value, uint8_t index)
+    {
+      uint32_t v = zigzag(value);
+
+      if (index > THINGFRAMESIZE - varIntSize(value))
+        return THINGFRAMEOVERFLOW;
+
+      while (v >= 0x80)
+      {
+        buffer[index++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+      }
+      buffer[index++] = v;
+
+      return index;
+    }
+
+
+    static uint8_t varIntSize(int32_t value)
+    {
+      uint32_t v = zigzag(value);
+      uint8_t size = 1;
+
+      while (v >= 0x80)
+      {
+        v >>= 7;
+        size++;
+      }
+
+      return size;
+    }
+
+
+    // Standard bitrates we can offer the gateway.
+    static uint8_t bitrateCount()
+    {
+      return 7;
+    }
+
+
+    static uint32_t standardBitrate(uint8_t i)
+    {
+      static const uint32_t bitrates[] = { 115200, 230400, 250000, 460800, 500000, 921600, 1000000 };
+
+      return bitrates[i];
+    }
+
+
+    // A bitrate is supported if we have a way to switch to it, and it is a standard rate
+    // between where we started and the maximum given to begin().
+    boolean supportsBitrate(uint32_t bps)
+    {
+      if (bitrateHandler == nullptr || bps < THINGBITRATE || bps > maxBitrate)
+        return false;
+
+      for (uint8_t i = 0; i < bitrateCount(); i++)
+      {
+        if (standardBitrate(i) == bps)
+          return true;
+      }
+
+      return false;
+    }
+
+
+    // Send a frame built by the write*() helpers, or an error if it overflowed, to each link
+    // with its bit set in links.
+    void sendFrame(uint8_t links, const uint8_t *buffer, uint8_t len)
+    {
+      uint8_t overflowError[3];
+
+      if (len == THINGFRAMEOVERFLOW)
+      {
+        len = writeHeader(overflowError, ThingAdapterResponse::ERROR, 0);
+        len = writeUInt8(overflowError, PackedSerialThingAdapterError::ERROR_FRAME_OVERFLOW, len);
+        buffer = overflowError;
+      }
+
+      #if THINGTXQUEUESIZE
+      // Keep frames in order behind anything queued, and queue rather than wait for room.
+      // If the queue itself is full, there is nothing for it but to wait.
+      if (!txQueueEmpty() || framedSize(len) > txRoom(links))
+      {
+        if (enqueueFrame(links, buffer, len))
+          return;
+
+        drainTxQueue(true);
+      }
+      #endif
+
+      transmit(links, buffer, len);
+    }
+
+
+    void transmit(uint8_t links, const uint8_t *buffer, uint8_t len)
+    {
+      for (uint8_t link = 0; link < THINGMAXLINKS; link++)
+      {
+        if (!(links & (1 << link)))
+          continue;
+
+        #if THINGSTATS
+        stats.packetsOut++;
+        stats.bytesOut += len;
+        if (buffer[0] == ThingAdapterResponse::ERROR)
+        {
+          uint8_t code = buffer[(linkOptions(link) & OPTION_SEQUENCE) ? 2 : 1];
+          stats.errors[(code < THINGERRORCODES) ? code : 0]++;
+        }
+        #endif
+
+        #if THINGRELIABLEWINDOW
+        if (link == 0 && (serialOptions & OPTION_RELIABLE))
+        {
+          sendReliable(buffer, len);
+          continue;
+        }
+        #endif
+
+        linkConn(link).send(buffer, len);
+      }
+    }
+
+
+    #if THINGRELIABLEWINDOW
+    // Send a frame to the gateway followed by its sequence number and CRC, and keep it until
+    // it is acknowledged.  Frames wait in the TX queue for room in the window (see txRoom()),
+    // so it is only full here when the queue is too; then the oldest frame is given up on.
+    void sendReliable(const uint8_t *buffer, uint8_t len)
+    {
+      if ((uint8_t) (windowNext - windowBase) >= THINGRELIABLEWINDOW)
+      {
+        #if THINGSTATS
+        if (!(windowAcked & 1))
+          stats.abandoned++;
+        #endif
+        windowBase++;
+        windowAcked >>= 1;
+        windowResent >>= 1;
+        resendPending >>= 1;
+        retransmitStart = millis();
+      }
+
+      uint8_t *retainedFrame = retained[windowNext & (THINGRELIABLEWINDOW - 1)];
+      uint16_t crc;
+
+      memcpy(retainedFrame, buffer, len);
+      retainedFrame[len] = windowNext;
+      crc = crc16(retainedFrame, len + 1);
+      retainedFrame[len + 1] = crc >> 8;
+      retainedFrame[len + 2] = crc & 0xff;
+      retainedLength[windowNext & (THINGRELIABLEWINDOW - 1)] = len + 3;
+
+      if (windowNext == windowBase)
+        retransmitStart = millis();
+      windowNext++;
+
+      serialConn.send(retainedFrame, len + 3);
+    }
+
+
+    // Send the frames in resendPending again, oldest first, while the gateway's stream has room
+    // for them.  The rest wait for the next update().
+    void sendResends()
+    {
+      for (uint8_t i = 0; resendPending >> i; i++)
+      {
+        if (!(resendPending & (1 << i)))
+          continue;
+
+        uint8_t seq = windowBase + i;
+        uint16_t len = retainedLength[seq & (THINGRELIABLEWINDOW - 1)];
+
+        if (framedSize(len) > streamRoom(1))
+          return;
+
+        serialConn.send(retained[seq & (THINGRELIABLEWINDOW - 1)], len);
+        resendPending &= ~(1 << i);
+
+        #if THINGSTATS
+        stats.retransmits++;
+        #endif
+      }
+    }
+    #endif
+
+
+    // The options link has negotiated with SETOPTIONS (for a route, those passed on to it).
+    uint8_t &linkOptions(uint8_t link)
+    {
+      #if THINGMAXLINKS > 1
+      if (link != 0)
+        return links[link - 1].options;
+      #else
+      (void) link;
+      #endif
+
+      return serialOptions;
+    }
+
+
+    // Status messages and events are built once, for every link they go to, with the options
+    // of the links that have things paired.  optionsConflict() keeps those in agreement.
+    uint8_t pushOptions()
+    {
+      #if THINGMAXLINKS > 1
+      uint8_t paired = linksPaired();
+
+      for (uint8_t link = 0; link < linkCount; link++)
+      {
+        if (paired & (1 << link))
+          return linkOptions(link);
+      }
+      #endif
+
+      return serialOptions;
+    }
+
+
+    // Whether link, with opts, would need status messages and events built differently from
+    // another link that has things paired.  OPTION_RELIABLE is added as each frame is sent, so
+    // it doesn't count.
+    boolean optionsConflict(uint8_t link, uint8_t opts)
+    {
+      #if THINGMAXLINKS > 1
+      uint8_t paired = linksPaired() & ~(1 << link);
+
+      for (uint8_t other = 0; other < linkCount; other++)
+      {
+        if ((paired & (1 << other)) && ((linkOptions(other) ^ opts) & ~OPTION_RELIABLE))
+          return true;
+      }
+      #else
+      (void) link;
+      (void) opts;
+      #endif
+
+      return false;
+    }
+
+
+    #if THINGMAXLINKS > 1
+    // Bit per link with any thing paired, ours or behind a route.
+    uint8_t linksPaired()
+    {
+      uint8_t paired = 0;
+
+      for (uint8_t thingIdx = 0; thingIdx < deviceCount; thingIdx++)
+        paired |= pairedLinks[thingIdx];
+
+      for (uint8_t i = 0; i < routedCount; i++)
+        paired |= routedPairedLinks[i];
+
+      return paired;
+    }
+    #endif
+
+
+    PackedSerial &linkConn(uint8_t link)
+    {
+      #if THINGMAXLINKS > 1
+      if (link != 0)
+        return links[link - 1].conn;
+      #else
+      (void) link;
+      #endif
+
+      return serialConn;
+    }
+
+
+    Stream *linkStream(uint8_t link)
+    {
+      #if THINGMAXLINKS > 1
+      if (link != 0)
+        return links[link - 1].stream;
+      #else
+      (void) link;
+      #endif
+
+      return serialStream;
+    }
+
+
+    // Bytes a frame of len bytes takes on the wire, allowing for PackedSerial's framing.
+    static uint16_t framedSize(uint16_t len)
+    {
+      return len + (len / 254) + 2;
+    }
+
+
+    // Wait for whatever is in link's transmit buffer already (a boot banner, say) to go out, so
+    // what availableForWrite() says now is the room in an empty buffer.  See streamRoom().
+    void measureTxBuffer(uint8_t link)
+    {
+      #if THINGTXQUEUESIZE
+      linkStream(link)->flush();
+      txRoomMax[link] = linkStream(link)->availableForWrite();
+      #else
+      (void) link;
+      #endif
+    }
+
+
+    // Room for a new frame to links: the room in their streams, less what the window needs.
+    uint16_t txRoom(uint8_t links)
+    {
+      uint16_t room = streamRoom(links);
+
+      #if THINGRELIABLEWINDOW
+      // A frame to the gateway also needs a place in the window, and 3 bytes for its trailer.
+      // Frames waiting to be sent again go first.
+      if ((links & 1) && (serialOptions & OPTION_RELIABLE))
+      {
+        if ((uint8_t) (windowNext - windowBase) >= THINGRELIABLEWINDOW || resendPending != 0 || room < 3)
+          room = 0;
+        else
+          room -= 3;
+      }
+      #endif
+
+      return room;
+    }
+
+
+    // Room in the transmit buffers of the streams of links (the least of them).
+    uint16_t streamRoom(uint8_t links)
+    {
+      uint16_t room = 0xffff;
+
+      #if THINGTXQUEUESIZE
+      for (uint8_t link = 0; link < THINGMAXLINKS; link++)
+      {
+        if (links & (1 << link))
+        {
+          uint16_t available = linkStream(link)->availableForWrite();
+
+          // An empty transmit buffer takes a frame of any size (the write waits for the rest),
+          // so a frame bigger than the buffer can't hold up the queue, or update(), for good
+          if (available >= txRoomMax[link])
+          {
+            txRoomMax[link] = available;
+            available = 0xffff;
+          }
+
+          if (available < room)
+            room = available;
+        }
+      }
+      #else
+      (void) links;
+      #endif
+
+      return room;
+    }
+
+
+    boolean txQueueEmpty()
+    {
+      #if THINGTXQUEUESIZE
+      return txCount == 0;
+      #else
+      return true;
+      #endif
+    }
+
+
+    #if THINGTXQUEUESIZE
+    // The queue holds frames as a length byte and the links still to send to, followed by the
+    // frame.  Frames are never split across the end of the buffer, so they can be sent straight
+    // from it; a length of 0 (or reaching the end) means the next frame is at the start.
+    boolean enqueueFrame(uint8_t links, const uint8_t *buffer, uint8_t len)
+    {
+      uint16_t need = len + 2;
+
+      if (txCount == 0)
+      {
+        txHead = 0;
+        txTail = 0;
+      }
+
+      if (txHead >= txTail)
+      {
+        if (txHead + need > THINGTXQUEUESIZE)
+        {
+          // Wrap to the start, leaving a gap so txHead never catches up to txTail
+          if (need >= txTail)
+            return false;
+
+          if (txHead < THINGTXQUEUESIZE)
+            txQueue[txHead] = 0;
+          txHead = 0;
+        }
+      }
+      else if (txHead + need >= txTail)
+      {
+        return false;
+      }
+
+      txQueue[txHead] = len;
+      txQueue[txHead + 1] = links;
+      memcpy(&txQueue[txHead + 2], buffer, len);
+      txHead += need;
+      txCount++;
+
+      return true;
+    }
+    #endif
+
+
+    // Send queued frames while the streams have room for them (or regardless, if block is set).
+    // A frame is sent to each of its links as soon as that link has room, and leaves the queue
+    // once every link has had it.
+    void drainTxQueue(boolean block)
+    {
+      #if THINGTXQUEUESIZE
+      while (txCount > 0)
+      {
+        if (txTail >= THINGTXQUEUESIZE || txQueue[txTail] == 0)
+          txTail = 0;
+
+        uint8_t len = txQueue[txTail];
+        uint8_t &pending = txQueue[txTail + 1];
+
+        for (uint8_t link = 0; link < THINGMAXLINKS; link++)
+        {
+          if ((pending & (1 << link)) && (block || framedSize(len) <= txRoom(1 << link)))
+          {
+            transmit(1 << link, &txQueue[txTail + 2], len);
+            pending &= ~(1 << link);
+          }
+        }
+
+        if (pending != 0)
+          break;
+
+        txTail += len + 2;
+        txCount--;
+      }
+      #else
+      (void) block;
+      #endif
+    }
+
+
+    // Write a frame's type, followed by its sequence id when OPTION_SEQUENCE is set.  The id is
+    // the one from the request being answered, or 0 for messages pushed by update().
+    uint8_t writeHeader(uint8_t *buffer, uint8_t type, uint8_t index)
+    {
+      index = writeUInt8(buffer, type, index);
+
+      if (options & OPTION_SEQUENCE)
+        index = writeUInt8(buffer, sequence, index);
+
+      return index;
+    }
+
+
+    uint8_t headerSize()
+    {
+      return (options & OPTION_SEQUENCE) ? 2 : 1;
+    }
+
+
+    // Bounded frame writers.  Like SimplePack's, these return the index after the value written,
+    // but a value that doesn't fit in THINGFRAMESIZE returns THINGFRAMEOVERFLOW instead, and
+    // every write after that is dropped.
+    static uint8_t writeUInt8(uint8_t *buffer, uint8_t value, uint8_t index)
+    {
+      if (index >= THINGFRAMESIZE)
+        return THINGFRAMEOVERFLOW;
+
+      buffer[index] = value;
+
+      return index + 1;
+    }
+
+
+    // A thingIdx as the gateway numbers it (see setThingOffset()).
+    uint8_t writeThingIdx(uint8_t *buffer, uint8_t thingIdx, uint8_t index)
+    {
+      return writeUInt8(buffer, thingIdx + thingOffset, index);
+    }
+
+
+    static uint8_t writeUInt16BE(uint8_t *buffer, uint16_t value, uint8_t index)
+    {
+      index = writeUInt8(buffer, value >> 8, index);
+
+      return writeUInt8(buffer, value & 0xff, index);
+    }
+
+
+    static uint8_t writeInt32BE(uint8_t *buffer, int32_t value, uint8_t index)
+    {
+      if (index > THINGFRAMESIZE - 4)
+        return THINGFRAMEOVERFLOW;
+
+      return SimplePack::writeInt32BE(buffer, value, index);
+    }
+
+
+    static uint8_t writeString(uint8_t *buffer, const char *value, uint8_t index)
+    {
+      size_t len = strlen(value) + 1;
+
+      if (index > THINGFRAMESIZE || len > (size_t) (THINGFRAMESIZE - index))
+        return THINGFRAMEOVERFLOW;
+
+      memcpy(buffer + index, value, len);
+
+      return index + len;
+    }
+
+
+    // Like writeString(), for a value whose length is already known.
+    static uint8_t writeStringValue(uint8_t *buffer, const char *value, uint8_t length, uint8_t index)
+    {
+      if (index > THINGFRAMESIZE || (size_t) length + 1 > (size_t) (THINGFRAMESIZE - index))
+        return THINGFRAMEOVERFLOW;
+
+      memcpy(buffer + index, value, length + 1);
+
+      return index + length + 1;
+    }
+
+
+    // Names and descriptions go through here, so with THINGFLASHSTRINGS they are copied
+    // straight from flash into the frame.
+    static uint8_t writeDescriptor(uint8_t *buffer, const char *value, uint8_t index)
+    {
+      #if THINGFLASHSTRINGS
+      size_t len = strlen_P(value) + 1;
+
+      if (index > THINGFRAMESIZE || len > (size_t) (THINGFRAMESIZE - index))
+        return THINGFRAMEOVERFLOW;
+
+      memcpy_P(buffer + index, value, len);
+
+      return index + len;
+      #else
+      return writeString(buffer, value, index);
+      #endif
+    }
+
+
+    void clearDirty(uint8_t slot)
+    {
+      if (slot < slotCount && (dirtyMap[slot >> 3] & (1 << (slot & 7))))
+      {
+        dirtyMap[slot >> 3] &= ~(1 << (slot & 7));
+        dirtyCount--;
+      }
+    }
+
+
+    PackedSerial serialConn;
+    Stream *serialStream;
+    #if THINGMAXLINKS > 1
+    Link links[THINGMAXLINKS - 1];  // links 1 and up
+    uint8_t linkCount;
+    uint8_t routedPairedLinks[THINGMAXROUTEDDEVICES];  // bit per link each routed thing is paired on
+    uint8_t routedCount;
+    RoutePending routePending[THINGROUTEPENDING];  // oldest first
+    uint8_t routePendingCount;
+    #endif
+    uint8_t gatewayLinks;  // bit per link that talks to a gateway, rather than a route
+    uint8_t thingOffset;
+    #if THINGTXQUEUESIZE
+    uint8_t txQueue[THINGTXQUEUESIZE];
+    uint16_t txHead;
+    uint16_t txTail;
+    uint8_t txCount;
+    uint16_t txRoomMax[THINGMAXLINKS];  // most availableForWrite() seen, i.e. an empty buffer
+    #endif
+    boolean connected;
+    uint8_t serialOptions;  // link 0's; other links keep theirs in Link
+    uint8_t options;  // of the link being answered, or for status messages and events (see pushOptions())
+    uint8_t nextOptions;  // options to use once the request being answered is done
+    uint8_t sequence;  // of the request being answered
+    uint8_t frame[THINGFRAMESIZE];  // every outgoing frame is built here
+    #if THINGSTATS
+    PackedSerialThingAdapterStats stats;
+    #endif
+    #if THINGRELIABLEWINDOW
+    uint8_t retained[THINGRELIABLEWINDOW][THINGFRAMESIZE + 3];  // by sequence number, with trailer
+    uint16_t retainedLength[THINGRELIABLEWINDOW];  // up to THINGFRAMESIZE + 3
+    uint8_t windowBase;   // oldest frame not yet acknowledged
+    uint8_t windowNext;   // sequence number of the next frame
+    uint8_t windowAcked;  // bit i set if windowBase + i has been selectively acknowledged
+    uint8_t windowResent;  // bit i set if windowBase + i has been sent again since the last timeout
+    uint8_t resendPending;  // bit i set if windowBase + i is waiting for room to be sent again
+    uint32_t retransmitStart;
+    #endif
+    uint32_t schemaFingerprint;
+    ThingBitrateHandler bitrateHandler;
+    uint32_t bitrate;
+    uint32_t maxBitrate;
+    uint32_t pendingBitrate;
+    uint32_t previousBitrate;
+    uint32_t bitrateProbeStart;
+    boolean bitrateProbing;
+    ThingWakeHandler wakeHandler;
+
+    ThingDevice *deviceSlot[THINGMAXDEVICES];
+    uint8_t pairedLinks[THINGMAXDEVICES];  // bit per link the thing is paired on
+    uint8_t deviceCount;
+    ThingProperty *propertySlot[THINGMAXPROPERTIES];
+    uint8_t slotThing[THINGMAXPROPERTIES];
+    uint8_t slotType[THINGMAXPROPERTIES];
+    uint8_t thingSlotBase[THINGMAXDEVICES];
+    uint8_t slotCount;
+    uint8_t dirtyMap[(THINGMAXPROPERTIES + 7) / 8];
+    uint8_t dirtyCount;
+    uint8_t scanCursor;  // slot sendChanges() starts from
+    uint8_t updateMaxMessages;
+    uint16_t updateMaxMicros;
+    uint32_t updateStart;
+    #if THINGDELTANUMBER
+    int32_t lastNumber[THINGMAXPROPERTIES];  // last NUMBER value sent, for OPTION_DELTANUMBER
+    #endif
+
+    #if THINGMAXSUBSCRIPTIONS
+    uint8_t slotSubscription[THINGMAXPROPERTIES];  // index into subscriptions, THINGMAXSUBSCRIPTIONS for none
+    PackedSerialThingSubscription subscriptions[THINGMAXSUBSCRIPTIONS];
+    uint8_t subscriptionCount;
+    #endif
+
+    #if THINGMAXEVENTS
+    PackedSerialThingInteraction events[THINGMAXEVENTS];
+    uint8_t eventCount;
+
+    // Written by postEvent() (eventHead, eventsDropped) and read by update() (eventTail,
+    // eventsDroppedReported), so each index has a single writer.
+    volatile uint8_t eventQueueEvent[THINGEVENTQUEUESIZE];
+    volatile int32_t eventQueueValue[THINGEVENTQUEUESIZE];
+    volatile uint8_t eventHead;
+    volatile uint8_t eventTail;
+    volatile uint8_t eventsDropped;
+    uint8_t eventsDroppedReported;
+    #endif
+
+    #if THINGMAXACTIONS
+    PackedSerialThingInteraction actions[THINGMAXACTIONS];
+    uint8_t actionCount;
+
+    struct PackedSerialThingActionRecord
+    {
+      uint8_t action;
+      uint8_t link;
+      uint8_t sequence;
+      int32_t input;
+    };
+    PackedSerialThingActionRecord actionQueue[THINGACTIONQUEUESIZE];
+    uint8_t actionHead;
+    uint8_t actionTail;
+    #endif
+
+    #if THINGMAXPUBLISHED
+    PackedSerialThingPublished publishedSlot[THINGMAXPUBLISHED];
+    uint8_t publishedCount;
+    volatile boolean publishPending;  // set by every publish(), cleared by collectPublished()
+    #endif
+
+    #if THINGSTRINGPOOLSIZE
+    PackedSerialThingString strings[THINGMAXSTRINGS];
+    uint8_t stringCount;
+    char stringPool[THINGSTRINGPOOLSIZE];
+    uint16_t stringPoolUsed;
+    #endif
+
+    uint16_t thingGeneration[THINGMAXDEVICES];  // bumped on every change, see GETSNAPSHOT
+    uint16_t adapterGeneration;
+    // uint32_t lastCommunication; // TODO: might need this to be a unix timestamp
+};
+
+
+/*
+||
+|| @author         Brett Hagman <bhagman@roguerobotics.com>
+|| @url            http://roguerobotics.com/
 || @url            http://oryng.org/
 || @contribution   James Hobin <github:hobinjk>
 || @contribution   Alexander Brevig <https://alexanderbrevig.com/>
@@ -583,6 +3976,15 @@ class PackedSerialThingAdapter : public ThingAdapter, public IPacketReceiver
 || |  DEFINEACTIONBYIDX   = 0x04,
 || |  SETPROPERTY         = 0x05,
 || |  GETPROPERTY         = 0x06,
+|| |  SETOPTIONS          = 0x07,
+|| |  DEFINEBITRATES      = 0x08,
+|| |  SETBITRATE          = 0x09,
+|| |  DEFINEALL           = 0x0a,
+|| |  GETSTATS            = 0x0b, (THINGSTATS only)
+|| |  SUBSCRIBE           = 0x0c,
+|| |  INVOKEACTION        = 0x0d,
+|| |  GETSNAPSHOT         = 0x0e,
+|| |  LINKACK             = 0xfc, (THINGRELIABLEWINDOW only)
 || |  PAIR                = 0xfd,
 || |  UNPAIR              = 0xfe
 || |
@@ -593,6 +3995,17 @@ class PackedSerialThingAdapter : public ThingAdapter, public IPacketReceiver
 || |  DETAILEVENTBYIDX    = 0x03,
 || |  DETAILACTIONBYIDX   = 0x04,
 || |  PROPERTYSTATUS      = 0x05,
+|| |  PROPERTYSTATUSBATCH = 0x06,
+|| |  OPTIONS             = 0x07,
+|| |  DETAILBITRATES      = 0x08,
+|| |  BITRATE             = 0x09,
+|| |  DETAILCOMPLETE      = 0x0a,
+|| |  STATS               = 0x0b,
+|| |  SUBSCRIBED          = 0x0c,
+|| |  ACTIONSTATUS        = 0x0d,
+|| |  EVENTBATCH          = 0x0e,
+|| |  SNAPSHOT            = 0x0f,
+|| |  SNAPSHOTUNCHANGED   = 0x10,
 || |  PAIRED              = 0xfd,
 || |  UNPAIRED            = 0xfe,
 || |  ERROR               = 0xff
@@ -609,13 +4022,208 @@ class PackedSerialThingAdapter : public ThingAdapter, public IPacketReceiver
 || | http://ithare.com/modified-harvard-architecture-clarifying-confusion/#comment-3195
 || | https://www.avrfreaks.net/forum/avr-g-lacks-flash
 || |
+|| | So instead of tagging each string, define THINGFLASHSTRINGS as 1 and put every name and
+|| | description (adapter, things, properties, events and actions) in flash.  They are then
+|| | read with pgm_read_byte()/memcpy_P() straight into the frame being built, and none of them
+|| | take up RAM.  String property values stay in RAM.
+|| |
+|| |   #define THINGFLASHSTRINGS 1
+|| |   #include <PackedSerialThingAdapter.h>
+|| |
+|| |   const char ledName[] PROGMEM = "LED";
+|| |   const char ledDescription[] PROGMEM = "Twinkly LED";
+|| |   ThingDevice ledThing = ThingDevice(ledName, ledDescription, ONOFFLIGHT);
+|| |
+|| | RE: Request handling
+|| | onPacketReceive() looks each request up in the table in lookupRequest(), which gives the
+|| | number of bytes the request needs and which of thingIdx/propertyIdx it starts with.
+|| | Requests that are too short, or unknown, are answered with ERROR_REQUEST_INVALID, and bad
+|| | indexes with the matching error, before the handler is called.  Handlers only need to
+|| | check variable length values (see readNumber() and readStringValue()).  To add a request,
+|| | add it to ThingAdapterRequest, write a handle*() method, and give it an entry in the table.
+|| |
+|| | RE: Change tracking and lookups
+|| | begin() builds flat tables of all things (up to THINGMAXDEVICES) and properties (up to
+|| | THINGMAXPROPERTIES), so requests resolve thingIdx/propertyIdx without walking the lists.
+|| | update() only visits properties marked in a dirty bitmap.  Mark a property with adapter.setChanged(), or
+|| | leave THINGCHANGESCAN enabled to have update() sweep the "changed" flags set by setValue().
+|| | Things and properties must be added before begin().
+|| |
+|| | RE: Bounding update()
+|| | By default update() sends every change it has room for.  With many properties changing at
+|| | once, that can take longer than a sketch's loop() can spare, so setUpdateBudget(messages,
+|| | micros) caps the PropertyStatus messages (or time) per call.  The scan is round-robin: the
+|| | next update() starts at the first property left unsent, so a busy property near the start
+|| | of the table can't starve the rest.
+|| |
+|| | RE: Sleeping between updates
+|| | update() is cheap when there is nothing to do, but on a battery powered board even that
+|| | keeps the CPU awake.  Instead, sleep whenever hasPendingWork() is false, for no longer than
+|| | millisUntilDue(), and let an interrupt end the sleep early: the serial port's receive
+|| | interrupt for requests, and for the sketch's own changes, the handler given to
+|| | setWakeHandler().  AdapterBenchmark measures the duty cycle and wake latency of this.
+|| | Report changes with setChanged() and define THINGCHANGESCAN 0: with the sweep on,
+|| | hasPendingWork() has to look at every property's changed flag on each call.
+|| |
+|| |   if (adapter.hasPendingWork())
+|| |     adapter.update();
+|| |   else
+|| |     sleepFor(adapter.millisUntilDue());  // until due, or an interrupt
+|| |
+|| | RE: Bitrate negotiation
+|| | The link always starts at THINGBITRATE.  begin(1000000) lets the gateway switch us up to
+|| | 1000000 bps: it asks for the supported rates with DEFINEBITRATES, picks one with SETBITRATE,
+|| | and switches its own port once the BITRATE response arrives.  The first request we answer
+|| | at the new rate confirms it; otherwise we fall back after THINGBITRATETIMEOUT ms.
+|| | For begin(Stream &), provide a way to switch rates with setBitrateHandler().
+|| |
+|| | RE: Compact NUMBER values
+|| | With OPTION_COMPACTNUMBER, NUMBER values in PROPERTYSTATUS(BATCH) and SETPROPERTY are sent as
+|| | zigzag varints (1 byte for -64..63) instead of 4 bytes.  Adding OPTION_DELTANUMBER makes each
+|| | NUMBER in a PROPERTYSTATUS(BATCH) pushed by update() the difference from the last value
+|| | pushed for that property, which both sides reset to 0 on SETOPTIONS; it is only offered
+|| | with THINGDELTANUMBER defined as 1.  Answers to GETPROPERTY
+|| | and SETPROPERTY (tagged with their sequence id under OPTION_SEQUENCE) and SNAPSHOTs carry
+|| | the value itself, and don't move the reference.  DETAILPROPERTYBYIDX values are always 4
+|| | bytes.
+|| |
+|| | RE: Transmit queue
+|| | By default every frame is written to the stream as it is built, and update() waits whenever
+|| | the stream's transmit buffer is full.  Define THINGTXQUEUESIZE (e.g. 128) to have responses
+|| | wait in a queue instead, drained as availableForWrite() allows.  PropertyStatus messages are
+|| | only built once the queue is empty and the stream has room, so a property that keeps changing
+|| | only ever has its latest value waiting, and never grows the queue.  One that doesn't fit is
+|| | passed over for now (and goes first next time) while smaller ones that do fit are sent.  A
+|| | frame only has to fit once the stream's buffer is empty (as much room as availableForWrite()
+|| | gave when begin() or addLink() flushed the stream, or the most it has given since); then it
+|| | is written whatever its size, so frames bigger than the buffer (a long STRING on AVR's 63
+|| | bytes) wait for it to drain, but not forever.
+|| |
+|| | RE: Subscriptions
+|| | By default every change is sent as soon as update() sees it.  With SUBSCRIBE, the gateway can
+|| | instead ask for at most one PropertyStatus per minInterval (changes in between are coalesced
+|| | into the latest value), a heartbeat every maxInterval, and for NUMBER properties, to skip
+|| | changes smaller than a deadband.  Up to THINGMAXSUBSCRIPTIONS properties can be subscribed;
+|| | it is 0 by default, which leaves subscriptions out.
+|| |
+|| | RE: Events and actions
+|| | Register events with addEvent() and actions with addAction() before begin().  The gateway
+|| | finds them with DEFINEEVENTBYIDX/DEFINEACTIONBYIDX (or DEFINEALL).  postEvent() only copies
+|| | the event into a queue of THINGEVENTQUEUESIZE, so it can be called from an interrupt handler;
+|| | update() sends everything queued in EVENTBATCH frames, along with a count of events dropped
+|| | because the queue was full.  INVOKEACTION is answered with ACTION_QUEUED straight away, and
+|| | the action's handler runs later in update(), followed by an ACTION_COMPLETED ActionStatus.
+|| | Both are left out unless THINGMAXEVENTS/THINGMAXACTIONS are defined before the #include.
+|| |
+|| | RE: Properties set from interrupt handlers
+|| | A NUMBER is more than one byte on most boards, so a value set from an interrupt handler
+|| | while update() is sending it can go out half old and half new.  Register such properties
+|| | with addPublished() and set them with publish() instead of setValue().  publish() writes to
+|| | a copy guarded by a sequence count (a seqlock), and update() copies it into the property,
+|| | retrying if a publish() got in the way.  The interrupt handler never waits, and the last
+|| | value published is always sent.  This relies on a single core; on multi-core boards,
+|| | publish() and update() must run on the same core.  Define THINGMAXPUBLISHED to use it.
+|| |
+|| | RE: String properties
+|| | A SetProperty for a STRING property is written straight over its current value, so give
+|| | it room first with addStringStorage(property, capacity), which takes capacity + 2 bytes of
+|| | the THINGSTRINGPOOLSIZE pool.  Values too long for the storage, or not terminated within
+|| | the request, are refused with ERROR_VALUE_INVALID.  Without storage, a new value can be no
+|| | longer than the current one.  Change the value from the sketch with adapter.setString(),
+|| | which keeps the stored length up to date so status messages don't need strlen().  A value
+|| | set with property.setValue() instead is sent as it is (with strlen()), and SetProperty
+|| | treats the property as having no storage until setString() is used again.  The pool
+|| | (THINGSTRINGPOOLSIZE) is 0 by default, which leaves storage out.
+|| |
+|| | RE: Snapshots
+|| | GETSNAPSHOT returns every property value of a thing (or of every paired thing) in one frame,
+|| | instead of a GETPROPERTY round trip per property.  Each thing has a generation, bumped on
+|| | every change, and the adapter has one bumped on any change or PAIR/UNPAIR.  The gateway
+|| | passes the generation it last saw, and gets a 4 byte SNAPSHOTUNCHANGED if nothing changed.
+|| |
+|| | RE: Sequence ids
+|| | With OPTION_SEQUENCE, every request has a sequence id byte after its type, and every
+|| | response carries the id of the request it answers after its type (DEFINEALL tags all of its
+|| | frames).  Frames pushed by update() carry 0, so the gateway should number its requests
+|| | 1-255.  The gateway can then keep several requests in flight and match up the responses.
+|| |
+|| | RE: Performance counters
+|| | Define THINGSTATS as 1 to count packets and bytes in and out, errors sent by code, status
+|| | messages pushed, and update()/onPacketReceive() times.  The gateway reads them with GETSTATS,
+|| | and the sketch with getStats().  With THINGSTATS 0 (the default) none of this is compiled in.
+|| |
+|| | RE: Schema fingerprint
+|| | DETAILADAPTER ends with a hash of the names, descriptions, types and counts of the adapter,
+|| | its things and their properties, computed once in begin().  A gateway that has the schema
+|| | for that fingerprint cached can skip the DEFINE* requests after a reconnect.  A fingerprint
+|| | of 0 means the schema can't be cached.
+|| |
+|| | RE: Several links
+|| | Define THINGMAXLINKS above 1 to serve more streams than the one given to begin().
+|| | addLink(Serial1) serves another gateway (or the same one over a second port).  Each link
+|| | pairs things for itself, and only gets status messages and events for the things it has
+|| | paired; a single scan of the changes builds each frame once, for all the links it goes to.
+|| | Responses only go back to the link that asked, and an action's ACTION_COMPLETED to the link
+|| | that invoked it.  Each link negotiates its own options with SETOPTIONS, and its requests
+|| | and their responses use them.  Status messages and events, though, are built once for all
+|| | the links they go to, so links with things paired must agree: a SETOPTIONS (other than for
+|| | OPTION_RELIABLE) that differs from the options of another link with things paired, or a
+|| | PAIR from a link whose options differ, gets ERROR_OPTIONS_CONFLICT.  OPTION_DELTANUMBER is
+|| | refused with more than one gateway link, and subscriptions are shared.  Only the stream
+|| | given to begin() can change bitrate.  With THINGTXQUEUESIZE, a frame leaves the queue once
+|| | every link it is for has had room for it, so a stalled link holds up the rest.
+|| |
+|| | RE: Router mode
+|| | addRoute(Serial2, first, count) hands things first to first + count - 1 to the board on
+|| | Serial2, which calls setThingOffset(first) so its frames already carry the gateway's
+|| | numbering.  Requests for those things are passed on as they are, and the options of every
+|| | SETOPTIONS accepted (less OPTION_RELIABLE) are passed on too; a request for a routed thing
+|| | from a link with other options gets ERROR_OPTIONS_CONFLICT, as the reply couldn't be read
+|| | there.  The board answers requests in order, so each reply goes back to the link that
+|| | asked (up to THINGROUTEPENDING requests can be waiting).  Pairing is kept for each gateway
+|| | link here (for up to THINGMAXROUTEDDEVICES things behind routes): an UNPAIR from one link
+|| | is answered here while another still has the thing paired, and status and events from the
+|| | board only go to links that have paired the thing (for a batch, any of the route's things).
+|| | DETAILADAPTER counts the things behind routes, but DEFINEALL and GETSNAPSHOT for 0xff only
+|| | cover our own, so the gateway defines routed things with DEFINETHINGBYIDX and friends, and
+|| | the schema fingerprint is 0 (don't cache) once there are routes.  See SerialRouter.
+|| |
+|| | RE: Reliable delivery
+|| | Define THINGRELIABLEWINDOW (1, 2, 4 or 8) to let the gateway turn on OPTION_RELIABLE, for
+|| | lines noisy enough that PackedSerial's framing isn't enough.  It takes effect after the
+|| | OPTIONS response.  Every request then ends with a CRC-16/CCITT-FALSE (big endian) of the
+|| | rest, and is dropped if it doesn't match; the gateway's own timeout sends it again.  Every
+|| | frame we send ends with a sequence number (counting from 0 when the option is turned on)
+|| | and a CRC of everything before it, and is kept until the gateway acknowledges it with
+|| |
+|| |   [LINKACK][(seq id)][next][received]
+|| |
+|| | where next is the first sequence number not yet received, and bit i of received is set
+|| | if next + 1 + i was.  Frames missing from below one that was received are sent again at
+|| | once, and all unacknowledged frames after THINGRELIABLETIMEOUT ms without progress, so
+|| | the gateway drops duplicates by sequence number.  A missing frame is sent again once per
+|| | timeout at most, however many LINKACKs report it, and only as the stream has room for
+|| | it: what doesn't fit goes ahead of new frames on the next update().  It needs
+|| | THINGTXQUEUESIZE: frames, responses included, wait in the TX queue for room in the
+|| | window, and only when the queue itself is full does a frame push out the oldest, which is
+|| | counted as abandoned.  Only the stream given to begin() does this; routes and other links
+|| | are unaffected.  See GatewayLoad (--reliable).
+|| |
+|| | RE: Host build
+|| | extras/host builds the adapter, the tests and every example for the machine you develop
+|| | on, against stand-in Arduino.h, Thing.h and PackedSerial.h headers in extras/host/stubs:
+|| |
+|| |   cmake -S extras/host -B build && cmake --build build && ctest --test-dir build
+|| |
+|| | Each file in extras/host/tests builds the adapter with its own THING* options.  The
+|| | examples run as programs (build/AdapterBenchmark is the benchmark suite), with loop()
+|| | called for HOSTRUNMS ms (from the environment) after setup().  build/GatewayLoad is the
+|| | load generator: see the notes in extras/host/tools/GatewayLoad.cpp.
+|| |
 || #
 ||
 || @todo
 || |
-|| | Set bitrate to common value on startup, then allow adapter to announce/negotiate speed change.
-|| | (e.g. .begin(1000000) -- would allow adapter to switch up to 1000000 bps after initial communication)
-|| | Bitrate is currently fixed to 115200.
 || #
 ||
 || @license Please see LICENSE.